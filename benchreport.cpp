@@ -0,0 +1,315 @@
+#include "benchreport.h"
+#include "worker.h"
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * JsonString --
+ *
+ *      Quotes and escapes a string for JSON output.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static std::string JsonString(const std::string &s)
+{
+    std::string out("\"");
+    for (size_t i = 0; i < s.size(); ++i) {
+       unsigned char c = (unsigned char)s[i];
+       switch (c) {
+       case '"':  out += "\\\""; break;
+       case '\\': out += "\\\\"; break;
+       case '\n': out += "\\n"; break;
+       case '\r': out += "\\r"; break;
+       case '\t': out += "\\t"; break;
+       default:
+          if (c < 0x20) {
+             char hex[8];
+             sprintf(hex, "\\u%04x", c);
+             out += hex;
+          } else {
+             out += (char)c;
+          }
+       }
+    }
+    out += "\"";
+    return out;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CsvString --
+ *
+ *      Quotes a CSV field if it contains separators or quotes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static std::string CsvString(const std::string &s)
+{
+    if (s.find_first_of(",\"\r\n") == std::string::npos) {
+       return s;
+    }
+    std::string out("\"");
+    for (size_t i = 0; i < s.size(); ++i) {
+       if (s[i] == '"') {
+          out += '"';
+       }
+       out += s[i];
+    }
+    out += "\"";
+    return out;
+}
+
+static double MBytesPerSec(const BenchReport::Sample &s)
+{
+    uint64 elapsed = s.end > s.start ? s.end - s.start : 1;
+    return ((double)VIXDISKLIB_SECTOR_SIZE * s.sectors * 1000000) /
+           ((double)(1024 * 1024) * elapsed);
+}
+
+void BenchReport::setConfig(const std::string &key, const std::string &value)
+{
+    for (size_t i = 0; i < m_config.size(); ++i) {
+       if (m_config[i].first == key) {
+          m_config[i].second = value;
+          return;
+       }
+    }
+    m_config.push_back(std::make_pair(key, value));
+}
+
+void BenchReport::setConfig(const std::string &key, uint64 value)
+{
+    std::ostringstream s;
+    s << value;
+    setConfig(key, s.str());
+}
+
+void BenchReport::beginRun(const std::string &name, uint64 origin)
+{
+    Run run;
+    run.name = name;
+    run.origin = origin;
+    run.hasTotal = false;
+    m_runs.push_back(run);
+}
+
+void BenchReport::setRunParam(const std::string &key, uint64 value)
+{
+    if (m_runs.empty()) {
+       return;
+    }
+    std::ostringstream s;
+    s << value;
+    m_runs.back().params.push_back(std::make_pair(key, s.str()));
+}
+
+BenchReport::Sample BenchReport::makeSample(uint64 start, uint64 end,
+                                            uint64 sectors,
+                                            const LatencyHistogram &latency) const
+{
+    uint64 origin = m_runs.back().origin;
+    Sample s;
+
+    s.start = start > origin ? start - origin : 0;
+    s.end = end > origin ? end - origin : 0;
+    s.sectors = sectors;
+    s.ops = latency.count();
+    s.p50 = latency.percentile(50);
+    s.p90 = latency.percentile(90);
+    s.p99 = latency.percentile(99);
+    s.p999 = latency.percentile(99.9);
+    s.max = latency.max();
+    return s;
+}
+
+void BenchReport::addSample(uint64 start, uint64 end, uint64 sectors,
+                            const LatencyHistogram &latency)
+{
+    if (m_runs.empty()) {
+       return;
+    }
+    m_runs.back().samples.push_back(makeSample(start, end, sectors, latency));
+}
+
+void BenchReport::setTotal(uint64 start, uint64 end, uint64 sectors,
+                           const LatencyHistogram &latency)
+{
+    if (m_runs.empty()) {
+       return;
+    }
+    m_runs.back().total = makeSample(start, end, sectors, latency);
+    m_runs.back().hasTotal = true;
+}
+
+void BenchReport::setError(const std::string &error)
+{
+    if (m_runs.empty()) {
+       return;
+    }
+    m_runs.back().error = error;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchReport::write --
+ *
+ *      Writes the report to path, as CSV if the file name ends in
+ *      ".csv" and as JSON otherwise.
+ *
+ * Results:
+ *      false if the file could not be written.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool BenchReport::write(const std::string &path) const
+{
+    std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
+    if (!out) {
+       return false;
+    }
+
+    std::string ext = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    bool ok = ext == ".csv" ? writeCsv(out) : writeJson(out);
+    out.close();
+    return ok && !out.fail();
+}
+
+static void WriteJsonSample(std::ostream &out, const BenchReport::Sample &s)
+{
+    out << "{\"start_usec\": " << s.start
+        << ", \"end_usec\": " << s.end
+        << ", \"sectors\": " << s.sectors
+        << ", \"bytes\": " << s.sectors * VIXDISKLIB_SECTOR_SIZE
+        << ", \"mbytes_per_sec\": " << std::fixed << std::setprecision(2)
+        << MBytesPerSec(s)
+        << ", \"ops\": " << s.ops
+        << ", \"latency_usec\": {\"p50\": " << s.p50
+        << ", \"p90\": " << s.p90
+        << ", \"p99\": " << s.p99
+        << ", \"p99_9\": " << s.p999
+        << ", \"max\": " << s.max << "}}";
+}
+
+bool BenchReport::writeJson(std::ostream &out) const
+{
+    size_t i, j;
+
+    out << "{\n  \"config\": {";
+    for (i = 0; i < m_config.size(); ++i) {
+       out << (i ? ",\n" : "\n") << "    " << JsonString(m_config[i].first)
+           << ": " << JsonString(m_config[i].second);
+    }
+    out << "\n  },\n  \"runs\": [";
+    for (i = 0; i < m_runs.size(); ++i) {
+       const Run &run = m_runs[i];
+
+       out << (i ? ",\n" : "\n") << "    {\n      \"name\": "
+           << JsonString(run.name) << ",\n      \"params\": {";
+       for (j = 0; j < run.params.size(); ++j) {
+          out << (j ? ", " : "") << JsonString(run.params[j].first) << ": "
+              << run.params[j].second;
+       }
+       out << "},\n      \"samples\": [";
+       for (j = 0; j < run.samples.size(); ++j) {
+          out << (j ? ",\n" : "\n") << "        ";
+          WriteJsonSample(out, run.samples[j]);
+       }
+       out << (run.samples.empty() ? "]" : "\n      ]");
+       if (run.hasTotal) {
+          out << ",\n      \"total\": ";
+          WriteJsonSample(out, run.total);
+       }
+       if (!run.error.empty()) {
+          out << ",\n      \"error\": " << JsonString(run.error);
+       }
+       out << "\n    }";
+    }
+    out << (m_runs.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    return !out.fail();
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchReport::writeCsv --
+ *
+ *      One row per interval sample plus one "total" row per run. The
+ *      configuration and run parameters are repeated on every row so
+ *      that files from several hosts can simply be concatenated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool BenchReport::writeCsv(std::ostream &out) const
+{
+    std::vector<std::string> paramKeys;
+    size_t i, j, k;
+
+    for (i = 0; i < m_runs.size(); ++i) {
+       for (j = 0; j < m_runs[i].params.size(); ++j) {
+          const std::string &key = m_runs[i].params[j].first;
+          if (std::find(paramKeys.begin(), paramKeys.end(), key) == paramKeys.end()) {
+             paramKeys.push_back(key);
+          }
+       }
+    }
+
+    for (i = 0; i < m_config.size(); ++i) {
+       out << CsvString(m_config[i].first) << ",";
+    }
+    out << "run";
+    for (i = 0; i < paramKeys.size(); ++i) {
+       out << "," << CsvString(paramKeys[i]);
+    }
+    out << ",sample,start_usec,end_usec,sectors,bytes,mbytes_per_sec,ops,"
+           "p50_usec,p90_usec,p99_usec,p99_9_usec,max_usec,error\n";
+
+    for (i = 0; i < m_runs.size(); ++i) {
+       const Run &run = m_runs[i];
+       std::ostringstream prefix;
+
+       for (j = 0; j < m_config.size(); ++j) {
+          prefix << CsvString(m_config[j].second) << ",";
+       }
+       prefix << CsvString(run.name);
+       for (j = 0; j < paramKeys.size(); ++j) {
+          prefix << ",";
+          for (k = 0; k < run.params.size(); ++k) {
+             if (run.params[k].first == paramKeys[j]) {
+                prefix << run.params[k].second;
+                break;
+             }
+          }
+       }
+
+       for (j = 0; j <= run.samples.size(); ++j) {
+          bool total = j == run.samples.size();
+          if (total && !run.hasTotal) {
+             break;
+          }
+          const Sample &s = total ? run.total : run.samples[j];
+          out << prefix.str() << ",";
+          if (total) {
+             out << "total";
+          } else {
+             out << j;
+          }
+          out << "," << s.start << "," << s.end << "," << s.sectors
+              << "," << s.sectors * VIXDISKLIB_SECTOR_SIZE
+              << "," << std::fixed << std::setprecision(2) << MBytesPerSec(s)
+              << "," << s.ops << "," << s.p50 << "," << s.p90 << "," << s.p99
+              << "," << s.p999 << "," << s.max
+              << "," << (total ? CsvString(run.error) : "") << "\n";
+       }
+    }
+    return !out.fail();
+}
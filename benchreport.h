@@ -0,0 +1,61 @@
+#ifndef BENCHREPORT_H
+#define BENCHREPORT_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <iosfwd>
+
+#include "vm_basic_types.h"
+
+class LatencyHistogram;
+
+// Collects benchmark configuration, per-interval samples and totals and
+// writes them out as JSON or CSV for loading into dashboards.
+class BenchReport
+{
+public:
+    struct Sample {
+        uint64 start;                   // usec since the start of the run
+        uint64 end;
+        uint64 sectors;
+        uint64 ops;
+        uint64 p50, p90, p99, p999, max;  // latency in usec
+    };
+
+    struct Run {
+        std::string name;
+        std::vector<std::pair<std::string, std::string> > params;
+        uint64 origin;                  // GetTimeUsec() at the start of the run
+        std::vector<Sample> samples;
+        Sample total;
+        bool hasTotal;
+        std::string error;
+    };
+
+    void setConfig(const std::string &key, const std::string &value);
+    void setConfig(const std::string &key, uint64 value);
+
+    void beginRun(const std::string &name, uint64 origin);                   //Starts a new run, samples go to the last run.
+    void setRunParam(const std::string &key, uint64 value);
+    void addSample(uint64 start, uint64 end, uint64 sectors,
+                   const LatencyHistogram &latency);
+    void setTotal(uint64 start, uint64 end, uint64 sectors,
+                  const LatencyHistogram &latency);
+    void setError(const std::string &error);
+
+    const std::vector<Run> &runs() const { return m_runs; }
+
+    bool write(const std::string &path) const;                                //JSON, or CSV if path ends in ".csv".
+
+private:
+    Sample makeSample(uint64 start, uint64 end, uint64 sectors,
+                      const LatencyHistogram &latency) const;
+    bool writeJson(std::ostream &out) const;
+    bool writeCsv(std::ostream &out) const;
+
+    std::vector<std::pair<std::string, std::string> > m_config;
+    std::vector<Run> m_runs;
+};
+
+#endif // BENCHREPORT_H
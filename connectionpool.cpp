@@ -0,0 +1,362 @@
+#include "connectionpool.h"
+#include "diskbackend.h"
+
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <sstream>
+
+// How often the reaper looks for idle connections.
+#define POOL_REAP_INTERVAL_MSEC 1000
+
+struct ConnectionPool::Entry
+{
+   Entry()
+      : connection(NULL), leases(0), lastUsed(0), endAccess(false)
+   {
+      memset(&params, 0, sizeof params);
+   }
+
+   std::string key;
+   std::string vm;                  // server and vmxSpec, empty if not prepared
+   std::string identity;            // passed to PrepareForAccess and EndAccess
+   VixDiskLibConnection connection;
+   unsigned leases;
+   uint64 lastUsed;                 // usec of the last release
+   bool endAccess;                  // set by expired() for the last connection to a VM
+
+   // Copy of the caller's parameters for EndAccess.
+   VixDiskLibConnectParams params;
+   std::string vmxSpec;
+   std::string serverName;
+   std::string thumbPrint;
+   std::string userName;
+   std::string password;
+   std::string cookie;
+   std::string vimApiVer;
+};
+
+static uint64 NowUsec()
+{
+   return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char *Str(const char *s)
+{
+   return s ? s : "";
+}
+
+// Copies a parameter string into dst, keeping NULL as NULL.
+static char *Copy(const char *src, std::string &dst)
+{
+   if (src == NULL) {
+      return NULL;
+   }
+   dst = src;
+   return &dst[0];
+}
+
+ConnectionPool::ConnectionPool()
+   : idleSec(0), stop(false), reaperThread(NULL)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+   shutdown();
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnectionPool::Key --
+ *
+ *      Everything that makes two connections differ. The password is
+ *      part of it so a changed password is not served a session that
+ *      was opened with the old one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::string ConnectionPool::Key(const VixDiskLibConnectParams &params,
+                                const char *snapshotRef,
+                                const char *transportModes, bool readOnly)
+{
+   std::ostringstream key;
+
+   key << Str(params.serverName) << '\n' << params.port << '\n'
+       << params.nfcHostPort << '\n' << Str(params.thumbPrint) << '\n'
+       << params.credType << '\n';
+   if (params.credType == VIXDISKLIB_CRED_UID) {
+      key << Str(params.creds.uid.userName) << '\n'
+          << Str(params.creds.uid.password) << '\n';
+   } else if (params.credType == VIXDISKLIB_CRED_SESSIONID) {
+      key << Str(params.creds.sessionId.userName) << '\n'
+          << Str(params.creds.sessionId.key) << '\n'
+          << Str(params.creds.sessionId.cookie) << '\n';
+   }
+   key << Str(params.vmxSpec) << '\n' << Str(snapshotRef) << '\n'
+       << Str(transportModes) << '\n' << readOnly;
+   return key.str();
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnectionPool::acquire --
+ *
+ *      Hands out a lease on a connection for the parameters. An open
+ *      connection with the same key is reused, otherwise a new one is
+ *      made, through ConnectEx if a snapshot or transport modes are
+ *      given. A non-empty identity calls PrepareForAccess for the VM,
+ *      once for all the connections to it.
+ *
+ *      The pool lock is held while connecting, so concurrent callers
+ *      with the same key end up on a single connection.
+ *
+ * Results:
+ *      VixError. reused tells whether the connection was already open.
+ *
+ * Side effects:
+ *      Starts the reaper thread on first use.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VixError ConnectionPool::acquire(const VixDiskLibConnectParams &params,
+                                 const char *identity,
+                                 const char *snapshotRef,
+                                 const char *transportModes, bool readOnly,
+                                 VixDiskLibConnection &connection,
+                                 bool &reused)
+{
+   std::string key = Key(params, snapshotRef, transportModes, readOnly);
+   LockGuard<ThreadLock> lg(lock);
+   bool prepared = false;
+   VixError vixError;
+   size_t i;
+
+   if (reaperThread == NULL) {
+      stop = false;
+      reaperThread = new boost::thread(boost::bind(&ConnectionPool::reaper, this));
+   }
+
+   for (i = 0; i < entries.size(); ++i) {
+      if (entries[i]->key == key) {
+         ++entries[i]->leases;
+         connection = entries[i]->connection;
+         reused = true;
+         return VIX_OK;
+      }
+   }
+
+   std::unique_ptr<Entry> entry(new Entry);
+   entry->key = key;
+   entry->params = params;
+   entry->params.vmxSpec = Copy(params.vmxSpec, entry->vmxSpec);
+   entry->params.serverName = Copy(params.serverName, entry->serverName);
+   entry->params.thumbPrint = Copy(params.thumbPrint, entry->thumbPrint);
+   entry->params.vimApiVer = Copy(params.vimApiVer, entry->vimApiVer);
+   if (params.credType == VIXDISKLIB_CRED_UID) {
+      entry->params.creds.uid.userName =
+         Copy(params.creds.uid.userName, entry->userName);
+      entry->params.creds.uid.password =
+         Copy(params.creds.uid.password, entry->password);
+   } else if (params.credType == VIXDISKLIB_CRED_SESSIONID) {
+      entry->params.creds.sessionId.userName =
+         Copy(params.creds.sessionId.userName, entry->userName);
+      entry->params.creds.sessionId.key =
+         Copy(params.creds.sessionId.key, entry->password);
+      entry->params.creds.sessionId.cookie =
+         Copy(params.creds.sessionId.cookie, entry->cookie);
+   }
+
+   if (identity != NULL && *identity != '\0' && !entry->vmxSpec.empty()) {
+      entry->vm = entry->serverName + '\n' + entry->vmxSpec;
+      entry->identity = identity;
+      for (i = 0; i < entries.size() && entries[i]->vm != entry->vm; ++i) {
+      }
+      if (i < entries.size()) {
+         // EndAccess must name the identity the VM was prepared with.
+         entry->identity = entries[i]->identity;
+      } else {
+         vixError = DiskLib().PrepareForAccess(&entry->params, identity);
+         if (VIX_FAILED(vixError)) {
+            return vixError;
+         }
+         prepared = true;
+      }
+   }
+
+   if (Str(snapshotRef)[0] == '\0' && Str(transportModes)[0] == '\0') {
+      vixError = DiskLib().Connect(&entry->params, &entry->connection);
+   } else {
+      vixError = DiskLib().ConnectEx(&entry->params, readOnly, snapshotRef,
+                                     transportModes, &entry->connection);
+   }
+   if (VIX_FAILED(vixError)) {
+      if (prepared) {
+         DiskLib().EndAccess(&entry->params, entry->identity.c_str());
+      }
+      return vixError;
+   }
+
+   entry->leases = 1;
+   connection = entry->connection;
+   reused = false;
+   entries.push_back(entry.release());
+   return VIX_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnectionPool::release --
+ *
+ *      Returns a lease taken by acquire. The connection stays open until
+ *      the reaper finds it idle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void ConnectionPool::release(VixDiskLibConnection connection)
+{
+   LockGuard<ThreadLock> lg(lock);
+   for (size_t i = 0; i < entries.size(); ++i) {
+      if (entries[i]->connection == connection && entries[i]->leases > 0) {
+         --entries[i]->leases;
+         entries[i]->lastUsed = NowUsec();
+         break;
+      }
+   }
+   if (idleSec == 0) {
+      std::vector<Entry *> done = expired(NowUsec(), false);
+      Teardown(done);
+   }
+}
+
+void ConnectionPool::setIdleTimeout(unsigned sec)
+{
+   LockGuard<ThreadLock> lg(lock);
+   idleSec = sec;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnectionPool::shutdown --
+ *
+ *      Disconnects all connections, leased or not, and stops the reaper.
+ *      Must be called before the library is exited or the backend is
+ *      replaced. The pool can be used again afterwards.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void ConnectionPool::shutdown()
+{
+   boost::thread *thread;
+   {
+      LockGuard<ThreadLock> lg(lock);
+      stop = true;
+      lock.notifyAll();
+      thread = reaperThread;
+      reaperThread = NULL;
+   }
+   if (thread != NULL) {
+      thread->join();
+      delete thread;
+   }
+
+   LockGuard<ThreadLock> lg(lock);
+   std::vector<Entry *> done = expired(0, true);
+   Teardown(done);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnectionPool::expired --
+ *
+ *      Removes the connections without leases that have been idle for
+ *      the idle timeout, or all connections, from the pool. Marks those
+ *      that leave no other connection to their VM for EndAccess.
+ *      Called with the lock held.
+ *
+ * Results:
+ *      The removed entries, to be passed to Teardown.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::vector<ConnectionPool::Entry *> ConnectionPool::expired(uint64 now, bool all)
+{
+   std::vector<Entry *> done;
+   size_t i, j;
+
+   for (i = 0; i < entries.size(); ) {
+      Entry *e = entries[i];
+      if (all ||
+          (e->leases == 0 && now - e->lastUsed >= (uint64)idleSec * 1000000)) {
+         done.push_back(e);
+         entries.erase(entries.begin() + i);
+      } else {
+         ++i;
+      }
+   }
+   for (i = 0; i < done.size(); ++i) {
+      if (done[i]->vm.empty()) {
+         continue;
+      }
+      for (j = 0; j < entries.size() && entries[j]->vm != done[i]->vm; ++j) {
+      }
+      done[i]->endAccess = j == entries.size();
+      for (j = i + 1; j < done.size() && done[i]->endAccess; ++j) {
+         if (done[j]->vm == done[i]->vm) {
+            done[i]->endAccess = false;
+         }
+      }
+   }
+   return done;
+}
+
+void ConnectionPool::Teardown(std::vector<Entry *> &done)
+{
+   for (size_t i = 0; i < done.size(); ++i) {
+      Entry *e = done[i];
+      DiskLib().Disconnect(e->connection);
+      if (e->endAccess) {
+         DiskLib().EndAccess(&e->params, e->identity.c_str());
+      }
+      if (!e->serverName.empty()) {
+         printf("Disconnected from %s.\n", e->serverName.c_str());
+      }
+      delete e;
+   }
+   done.clear();
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnectionPool::reaper --
+ *
+ *      Thread disconnecting idle connections until shutdown. Teardown
+ *      runs under the lock so a concurrent acquire never sees a VM
+ *      between its EndAccess and the next PrepareForAccess.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void ConnectionPool::reaper()
+{
+   LockGuard<ThreadLock> lg(lock);
+   while (!stop) {
+      lock.wait(POOL_REAP_INTERVAL_MSEC);
+      if (!stop) {
+         std::vector<Entry *> done = expired(NowUsec(), false);
+         Teardown(done);
+      }
+   }
+}
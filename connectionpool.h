@@ -0,0 +1,49 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+
+#include "vixDiskLib.h"
+#include "threadlock.h"
+
+// Source connections kept open across commands. A connection is keyed by
+// everything that goes into VixDiskLib_ConnectEx, handed out as a lease
+// by acquire() and returned by release(); commands with the same key
+// share it, and the vCenter login, PrepareForAccess and ticket are paid
+// once. Connections without leases are disconnected by a reaper thread
+// once they have been idle for the idle timeout.
+class ConnectionPool
+{
+   public:
+      ConnectionPool();
+      ~ConnectionPool();
+
+      VixError acquire(const VixDiskLibConnectParams &params,   //Connects or reuses a connection.
+                       const char *identity, const char *snapshotRef,
+                       const char *transportModes, bool readOnly,
+                       VixDiskLibConnection &connection, bool &reused);
+      void release(VixDiskLibConnection connection);            //Returns a lease.
+      void setIdleTimeout(unsigned sec);                        //0 disconnects on the last release.
+      void shutdown();                                          //Disconnects everything, leases or not.
+
+   private:
+      struct Entry;
+
+      static std::string Key(const VixDiskLibConnectParams &params,
+                             const char *snapshotRef,
+                             const char *transportModes, bool readOnly);
+      static void Teardown(std::vector<Entry *> &entries);
+      void reaper();
+      std::vector<Entry *> expired(uint64 now, bool all);
+
+      std::vector<Entry *> entries;
+      unsigned idleSec;
+      bool stop;
+      boost::thread *reaperThread;
+      ThreadLock lock;
+};
+
+#endif // CONNECTIONPOOL_H
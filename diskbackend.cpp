@@ -0,0 +1,1373 @@
+#include "diskbackend.h"
+#include "worker.h"
+
+#include <chrono>
+#include <functional>
+
+#ifdef _WIN32
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#ifndef NO_VDDK
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VddkBackend --
+ *
+ *      The real VixDiskLib.
+ *
+ *----------------------------------------------------------------------
+ */
+
+class VddkBackend : public DiskBackend
+{
+public:
+    const char *Name() const { return "vddk"; }
+
+    VixError InitEx(uint32 majorVersion, uint32 minorVersion,
+                    VixDiskLibGenericLogFunc *log, VixDiskLibGenericLogFunc *warn,
+                    VixDiskLibGenericLogFunc *panic, const char *libDir,
+                    const char *configFile)
+    {
+        return VixDiskLib_InitEx(majorVersion, minorVersion, log, warn, panic,
+                                 libDir, configFile);
+    }
+    VixError Init(uint32 majorVersion, uint32 minorVersion,
+                  VixDiskLibGenericLogFunc *log, VixDiskLibGenericLogFunc *warn,
+                  VixDiskLibGenericLogFunc *panic, const char *libDir)
+    {
+        return VixDiskLib_Init(majorVersion, minorVersion, log, warn, panic,
+                               libDir);
+    }
+    void Exit() { VixDiskLib_Exit(); }
+    const char *ListTransportModes() { return VixDiskLib_ListTransportModes(); }
+
+    VixError Connect(const VixDiskLibConnectParams *connectParams,
+                     VixDiskLibConnection *connection)
+    {
+        return VixDiskLib_Connect(connectParams, connection);
+    }
+    VixError ConnectEx(const VixDiskLibConnectParams *connectParams,
+                       Bool readOnly, const char *snapshotRef,
+                       const char *transportModes,
+                       VixDiskLibConnection *connection)
+    {
+        return VixDiskLib_ConnectEx(connectParams, readOnly, snapshotRef,
+                                    transportModes, connection);
+    }
+    VixError Disconnect(VixDiskLibConnection connection)
+    {
+        return VixDiskLib_Disconnect(connection);
+    }
+    VixError PrepareForAccess(const VixDiskLibConnectParams *connectParams,
+                              const char *identity)
+    {
+        return VixDiskLib_PrepareForAccess(connectParams, identity);
+    }
+    VixError EndAccess(const VixDiskLibConnectParams *connectParams,
+                       const char *identity)
+    {
+        return VixDiskLib_EndAccess(connectParams, identity);
+    }
+
+    VixError Create(const VixDiskLibConnection connection, const char *path,
+                    const VixDiskLibCreateParams *createParams,
+                    VixDiskLibProgressFunc progressFunc,
+                    void *progressCallbackData)
+    {
+        return VixDiskLib_Create(connection, path, createParams, progressFunc,
+                                 progressCallbackData);
+    }
+    VixError CreateChild(VixDiskLibHandle diskHandle, const char *childPath,
+                         VixDiskLibDiskType diskType,
+                         VixDiskLibProgressFunc progressFunc,
+                         void *progressCallbackData)
+    {
+        return VixDiskLib_CreateChild(diskHandle, childPath, diskType,
+                                      progressFunc, progressCallbackData);
+    }
+    VixError Clone(const VixDiskLibConnection dstConnection, const char *dstPath,
+                   const VixDiskLibConnection srcConnection, const char *srcPath,
+                   const VixDiskLibCreateParams *createParams,
+                   VixDiskLibProgressFunc progressFunc,
+                   void *progressCallbackData, Bool overWrite)
+    {
+        return VixDiskLib_Clone(dstConnection, dstPath, srcConnection, srcPath,
+                                createParams, progressFunc, progressCallbackData,
+                                overWrite);
+    }
+    VixError Unlink(VixDiskLibConnection connection, const char *path)
+    {
+        return VixDiskLib_Unlink(connection, path);
+    }
+    VixError CheckRepair(const VixDiskLibConnection connection,
+                         const char *filename, Bool repair)
+    {
+        return VixDiskLib_CheckRepair(connection, filename, repair);
+    }
+
+    VixError Open(const VixDiskLibConnection connection, const char *path,
+                  uint32 flags, VixDiskLibHandle *diskHandle)
+    {
+        return VixDiskLib_Open(connection, path, flags, diskHandle);
+    }
+    VixError Close(VixDiskLibHandle diskHandle)
+    {
+        return VixDiskLib_Close(diskHandle);
+    }
+    VixError GetInfo(VixDiskLibHandle diskHandle, VixDiskLibInfo **info)
+    {
+        return VixDiskLib_GetInfo(diskHandle, info);
+    }
+    void FreeInfo(VixDiskLibInfo *info) { VixDiskLib_FreeInfo(info); }
+    const char *GetTransportMode(VixDiskLibHandle diskHandle)
+    {
+        return VixDiskLib_GetTransportMode(diskHandle);
+    }
+
+    VixError Read(VixDiskLibHandle diskHandle, VixDiskLibSectorType startSector,
+                  VixDiskLibSectorType numSectors, uint8 *readBuffer)
+    {
+        return VixDiskLib_Read(diskHandle, startSector, numSectors, readBuffer);
+    }
+    VixError Write(VixDiskLibHandle diskHandle, VixDiskLibSectorType startSector,
+                   VixDiskLibSectorType numSectors, const uint8 *writeBuffer)
+    {
+        return VixDiskLib_Write(diskHandle, startSector, numSectors, writeBuffer);
+    }
+    VixError ReadAsync(VixDiskLibHandle diskHandle,
+                       VixDiskLibSectorType startSector,
+                       VixDiskLibSectorType numSectors, uint8 *readBuffer,
+                       VixDiskLibCompletionCB callback, void *cbData)
+    {
+        return VixDiskLib_ReadAsync(diskHandle, startSector, numSectors,
+                                    readBuffer, callback, cbData);
+    }
+    VixError WriteAsync(VixDiskLibHandle diskHandle,
+                        VixDiskLibSectorType startSector,
+                        VixDiskLibSectorType numSectors,
+                        const uint8 *writeBuffer,
+                        VixDiskLibCompletionCB callback, void *cbData)
+    {
+        return VixDiskLib_WriteAsync(diskHandle, startSector, numSectors,
+                                     writeBuffer, callback, cbData);
+    }
+    VixError Flush(VixDiskLibHandle diskHandle)
+    {
+        return VixDiskLib_Flush(diskHandle);
+    }
+    VixError Wait(VixDiskLibHandle diskHandle)
+    {
+        return VixDiskLib_Wait(diskHandle);
+    }
+
+    VixError ReadMetadata(VixDiskLibHandle diskHandle, const char *key,
+                          char *buf, size_t bufLen, size_t *requiredLen)
+    {
+        return VixDiskLib_ReadMetadata(diskHandle, key, buf, bufLen, requiredLen);
+    }
+    VixError WriteMetadata(VixDiskLibHandle diskHandle, const char *key,
+                           const char *val)
+    {
+        return VixDiskLib_WriteMetadata(diskHandle, key, val);
+    }
+    VixError GetMetadataKeys(VixDiskLibHandle diskHandle, char *keys,
+                             size_t maxLen, size_t *requiredLen)
+    {
+        return VixDiskLib_GetMetadataKeys(diskHandle, keys, maxLen, requiredLen);
+    }
+
+    char *GetErrorText(VixError err, const char *locale)
+    {
+        return VixDiskLib_GetErrorText(err, locale);
+    }
+    void FreeErrorText(char *errMsg) { VixDiskLib_FreeErrorText(errMsg); }
+};
+
+DiskBackend *DiskBackend::NewVddk()
+{
+    return new VddkBackend;
+}
+
+#endif // NO_VDDK
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RawFile --
+ *
+ *      Positional I/O on a local file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+class RawFile
+{
+public:
+#ifdef _WIN32
+    RawFile() : _h(INVALID_HANDLE_VALUE) {}
+    bool IsOpen() const { return _h != INVALID_HANDLE_VALUE; }
+#else
+    RawFile() : _fd(-1) {}
+    bool IsOpen() const { return _fd >= 0; }
+#endif
+    ~RawFile() { Close(); }
+
+    bool Open(const std::string &path, bool readOnly, bool create)
+    {
+#ifdef _WIN32
+        _h = CreateFileA(path.c_str(),
+                         GENERIC_READ | (readOnly ? 0 : GENERIC_WRITE),
+                         FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                         create ? CREATE_NEW : OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+        if (_h != INVALID_HANDLE_VALUE && create) {
+            DWORD bytes;
+            DeviceIoControl(_h, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+        }
+#else
+        _fd = open(path.c_str(),
+                   (readOnly ? O_RDONLY : O_RDWR) | (create ? O_CREAT | O_EXCL : 0),
+                   0644);
+#endif
+        return IsOpen();
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (_h != INVALID_HANDLE_VALUE) {
+            CloseHandle(_h);
+            _h = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (_fd >= 0) {
+            close(_fd);
+            _fd = -1;
+        }
+#endif
+    }
+
+    bool ReadAt(uint64 offset, size_t n, void *buf)
+    {
+        uint8 *p = static_cast<uint8 *>(buf);
+        while (n > 0) {
+#ifdef _WIN32
+            OVERLAPPED ov = { 0 };
+            DWORD got = 0;
+            ov.Offset = (DWORD)offset;
+            ov.OffsetHigh = (DWORD)(offset >> 32);
+            if (!ReadFile(_h, p, (DWORD)std::min(n, (size_t)(1 << 30)), &got, &ov) ||
+                got == 0) {
+                return false;
+            }
+#else
+            ssize_t got = pread(_fd, p, n, (off_t)offset);
+            if (got <= 0) {
+                return false;
+            }
+#endif
+            p += got;
+            n -= got;
+            offset += got;
+        }
+        return true;
+    }
+
+    bool WriteAt(uint64 offset, size_t n, const void *buf)
+    {
+        const uint8 *p = static_cast<const uint8 *>(buf);
+        while (n > 0) {
+#ifdef _WIN32
+            OVERLAPPED ov = { 0 };
+            DWORD put = 0;
+            ov.Offset = (DWORD)offset;
+            ov.OffsetHigh = (DWORD)(offset >> 32);
+            if (!WriteFile(_h, p, (DWORD)std::min(n, (size_t)(1 << 30)), &put, &ov) ||
+                put == 0) {
+                return false;
+            }
+#else
+            ssize_t put = pwrite(_fd, p, n, (off_t)offset);
+            if (put <= 0) {
+                return false;
+            }
+#endif
+            p += put;
+            n -= put;
+            offset += put;
+        }
+        return true;
+    }
+
+    bool Truncate(uint64 size)
+    {
+#ifdef _WIN32
+        LARGE_INTEGER li;
+        li.QuadPart = (LONGLONG)size;
+        return SetFilePointerEx(_h, li, NULL, FILE_BEGIN) && SetEndOfFile(_h);
+#else
+        return ftruncate(_fd, (off_t)size) == 0;
+#endif
+    }
+
+    bool Sync()
+    {
+#ifdef _WIN32
+        return FlushFileBuffers(_h) != 0;
+#else
+        return fsync(_fd) == 0;
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE _h;
+#else
+    int _fd;
+#endif
+};
+
+static uint64 NowUsec()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool IsZero(const std::vector<uint8> &buf, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (buf[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool FileExists(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        return false;
+    }
+    fclose(f);
+    return true;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FileDisk --
+ *
+ *      A disk of the file backend. It consists of a text descriptor at
+ *      the disk path, the sectors in "<path>.flat" (a sparse file of
+ *      the size of the disk) and, for a child disk, a bitmap of the
+ *      grains written to the child in "<path>.grains". Reads of the
+ *      other grains go to the parent.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define FILEDISK_GRAIN_SECTORS 128  // 64KB, as in sparse vmdks
+
+struct FileConnection;
+
+struct FileDisk
+{
+    FileDisk()
+       : capacity(0), adapterType(VIXDISKLIB_ADAPTER_SCSI_LSILOGIC),
+         readOnly(true), parent(NULL), grainsDirty(false), descDirty(false),
+         pending(0), conn(NULL)
+    {}
+
+    std::string path;
+    RawFile data;
+    VixDiskLibSectorType capacity;
+    VixDiskLibAdapterType adapterType;
+    bool readOnly;
+    std::string parentPath;         // empty for a base disk
+    FileDisk *parent;               // NULL for a base disk or a single link
+    std::vector<uint8> grains;      // child: grains written to this link
+    bool grainsDirty;
+    std::vector<std::pair<std::string, std::string> > metadata;
+    bool descDirty;
+    uint32 pending;                 // async requests in flight
+    ThreadLock lock;                // grains, metadata and pending
+    FileConnection *conn;           // transport model, NULL for parents
+
+    static std::string FlatPath(const std::string &path) { return path + ".flat"; }
+    static std::string GrainsPath(const std::string &path) { return path + ".grains"; }
+
+    bool HasGrain(uint64 grain)
+    {
+        return (grains[(size_t)(grain / 8)] >> (grain % 8)) & 1;
+    }
+
+    void SetGrain(uint64 grain)
+    {
+        grains[(size_t)(grain / 8)] |= (uint8)(1 << (grain % 8));
+        grainsDirty = true;
+    }
+
+    bool WriteDesc() const
+    {
+        std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        out << "# file backend disk\n"
+            << "capacity " << capacity << "\n"
+            << "adapter " << (int)adapterType << "\n";
+        if (!parentPath.empty()) {
+            out << "parent " << parentPath << "\n";
+        }
+        for (size_t i = 0; i < metadata.size(); ++i) {
+            out << "ddb " << metadata[i].first << " " << metadata[i].second << "\n";
+        }
+        out.close();
+        return !out.fail();
+    }
+
+    bool ReadDesc()
+    {
+        std::ifstream in(path.c_str());
+        std::string line, key, value;
+        int adapter;
+
+        if (!in) {
+            return false;
+        }
+        while (std::getline(in, line)) {
+            std::istringstream ls(line);
+            if (line.empty() || line[0] == '#' || !(ls >> key)) {
+                continue;
+            }
+            if (key == "capacity") {
+                ls >> capacity;
+            } else if (key == "adapter") {
+                ls >> adapter;
+                adapterType = (VixDiskLibAdapterType)adapter;
+            } else if (key == "parent") {
+                std::getline(ls >> std::ws, parentPath);
+            } else if (key == "ddb" && ls >> key) {
+                std::getline(ls >> std::ws, value);
+                metadata.push_back(std::make_pair(key, value));
+            }
+        }
+        return capacity != 0;
+    }
+
+    // Reads from this link and its parents.
+    bool ReadChain(VixDiskLibSectorType start, VixDiskLibSectorType n, uint8 *buf)
+    {
+        VixDiskLibSectorType end = start + n;
+
+        if (parentPath.empty()) {
+            return data.ReadAt(start * VIXDISKLIB_SECTOR_SIZE,
+                               (size_t)n * VIXDISKLIB_SECTOR_SIZE, buf);
+        }
+        while (start < end) {
+            VixDiskLibSectorType runEnd;
+            bool own;
+            {
+                LockGuard<ThreadLock> lg(lock);
+                uint64 grain = start / FILEDISK_GRAIN_SECTORS;
+                own = HasGrain(grain);
+                runEnd = (grain + 1) * FILEDISK_GRAIN_SECTORS;
+                while (runEnd < end && HasGrain(runEnd / FILEDISK_GRAIN_SECTORS) == own) {
+                    runEnd += FILEDISK_GRAIN_SECTORS;
+                }
+            }
+            runEnd = std::min(runEnd, end);
+
+            size_t bytes = (size_t)(runEnd - start) * VIXDISKLIB_SECTOR_SIZE;
+            if (own) {
+                if (!data.ReadAt(start * VIXDISKLIB_SECTOR_SIZE, bytes, buf)) {
+                    return false;
+                }
+            } else if (parent) {
+                if (!parent->ReadChain(start, runEnd - start, buf)) {
+                    return false;
+                }
+            } else {
+                memset(buf, 0, bytes);      // opened as a single link
+            }
+            buf += bytes;
+            start = runEnd;
+        }
+        return true;
+    }
+
+    // Writes to this link. The grains of a child that are only partly
+    // written are first copied up from the parent.
+    bool WriteLink(VixDiskLibSectorType start, VixDiskLibSectorType n,
+                   const uint8 *buf)
+    {
+        if (!parentPath.empty()) {
+            uint64 first = start / FILEDISK_GRAIN_SECTORS;
+            uint64 last = (start + n - 1) / FILEDISK_GRAIN_SECTORS;
+            std::vector<uint8> grainBuf;
+
+            for (uint64 g = first; g <= last; ++g) {
+                VixDiskLibSectorType gStart = g * FILEDISK_GRAIN_SECTORS;
+                VixDiskLibSectorType gCount =
+                   std::min((VixDiskLibSectorType)FILEDISK_GRAIN_SECTORS,
+                            capacity - gStart);
+                LockGuard<ThreadLock> lg(lock);
+
+                if (HasGrain(g)) {
+                    continue;
+                }
+                if ((gStart < start || gStart + gCount > start + n) && parent) {
+                    grainBuf.resize((size_t)gCount * VIXDISKLIB_SECTOR_SIZE);
+                    if (!parent->ReadChain(gStart, gCount, &grainBuf[0]) ||
+                        !data.WriteAt(gStart * VIXDISKLIB_SECTOR_SIZE,
+                                      grainBuf.size(), &grainBuf[0])) {
+                        return false;
+                    }
+                }
+                SetGrain(g);
+            }
+        }
+        return data.WriteAt(start * VIXDISKLIB_SECTOR_SIZE,
+                            (size_t)n * VIXDISKLIB_SECTOR_SIZE, buf);
+    }
+};
+
+struct FileConnection
+{
+    FileConnection()
+       : readOnly(false), nextFree(0)
+    {}
+
+    bool readOnly;
+    TransportModel model;
+    std::vector<uint64> busyUntil;  // usec, end of service of each of the
+                                    // maxConcurrent slots, a min-heap
+    uint64 nextFree;                // usec, end of the last transfer on the wire
+    ThreadLock lock;                // busyUntil and nextFree
+};
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TransportModel::Preset --
+ *
+ *      Rough figures for a single connection over 10GbE to a lightly
+ *      loaded host. They are meant to be calibrated against a lab run
+ *      with the -model* options, not to be exact.
+ *
+ * Results:
+ *      false if name is not a known transport mode.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool TransportModel::Preset(const std::string &name, TransportModel &model)
+{
+    static const struct {
+        const char *name;
+        uint32 latencyUsec, usecPerMB, maxConcurrent, tlsUsecPerMB;
+    } presets[] = {
+        // NFC: one TCP stream per connection through hostd, few requests
+        // in service at a time.
+        { "nbd",    400, 8000,  4,  0 },
+        // NBD plus TLS, encrypted and decrypted by the proxy's CPU.
+        { "nbdssl", 450, 9000,  4,  2500 },
+        // Local SCSI hot-add of the disk to the proxy VM.
+        { "hotadd", 150, 2500,  32, 0 },
+        // Direct FC/iSCSI reads of the datastore LUN.
+        { "san",    250, 1700,  16, 0 },
+    };
+
+    for (size_t i = 0; i < sizeof presets / sizeof presets[0]; ++i) {
+        if (name == presets[i].name) {
+            model.name = presets[i].name;
+            model.latencyUsec = presets[i].latencyUsec;
+            model.usecPerMB = presets[i].usecPerMB;
+            model.maxConcurrent = presets[i].maxConcurrent;
+            model.tlsUsecPerMB = presets[i].tlsUsecPerMB;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct FileAsyncRequest
+{
+    FileDisk *disk;
+    VixDiskLibSectorType startSector;
+    VixDiskLibSectorType numSectors;
+    uint8 *buf;
+    bool write;
+    VixDiskLibCompletionCB callback;
+    void *cbData;
+};
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FileBackend --
+ *
+ *      Disks in local files, see FileDisk. Every read and write can be
+ *      delayed by a fixed latency and by a bandwidth limit shared by
+ *      all disks, and can fail at random with VIX_E_HOST_TCP_CONN_LOST,
+ *      like a dropped NFC connection. On top of that, each connection
+ *      can emulate a transport mode, see TransportModel.
+ *
+ *      The completion time of a request is worked out when it is
+ *      submitted. A synchronous call sleeps until then. An async
+ *      request is handed to a pool of threads by a timer at that time,
+ *      so no thread waits out a request and the queue depth is not
+ *      limited by the size of the pool. The pool threads do the file
+ *      I/O, spin for the TLS time and invoke the completion callbacks.
+ *
+ *      Disk types are ignored: every disk is a sparse file.
+ *
+ *----------------------------------------------------------------------
+ */
+
+class FileBackend : public DiskBackend
+{
+public:
+    explicit FileBackend(const FileBackendParams &params)
+       : _params(params), _nextFree(0), _random(params.seed | 1),
+         _async(params.asyncThreads ? params.asyncThreads : 1)
+    {}
+
+    const char *Name() const { return "file"; }
+
+    VixError InitEx(uint32, uint32, VixDiskLibGenericLogFunc *,
+                    VixDiskLibGenericLogFunc *, VixDiskLibGenericLogFunc *,
+                    const char *, const char *)
+    {
+        return VIX_OK;
+    }
+    VixError Init(uint32, uint32, VixDiskLibGenericLogFunc *,
+                  VixDiskLibGenericLogFunc *, VixDiskLibGenericLogFunc *,
+                  const char *)
+    {
+        return VIX_OK;
+    }
+    void Exit() {}
+    const char *ListTransportModes() { return "file:san:hotadd:nbdssl:nbd"; }
+
+    VixError Connect(const VixDiskLibConnectParams *connectParams,
+                     VixDiskLibConnection *connection)
+    {
+        return ConnectEx(connectParams, FALSE, NULL, NULL, connection);
+    }
+    VixError ConnectEx(const VixDiskLibConnectParams *, Bool readOnly,
+                       const char *, const char *transportModes,
+                       VixDiskLibConnection *connection)
+    {
+        FileConnection *conn = new FileConnection;
+        std::string modes(transportModes ? transportModes : "");
+        size_t pos = 0, end;
+
+        conn->readOnly = readOnly != FALSE;
+        do {
+            end = modes.find(':', pos);
+            if (TransportModel::Preset(modes.substr(pos, end - pos), conn->model)) {
+                break;
+            }
+            pos = end + 1;
+        } while (end != std::string::npos);
+        if (conn->model.name.empty()) {
+            TransportModel::Preset(_params.transport, conn->model);
+        }
+        if (!conn->model.name.empty()) {
+            if (_params.modelLatencyUsec >= 0) {
+                conn->model.latencyUsec = _params.modelLatencyUsec;
+            }
+            if (_params.modelUsecPerMB >= 0) {
+                conn->model.usecPerMB = _params.modelUsecPerMB;
+            }
+            if (_params.modelMaxConcurrent >= 0) {
+                conn->model.maxConcurrent = _params.modelMaxConcurrent;
+            }
+            if (_params.modelTlsUsecPerMB >= 0) {
+                conn->model.tlsUsecPerMB = _params.modelTlsUsecPerMB;
+            }
+        }
+        *connection = reinterpret_cast<VixDiskLibConnection>(conn);
+        return VIX_OK;
+    }
+    VixError Disconnect(VixDiskLibConnection connection)
+    {
+        delete reinterpret_cast<FileConnection *>(connection);
+        return VIX_OK;
+    }
+    VixError PrepareForAccess(const VixDiskLibConnectParams *, const char *)
+    {
+        return VIX_OK;
+    }
+    VixError EndAccess(const VixDiskLibConnectParams *, const char *)
+    {
+        return VIX_OK;
+    }
+
+    VixError Create(const VixDiskLibConnection, const char *path,
+                    const VixDiskLibCreateParams *createParams,
+                    VixDiskLibProgressFunc, void *)
+    {
+        FileDisk disk;
+
+        disk.path = path;
+        disk.capacity = createParams->capacity;
+        disk.adapterType = createParams->adapterType;
+        return CreateFiles(disk);
+    }
+
+    VixError CreateChild(VixDiskLibHandle diskHandle, const char *childPath,
+                         VixDiskLibDiskType, VixDiskLibProgressFunc, void *)
+    {
+        FileDisk *parent = ToDisk(diskHandle);
+        FileDisk child;
+
+        if (parent == NULL) {
+            return VIX_E_INVALID_ARG;
+        }
+        child.path = childPath;
+        child.capacity = parent->capacity;
+        child.adapterType = parent->adapterType;
+        child.parentPath = parent->path;
+        return CreateFiles(child);
+    }
+
+    VixError Clone(const VixDiskLibConnection dstConnection, const char *dstPath,
+                   const VixDiskLibConnection srcConnection, const char *srcPath,
+                   const VixDiskLibCreateParams *createParams,
+                   VixDiskLibProgressFunc progressFunc,
+                   void *progressCallbackData, Bool overWrite)
+    {
+        const VixDiskLibSectorType chunk = 2048;
+        VixDiskLibHandle src = NULL, dst = NULL;
+        VixDiskLibCreateParams params = *createParams;
+        std::vector<uint8> buf((size_t)chunk * VIXDISKLIB_SECTOR_SIZE);
+        VixDiskLibSectorType sector, count;
+        VixError err;
+
+        if (FileExists(dstPath)) {
+            if (!overWrite) {
+                return VIX_E_FILE_ALREADY_EXISTS;
+            }
+            Unlink(dstConnection, dstPath);
+        }
+        err = Open(srcConnection, srcPath, VIXDISKLIB_FLAG_OPEN_READ_ONLY, &src);
+        if (VIX_FAILED(err)) {
+            return err;
+        }
+        params.capacity = ToDisk(src)->capacity;
+        err = Create(dstConnection, dstPath, &params, NULL, NULL);
+        if (VIX_SUCCEEDED(err)) {
+            err = Open(dstConnection, dstPath, 0, &dst);
+        }
+        for (sector = 0; VIX_SUCCEEDED(err) && sector < params.capacity;
+             sector += count) {
+            count = std::min(chunk, params.capacity - sector);
+            err = Read(src, sector, count, &buf[0]);
+            if (VIX_SUCCEEDED(err) &&
+                !IsZero(buf, (size_t)count * VIXDISKLIB_SECTOR_SIZE)) {
+                err = Write(dst, sector, count, &buf[0]);
+            }
+            if (progressFunc &&
+                !progressFunc(progressCallbackData,
+                              (int)(100 * (sector + count) / params.capacity))) {
+                err = VIX_E_CANCELLED;
+            }
+        }
+        if (dst) {
+            Close(dst);
+        }
+        Close(src);
+        return err;
+    }
+
+    VixError Unlink(VixDiskLibConnection, const char *path)
+    {
+        if (remove(path) != 0) {
+            return VIX_E_FILE_NOT_FOUND;
+        }
+        remove(FileDisk::FlatPath(path).c_str());
+        remove(FileDisk::GrainsPath(path).c_str());
+        return VIX_OK;
+    }
+
+    VixError CheckRepair(const VixDiskLibConnection connection,
+                         const char *filename, Bool)
+    {
+        VixDiskLibHandle handle;
+        VixError err = Open(connection, filename, VIXDISKLIB_FLAG_OPEN_READ_ONLY,
+                            &handle);
+        if (VIX_SUCCEEDED(err)) {
+            Close(handle);
+        }
+        return err;
+    }
+
+    VixError Open(const VixDiskLibConnection connection, const char *path,
+                  uint32 flags, VixDiskLibHandle *diskHandle)
+    {
+        FileConnection *conn = reinterpret_cast<FileConnection *>(connection);
+        FileDisk *disk;
+        VixError err;
+
+        if (conn == NULL) {
+            return VIX_E_DISK_INVALID_CONNECTION;
+        }
+        err = OpenDisk(path, (flags & VIXDISKLIB_FLAG_OPEN_READ_ONLY) || conn->readOnly,
+                       (flags & VIXDISKLIB_FLAG_OPEN_SINGLE_LINK) != 0, &disk);
+        if (VIX_SUCCEEDED(err)) {
+            disk->conn = conn;
+            *diskHandle = reinterpret_cast<VixDiskLibHandle>(disk);
+        }
+        return err;
+    }
+
+    VixError Close(VixDiskLibHandle diskHandle)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        if (disk == NULL) {
+            return VIX_E_INVALID_ARG;
+        }
+        Wait(diskHandle);
+        return CloseDisk(disk);
+    }
+
+    VixError GetInfo(VixDiskLibHandle diskHandle, VixDiskLibInfo **info)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        VixDiskLibInfo *i;
+        FileDisk *link;
+
+        if (disk == NULL) {
+            return VIX_E_INVALID_ARG;
+        }
+        i = new VixDiskLibInfo;
+        memset(i, 0, sizeof *i);
+        i->capacity = disk->capacity;
+        i->adapterType = disk->adapterType;
+        i->biosGeo.heads = 255;
+        i->biosGeo.sectors = 63;
+        i->biosGeo.cylinders = (uint32)std::min(disk->capacity / (255 * 63),
+                                                (VixDiskLibSectorType)1024);
+        i->physGeo.heads = 16;
+        i->physGeo.sectors = 63;
+        i->physGeo.cylinders = (uint32)std::min(disk->capacity / (16 * 63),
+                                                (VixDiskLibSectorType)16383);
+        for (link = disk, i->numLinks = 1; link->parent; link = link->parent) {
+            ++i->numLinks;
+        }
+        if (!disk->parentPath.empty()) {
+            i->parentFileNameHint = strdup(disk->parentPath.c_str());
+        }
+        *info = i;
+        return VIX_OK;
+    }
+
+    void FreeInfo(VixDiskLibInfo *info)
+    {
+        if (info) {
+            free(info->parentFileNameHint);
+            free(info->uuid);
+            delete info;
+        }
+    }
+
+    const char *GetTransportMode(VixDiskLibHandle diskHandle)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        if (disk && disk->conn && !disk->conn->model.name.empty()) {
+            return disk->conn->model.name.c_str();
+        }
+        return "file";
+    }
+
+    VixError Read(VixDiskLibHandle diskHandle, VixDiskLibSectorType startSector,
+                  VixDiskLibSectorType numSectors, uint8 *readBuffer)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        VixError err = Check(disk, startSector, numSectors, false);
+
+        if (VIX_SUCCEEDED(err)) {
+            SleepUntil(Schedule(disk, numSectors));
+            err = Access(disk, startSector, numSectors, readBuffer, false);
+        }
+        return err;
+    }
+
+    VixError Write(VixDiskLibHandle diskHandle, VixDiskLibSectorType startSector,
+                   VixDiskLibSectorType numSectors, const uint8 *writeBuffer)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        VixError err = Check(disk, startSector, numSectors, true);
+
+        if (VIX_SUCCEEDED(err)) {
+            SleepUntil(Schedule(disk, numSectors));
+            err = Access(disk, startSector, numSectors,
+                         const_cast<uint8 *>(writeBuffer), true);
+        }
+        return err;
+    }
+
+    VixError ReadAsync(VixDiskLibHandle diskHandle,
+                       VixDiskLibSectorType startSector,
+                       VixDiskLibSectorType numSectors, uint8 *readBuffer,
+                       VixDiskLibCompletionCB callback, void *cbData)
+    {
+        return Submit(diskHandle, startSector, numSectors, readBuffer, false,
+                      callback, cbData);
+    }
+
+    VixError WriteAsync(VixDiskLibHandle diskHandle,
+                        VixDiskLibSectorType startSector,
+                        VixDiskLibSectorType numSectors,
+                        const uint8 *writeBuffer,
+                        VixDiskLibCompletionCB callback, void *cbData)
+    {
+        return Submit(diskHandle, startSector, numSectors,
+                      const_cast<uint8 *>(writeBuffer), true, callback, cbData);
+    }
+
+    VixError Flush(VixDiskLibHandle diskHandle)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        if (disk == NULL) {
+            return VIX_E_INVALID_ARG;
+        }
+        return disk->readOnly || disk->data.Sync() ? VIX_OK : VIX_E_FILE_ERROR;
+    }
+
+    VixError Wait(VixDiskLibHandle diskHandle)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        if (disk == NULL) {
+            return VIX_E_INVALID_ARG;
+        }
+        LockGuard<ThreadLock> lg(disk->lock);
+        while (disk->pending != 0) {
+            disk->lock.wait();
+        }
+        return VIX_OK;
+    }
+
+    VixError ReadMetadata(VixDiskLibHandle diskHandle, const char *key,
+                          char *buf, size_t bufLen, size_t *requiredLen)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        if (disk == NULL) {
+            return VIX_E_INVALID_ARG;
+        }
+        LockGuard<ThreadLock> lg(disk->lock);
+        for (size_t i = 0; i < disk->metadata.size(); ++i) {
+            const std::string &value = disk->metadata[i].second;
+            if (disk->metadata[i].first != key) {
+                continue;
+            }
+            if (requiredLen) {
+                *requiredLen = value.size() + 1;
+            }
+            if (buf == NULL || bufLen < value.size() + 1) {
+                return VIX_E_BUFFER_TOOSMALL;
+            }
+            memcpy(buf, value.c_str(), value.size() + 1);
+            return VIX_OK;
+        }
+        return VIX_E_DISK_KEY_NOTFOUND;
+    }
+
+    VixError WriteMetadata(VixDiskLibHandle diskHandle, const char *key,
+                           const char *val)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        size_t i;
+
+        if (disk == NULL || strpbrk(key, " \t\r\n") || strpbrk(val, "\r\n")) {
+            return VIX_E_INVALID_ARG;
+        }
+        if (disk->readOnly) {
+            return VIX_E_FILE_READ_ONLY;
+        }
+        LockGuard<ThreadLock> lg(disk->lock);
+        for (i = 0; i < disk->metadata.size(); ++i) {
+            if (disk->metadata[i].first == key) {
+                disk->metadata[i].second = val;
+                break;
+            }
+        }
+        if (i == disk->metadata.size()) {
+            disk->metadata.push_back(std::make_pair(std::string(key),
+                                                    std::string(val)));
+        }
+        disk->descDirty = true;
+        return VIX_OK;
+    }
+
+    VixError GetMetadataKeys(VixDiskLibHandle diskHandle, char *keys,
+                             size_t maxLen, size_t *requiredLen)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        std::string all;
+
+        if (disk == NULL) {
+            return VIX_E_INVALID_ARG;
+        }
+        {
+            LockGuard<ThreadLock> lg(disk->lock);
+            for (size_t i = 0; i < disk->metadata.size(); ++i) {
+                all += disk->metadata[i].first;
+                all += '\0';
+            }
+        }
+        all += '\0';
+        if (requiredLen) {
+            *requiredLen = all.size();
+        }
+        if (keys == NULL || maxLen < all.size()) {
+            return VIX_E_BUFFER_TOOSMALL;
+        }
+        memcpy(keys, all.data(), all.size());
+        return VIX_OK;
+    }
+
+    char *GetErrorText(VixError err, const char *)
+    {
+        static const struct {
+            VixError err;
+            const char *text;
+        } texts[] = {
+            { VIX_OK, "The operation was successful" },
+            { VIX_E_FAIL, "Unknown error" },
+            { VIX_E_INVALID_ARG, "One of the parameters was invalid" },
+            { VIX_E_FILE_NOT_FOUND, "A file was not found" },
+            { VIX_E_FILE_ERROR, "A file access error occurred on the host or guest operating system" },
+            { VIX_E_CANCELLED, "The operation was canceled" },
+            { VIX_E_FILE_READ_ONLY, "The file is write-protected" },
+            { VIX_E_FILE_ALREADY_EXISTS, "The file already exists" },
+            { VIX_E_BUFFER_TOOSMALL, "Buffer is too small" },
+            { VIX_E_HOST_TCP_CONN_LOST, "Lost connection (injected by the file backend)" },
+            { VIX_E_DISK_INVAL, "One of the parameters supplied is invalid" },
+            { VIX_E_DISK_OUTOFRANGE, "The disk sector number is out of range" },
+            { VIX_E_DISK_OPENPARENT, "The parent virtual disk could not be opened" },
+            { VIX_E_DISK_KEY_NOTFOUND, "The specified key is not found in the disk database" },
+            { VIX_E_DISK_INVALID_CONNECTION, "The connection is invalid" },
+        };
+        std::ostringstream s;
+
+        for (size_t i = 0; i < sizeof texts / sizeof texts[0]; ++i) {
+            if (texts[i].err == VIX_ERROR_CODE(err)) {
+                return strdup(texts[i].text);
+            }
+        }
+        s << "VIX error " << VIX_ERROR_CODE(err);
+        return strdup(s.str().c_str());
+    }
+
+    void FreeErrorText(char *errMsg) { free(errMsg); }
+
+private:
+    static FileDisk *ToDisk(VixDiskLibHandle handle)
+    {
+        return reinterpret_cast<FileDisk *>(handle);
+    }
+
+    VixError CreateFiles(FileDisk &disk)
+    {
+        RawFile flat;
+
+        if (disk.capacity == 0) {
+            return VIX_E_INVALID_ARG;
+        }
+        if (FileExists(disk.path)) {
+            return VIX_E_FILE_ALREADY_EXISTS;
+        }
+        remove(FileDisk::FlatPath(disk.path).c_str());
+        remove(FileDisk::GrainsPath(disk.path).c_str());
+        if (!flat.Open(FileDisk::FlatPath(disk.path), false, true) ||
+            !flat.Truncate(disk.capacity * VIXDISKLIB_SECTOR_SIZE)) {
+            return VIX_E_FILE_ERROR;
+        }
+        flat.Close();
+        return disk.WriteDesc() ? VIX_OK : VIX_E_FILE_ERROR;
+    }
+
+    VixError OpenDisk(const std::string &path, bool readOnly, bool singleLink,
+                      FileDisk **result)
+    {
+        FileDisk *disk = new FileDisk;
+        VixError err = VIX_OK;
+
+        disk->path = path;
+        disk->readOnly = readOnly;
+        if (!disk->ReadDesc()) {
+            err = FileExists(path) ? VIX_E_DISK_INVAL : VIX_E_FILE_NOT_FOUND;
+        } else if (!disk->data.Open(FileDisk::FlatPath(path), readOnly, false)) {
+            err = VIX_E_FILE_ERROR;
+        } else if (!disk->parentPath.empty()) {
+            std::string grainsPath = FileDisk::GrainsPath(path);
+            FILE *f = fopen(grainsPath.c_str(), "rb");
+
+            disk->grains.assign((size_t)((disk->capacity / FILEDISK_GRAIN_SECTORS + 8) / 8), 0);
+            if (f != NULL) {
+                size_t got = fread(&disk->grains[0], 1, disk->grains.size(), f);
+                (void)got;                  // a short file means unwritten grains
+                fclose(f);
+            }
+            if (!singleLink &&
+                VIX_FAILED(OpenDisk(disk->parentPath, true, false, &disk->parent))) {
+                err = VIX_E_DISK_OPENPARENT;
+            } else if (disk->parent && disk->parent->capacity != disk->capacity) {
+                err = VIX_E_DISK_CAPACITY_MISMATCH;
+            }
+        }
+        if (VIX_FAILED(err)) {
+            CloseDisk(disk);
+            return err;
+        }
+        *result = disk;
+        return VIX_OK;
+    }
+
+    VixError CloseDisk(FileDisk *disk)
+    {
+        VixError err = VIX_OK;
+
+        if (disk->grainsDirty) {
+            std::string grainsPath = FileDisk::GrainsPath(disk->path);
+            FILE *f = fopen(grainsPath.c_str(), "wb");
+            if (f == NULL ||
+                fwrite(&disk->grains[0], 1, disk->grains.size(), f) != disk->grains.size()) {
+                err = VIX_E_FILE_ERROR;
+            }
+            if (f != NULL && fclose(f) != 0) {
+                err = VIX_E_FILE_ERROR;
+            }
+        }
+        if (disk->descDirty && !disk->WriteDesc()) {
+            err = VIX_E_FILE_ERROR;
+        }
+        if (disk->parent) {
+            CloseDisk(disk->parent);
+        }
+        delete disk;
+        return err;
+    }
+
+    VixError Check(FileDisk *disk, VixDiskLibSectorType startSector,
+                   VixDiskLibSectorType numSectors, bool write)
+    {
+        if (disk == NULL) {
+            return VIX_E_INVALID_ARG;
+        }
+        if (startSector + numSectors > disk->capacity ||
+            startSector + numSectors < startSector) {
+            return VIX_E_DISK_OUTOFRANGE;
+        }
+        if (write && disk->readOnly) {
+            return VIX_E_FILE_READ_ONLY;
+        }
+        return VIX_OK;
+    }
+
+    /*
+     *------------------------------------------------------------------
+     *
+     * Schedule --
+     *
+     *      Books a request of numSectors submitted now: a service slot
+     *      and the wire of the disk's connection under its transport
+     *      model, then the injected latency and the bandwidth limit
+     *      shared by all disks.
+     *
+     * Results:
+     *      The time in usec, see NowUsec, at which the request is done.
+     *
+     *------------------------------------------------------------------
+     */
+
+    uint64 Schedule(FileDisk *disk, VixDiskLibSectorType numSectors)
+    {
+        uint64 bytes = numSectors * VIXDISKLIB_SECTOR_SIZE;
+        uint64 now = NowUsec();
+        uint64 end = now;
+
+        if (disk->conn && !disk->conn->model.name.empty()) {
+            FileConnection &conn = *disk->conn;
+            const TransportModel &model = conn.model;
+            uint64 start = now;
+            std::greater<uint64> later;
+
+            LockGuard<ThreadLock> lg(conn.lock);
+            if (model.maxConcurrent) {
+                // Wait for the slot that frees up first.
+                if (conn.busyUntil.size() < model.maxConcurrent) {
+                    conn.busyUntil.push_back(0);
+                    std::push_heap(conn.busyUntil.begin(), conn.busyUntil.end(),
+                                   later);
+                }
+                std::pop_heap(conn.busyUntil.begin(), conn.busyUntil.end(),
+                              later);
+                start = std::max(start, conn.busyUntil.back());
+            }
+            conn.nextFree = std::max(conn.nextFree, start + model.latencyUsec) +
+                            bytes * model.usecPerMB / (1024 * 1024);
+            end = conn.nextFree;
+            if (model.maxConcurrent) {
+                // The slot stays busy while the data is decrypted, see Finish.
+                conn.busyUntil.back() = end + Tls(disk, numSectors);
+                std::push_heap(conn.busyUntil.begin(), conn.busyUntil.end(),
+                               later);
+            }
+        }
+
+        if (_params.bandwidthMB) {
+            uint64 cost = bytes * 1000000 /
+                          ((uint64)_params.bandwidthMB * 1024 * 1024);
+            LockGuard<ThreadLock> lg(_lock);
+            _nextFree = std::max(_nextFree, end) + cost;
+            return std::max(end + _params.latencyUsec, _nextFree);
+        }
+        return end + _params.latencyUsec;
+    }
+
+    // CPU time in usec the transport model spends on encryption.
+    static uint64 Tls(FileDisk *disk, VixDiskLibSectorType numSectors)
+    {
+        if (disk->conn == NULL) {
+            return 0;
+        }
+        return numSectors * VIXDISKLIB_SECTOR_SIZE *
+               disk->conn->model.tlsUsecPerMB / (1024 * 1024);
+    }
+
+    static void SleepUntil(uint64 deadline)
+    {
+        uint64 now = NowUsec();
+        if (deadline > now) {
+            boost::this_thread::sleep(boost::posix_time::microseconds(deadline - now));
+        }
+    }
+
+    // Does a request once its scheduled time has come: spends the TLS
+    // time, possibly fails it with an injected error, then reads or
+    // writes the file.
+    VixError Access(FileDisk *disk, VixDiskLibSectorType startSector,
+                    VixDiskLibSectorType numSectors, uint8 *buf, bool write)
+    {
+        uint64 tls = Tls(disk, numSectors);
+
+        // Encryption costs CPU, not wall time, so spin instead of sleep;
+        // for async requests on a thread of the pool.
+        for (uint64 now = NowUsec(); NowUsec() - now < tls; ) {
+        }
+        if (_params.errorRate > 0) {
+            LockGuard<ThreadLock> lg(_lock);
+            // xorshift64*
+            _random ^= _random >> 12;
+            _random ^= _random << 25;
+            _random ^= _random >> 27;
+            if ((double)((_random * 2685821657736338717ULL) >> 11) / (1ULL << 53) <
+                _params.errorRate) {
+                return VIX_E_HOST_TCP_CONN_LOST;
+            }
+        }
+        if (write ? !disk->WriteLink(startSector, numSectors, buf)
+                  : !disk->ReadChain(startSector, numSectors, buf)) {
+            return VIX_E_FILE_ERROR;
+        }
+        return VIX_OK;
+    }
+
+    VixError Submit(VixDiskLibHandle diskHandle, VixDiskLibSectorType startSector,
+                    VixDiskLibSectorType numSectors, uint8 *buf, bool write,
+                    VixDiskLibCompletionCB callback, void *cbData)
+    {
+        FileDisk *disk = ToDisk(diskHandle);
+        VixError err = Check(disk, startSector, numSectors, write);
+        FileAsyncRequest req;
+        uint64 deadline, now;
+
+        if (VIX_FAILED(err)) {
+            return err;
+        }
+        req.disk = disk;
+        req.startSector = startSector;
+        req.numSectors = numSectors;
+        req.buf = buf;
+        req.write = write;
+        req.callback = callback;
+        req.cbData = cbData;
+        {
+            LockGuard<ThreadLock> lg(disk->lock);
+            ++disk->pending;
+        }
+        deadline = Schedule(disk, numSectors);
+        now = NowUsec();
+        _async.addTask(boost::bind(&FileBackend::Complete, this, req),
+                       boost::posix_time::microseconds(deadline > now ?
+                                                       deadline - now : 0));
+        return VIX_ASYNC;
+    }
+
+    void Complete(const FileAsyncRequest &req)
+    {
+        VixError err = Access(req.disk, req.startSector, req.numSectors,
+                              req.buf, req.write);
+
+        if (req.callback) {
+            req.callback(req.cbData, err);
+        }
+        LockGuard<ThreadLock> lg(req.disk->lock);
+        --req.disk->pending;
+        req.disk->lock.notifyAll();
+    }
+
+    FileBackendParams _params;
+    uint64 _nextFree;               // usec, end of the last transfer
+    uint64 _random;
+    ThreadLock _lock;               // _nextFree and _random
+    TaskExecutor _async;            // last, so it is joined first
+};
+
+DiskBackend *DiskBackend::NewFile(const FileBackendParams &params)
+{
+    return new FileBackend(params);
+}
+
+static DiskBackend *currentBackend = NULL;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DiskBackend::Get --
+ *
+ *      Returns the current backend, by default VixDiskLib (or the file
+ *      backend in builds without VDDK).
+ *
+ *----------------------------------------------------------------------
+ */
+
+DiskBackend &DiskBackend::Get()
+{
+    if (currentBackend == NULL) {
+#ifdef NO_VDDK
+        currentBackend = NewFile(FileBackendParams());
+#else
+        currentBackend = NewVddk();
+#endif
+    }
+    return *currentBackend;
+}
+
+void DiskBackend::Set(DiskBackend *backend)
+{
+    if (backend != currentBackend) {
+        delete currentBackend;
+        currentBackend = backend;
+    }
+}
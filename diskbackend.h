@@ -0,0 +1,173 @@
+#ifndef DISKBACKEND_H
+#define DISKBACKEND_H
+
+#include <string>
+
+#include "vixDiskLib.h"
+
+// Cost model of a VDDK transport mode, emulated by the file backend on
+// every connection: each request pays a fixed latency, then waits for
+// the connection's wire, which carries one request at a time, and
+// burns CPU for encryption. At most maxConcurrent requests of a
+// connection are in service at once, the others queue.
+struct TransportModel
+{
+    TransportModel()
+       : latencyUsec(0), usecPerMB(0), maxConcurrent(0), tlsUsecPerMB(0)
+    {}
+
+    std::string name;               // reported by GetTransportMode
+    uint32 latencyUsec;             // fixed cost of every request
+    uint32 usecPerMB;               // wire time per MB
+    uint32 maxConcurrent;           // requests in service per connection, 0 = unlimited
+    uint32 tlsUsecPerMB;            // CPU time per MB, e.g. for NBDSSL
+
+    static bool Preset(const std::string &name, TransportModel &model); //nbd, nbdssl, hotadd or san.
+};
+
+// Settings of the file backend, see DiskBackend::NewFile.
+struct FileBackendParams
+{
+    FileBackendParams()
+       : latencyUsec(0), bandwidthMB(0), errorRate(0), seed(0),
+         asyncThreads(16), modelLatencyUsec(-1), modelUsecPerMB(-1),
+         modelMaxConcurrent(-1), modelTlsUsecPerMB(-1)
+    {}
+
+    uint32 latencyUsec;             // added to every read and write
+    uint32 bandwidthMB;             // MB/s shared by all disks, 0 = unlimited
+    double errorRate;               // probability that a read or write fails
+    uint64 seed;                    // for the injected errors
+    uint32 asyncThreads;            // threads completing async requests once due
+
+    // The transport model of a connection is the first mode with a
+    // preset in the transport modes passed to ConnectEx, otherwise the
+    // one named here. Fields that are not -1 override the preset.
+    std::string transport;          // empty = no model
+    int32 modelLatencyUsec;
+    int32 modelUsecPerMB;
+    int32 modelMaxConcurrent;
+    int32 modelTlsUsecPerMB;
+};
+
+// The disk library behind the worker. Every call of the worker goes
+// through the current backend, see DiskLib(). The methods take the same
+// arguments and return the same errors as the VixDiskLib_* functions of
+// the same name.
+//
+// The VDDK backend forwards to the real library. The file backend keeps
+// disks in plain sparse files on the local machine, so the copy, fill
+// and benchmark engines can be run without VDDK and an ESX host, with
+// optional injected latency, bandwidth limit and errors.
+class DiskBackend
+{
+public:
+    virtual ~DiskBackend() {}
+
+    virtual const char *Name() const = 0;
+
+    virtual VixError InitEx(uint32 majorVersion, uint32 minorVersion,
+                            VixDiskLibGenericLogFunc *log,
+                            VixDiskLibGenericLogFunc *warn,
+                            VixDiskLibGenericLogFunc *panic,
+                            const char *libDir, const char *configFile) = 0;
+    virtual VixError Init(uint32 majorVersion, uint32 minorVersion,
+                          VixDiskLibGenericLogFunc *log,
+                          VixDiskLibGenericLogFunc *warn,
+                          VixDiskLibGenericLogFunc *panic,
+                          const char *libDir) = 0;
+    virtual void Exit() = 0;
+    virtual const char *ListTransportModes() = 0;
+
+    virtual VixError Connect(const VixDiskLibConnectParams *connectParams,
+                             VixDiskLibConnection *connection) = 0;
+    virtual VixError ConnectEx(const VixDiskLibConnectParams *connectParams,
+                               Bool readOnly, const char *snapshotRef,
+                               const char *transportModes,
+                               VixDiskLibConnection *connection) = 0;
+    virtual VixError Disconnect(VixDiskLibConnection connection) = 0;
+    virtual VixError PrepareForAccess(const VixDiskLibConnectParams *connectParams,
+                                      const char *identity) = 0;
+    virtual VixError EndAccess(const VixDiskLibConnectParams *connectParams,
+                               const char *identity) = 0;
+
+    virtual VixError Create(const VixDiskLibConnection connection,
+                            const char *path,
+                            const VixDiskLibCreateParams *createParams,
+                            VixDiskLibProgressFunc progressFunc,
+                            void *progressCallbackData) = 0;
+    virtual VixError CreateChild(VixDiskLibHandle diskHandle,
+                                 const char *childPath,
+                                 VixDiskLibDiskType diskType,
+                                 VixDiskLibProgressFunc progressFunc,
+                                 void *progressCallbackData) = 0;
+    virtual VixError Clone(const VixDiskLibConnection dstConnection,
+                           const char *dstPath,
+                           const VixDiskLibConnection srcConnection,
+                           const char *srcPath,
+                           const VixDiskLibCreateParams *createParams,
+                           VixDiskLibProgressFunc progressFunc,
+                           void *progressCallbackData, Bool overWrite) = 0;
+    virtual VixError Unlink(VixDiskLibConnection connection,
+                            const char *path) = 0;
+    virtual VixError CheckRepair(const VixDiskLibConnection connection,
+                                 const char *filename, Bool repair) = 0;
+
+    virtual VixError Open(const VixDiskLibConnection connection,
+                          const char *path, uint32 flags,
+                          VixDiskLibHandle *diskHandle) = 0;
+    virtual VixError Close(VixDiskLibHandle diskHandle) = 0;
+    virtual VixError GetInfo(VixDiskLibHandle diskHandle,
+                             VixDiskLibInfo **info) = 0;
+    virtual void FreeInfo(VixDiskLibInfo *info) = 0;
+    virtual const char *GetTransportMode(VixDiskLibHandle diskHandle) = 0;
+
+    virtual VixError Read(VixDiskLibHandle diskHandle,
+                          VixDiskLibSectorType startSector,
+                          VixDiskLibSectorType numSectors,
+                          uint8 *readBuffer) = 0;
+    virtual VixError Write(VixDiskLibHandle diskHandle,
+                           VixDiskLibSectorType startSector,
+                           VixDiskLibSectorType numSectors,
+                           const uint8 *writeBuffer) = 0;
+    virtual VixError ReadAsync(VixDiskLibHandle diskHandle,
+                               VixDiskLibSectorType startSector,
+                               VixDiskLibSectorType numSectors,
+                               uint8 *readBuffer,
+                               VixDiskLibCompletionCB callback,
+                               void *cbData) = 0;
+    virtual VixError WriteAsync(VixDiskLibHandle diskHandle,
+                                VixDiskLibSectorType startSector,
+                                VixDiskLibSectorType numSectors,
+                                const uint8 *writeBuffer,
+                                VixDiskLibCompletionCB callback,
+                                void *cbData) = 0;
+    virtual VixError Flush(VixDiskLibHandle diskHandle) = 0;
+    virtual VixError Wait(VixDiskLibHandle diskHandle) = 0;
+
+    virtual VixError ReadMetadata(VixDiskLibHandle diskHandle, const char *key,
+                                  char *buf, size_t bufLen,
+                                  size_t *requiredLen) = 0;
+    virtual VixError WriteMetadata(VixDiskLibHandle diskHandle,
+                                   const char *key, const char *val) = 0;
+    virtual VixError GetMetadataKeys(VixDiskLibHandle diskHandle, char *keys,
+                                     size_t maxLen, size_t *requiredLen) = 0;
+
+    virtual char *GetErrorText(VixError err, const char *locale) = 0;
+    virtual void FreeErrorText(char *errMsg) = 0;
+
+    static DiskBackend &Get();                                   //The current backend.
+    static void Set(DiskBackend *backend);                       //Replaces (and deletes) the current backend.
+
+#ifndef NO_VDDK
+    static DiskBackend *NewVddk();                               //Forwards to VixDiskLib.
+#endif
+    static DiskBackend *NewFile(const FileBackendParams &params); //Sparse files on the local machine.
+};
+
+inline DiskBackend &DiskLib()
+{
+    return DiskBackend::Get();
+}
+
+#endif // DISKBACKEND_H
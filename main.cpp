@@ -1,8 +1,15 @@
 #include "vixdisklibsamplegui.h"
+#include "worker.h"
 #include <QApplication>
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1) {                                             //arguments given - run headless, e.g. -batch jobFile
+        QCoreApplication a(argc, argv);
+        worker w;
+        return w.Execute(argc, argv);
+    }
+
     QApplication a(argc, argv);
     vixdisklibsamplegui w;
     w.show();
@@ -0,0 +1,190 @@
+#include "outputcapture.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define dup _dup
+#define dup2 _dup2
+#define close _close
+#define read _read
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+OutputCapture::OutputCapture(size_t maxLines)
+   : ring(maxLines ? maxLines : 1), head(0), count(0), dropped(0),
+     carriageReturn(false), readFd(-1), writeFd(-1), savedOut(-1),
+     savedErr(-1), readerThread(NULL)
+{
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OutputCapture::~OutputCapture --
+ *
+ *      Puts stdout and stderr back and waits for the reader to take
+ *      what is left in the pipe.
+ *
+ *----------------------------------------------------------------------
+ */
+
+OutputCapture::~OutputCapture()
+{
+   if (readerThread == NULL) {
+      return;
+   }
+   fflush(stdout);
+   fflush(stderr);
+   dup2(savedOut, fileno(stdout));
+   dup2(savedErr, fileno(stderr));
+   close(savedOut);
+   close(savedErr);
+   close(writeFd);
+   readerThread->join();
+   delete readerThread;
+   close(readFd);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OutputCapture::start --
+ *
+ *      Points the stdout and stderr descriptors at a pipe read by a
+ *      thread of its own. stdout is made unbuffered so that printf and
+ *      cout output arrives as it is written.
+ *
+ * Results:
+ *      false if the pipe could not be set up; output is not captured.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool OutputCapture::start()
+{
+   int fds[2];
+
+   if (readerThread != NULL) {
+      return true;
+   }
+#ifdef _WIN32
+   // A GUI application starts without valid standard streams.
+   if (fileno(stdout) < 0) {
+      freopen("NUL", "w", stdout);
+   }
+   if (fileno(stderr) < 0) {
+      freopen("NUL", "w", stderr);
+   }
+   if (_pipe(fds, 64 * 1024, _O_BINARY) != 0) {
+      return false;
+   }
+#else
+   if (pipe(fds) != 0) {
+      return false;
+   }
+#endif
+   fflush(stdout);
+   fflush(stderr);
+   savedOut = dup(fileno(stdout));
+   savedErr = dup(fileno(stderr));
+   readFd = fds[0];
+   writeFd = fds[1];
+   dup2(writeFd, fileno(stdout));
+   dup2(writeFd, fileno(stderr));
+   setvbuf(stdout, NULL, _IONBF, 0);
+
+   readerThread = new boost::thread(boost::bind(&OutputCapture::reader, this));
+   return true;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OutputCapture::drain --
+ *
+ *      Moves up to maxLines of the oldest lines into lines.
+ *
+ * Results:
+ *      The number of lines dropped because the buffer was full since
+ *      the last call.
+ *
+ *----------------------------------------------------------------------
+ */
+
+size_t OutputCapture::drain(std::vector<std::string> &lines, size_t maxLines)
+{
+   LockGuard<ThreadLock> lg(lock);
+   size_t lost = dropped;
+
+   for (; count > 0 && maxLines > 0; --count, --maxLines) {
+      lines.push_back(std::string());
+      lines.back().swap(ring[head]);
+      head = (head + 1) % ring.size();
+   }
+   dropped = 0;
+   return lost;
+}
+
+std::string OutputCapture::pending()
+{
+   LockGuard<ThreadLock> lg(lock);
+   return partial;
+}
+
+// Called with the lock held.
+void OutputCapture::push(const std::string &line)
+{
+   if (count == ring.size()) {
+      head = (head + 1) % ring.size();
+      --count;
+      ++dropped;
+   }
+   ring[(head + count) % ring.size()] = line;
+   ++count;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OutputCapture::reader --
+ *
+ *      Splits the pipe into lines until every write end is closed.
+ *      "\r\n" (text mode stdout on Windows) ends a line like "\n"; a
+ *      lone '\r' starts the line over.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void OutputCapture::reader()
+{
+   char buf[4096];
+   int n;
+
+   while ((n = read(readFd, buf, sizeof buf)) > 0) {
+      LockGuard<ThreadLock> lg(lock);
+      for (int i = 0; i < n; ++i) {
+         char c = buf[i];
+         if (carriageReturn && c != '\n') {
+            partial.clear();
+         }
+         carriageReturn = c == '\r';
+         if (c == '\n') {
+            push(partial);
+            partial.clear();
+         } else if (c != '\r') {
+            partial += c;
+         }
+      }
+   }
+
+   LockGuard<ThreadLock> lg(lock);
+   if (!partial.empty()) {
+      push(partial);
+      partial.clear();
+   }
+}
@@ -0,0 +1,45 @@
+#ifndef OUTPUTCAPTURE_H
+#define OUTPUTCAPTURE_H
+
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+
+#include "threadlock.h"
+
+// Captures everything written to stdout and stderr, by the worker or by
+// VixDiskLib, into a ring buffer of lines that the GUI drains in batches
+// on a timer, so the writers never wait for the GUI. Once the buffer is
+// full the oldest lines are dropped. A line that is rewritten with '\r'
+// (progress output) only keeps its latest text.
+class OutputCapture
+{
+   public:
+      explicit OutputCapture(size_t maxLines);
+      ~OutputCapture();
+
+      bool start();                                             //Redirects stdout and stderr into the buffer.
+      size_t drain(std::vector<std::string> &lines,             //Takes up to maxLines lines, returns the lines
+                   size_t maxLines);                            //dropped since the last drain.
+      std::string pending();                                    //The unterminated line, e.g. progress.
+
+   private:
+      void reader();
+      void push(const std::string &line);
+
+      std::vector<std::string> ring;
+      size_t head;                  // oldest line
+      size_t count;
+      size_t dropped;
+      std::string partial;          // line being received
+      bool carriageReturn;          // '\r' seen, '\n' or new text decides
+      int readFd;
+      int writeFd;
+      int savedOut;
+      int savedErr;
+      boost::thread *readerThread;
+      ThreadLock lock;
+};
+
+#endif // OUTPUTCAPTURE_H
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Round trip through the file backend, no VDDK or host needed:
+# -create, -fill, -copy -manifest, -verify, -copy -resume after a copy
+# that failed partway, -incremental and -verify of the child. Also
+# checks that -verify notices a changed disk.
+#
+# Usage: tests/file_backend_roundtrip.sh path/to/vixdisklibsamplegui
+#
+# The executable runs headless when given arguments; build it with
+# "qmake CONFIG+=novddk" where VDDK is not installed.
+
+EXE=${1:?usage: $0 path/to/vixdisklibsamplegui}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/vdlroundtrip.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+run() {
+    echo "+ $*"
+    "$EXE" -backend file "$@" > out.txt 2>&1
+    rc=$?
+    cat out.txt
+    return $rc
+}
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+run -create -cap 64 base.vmdk || fail "create"
+run -fill -start 0 -count 8192 -val 0x5a base.vmdk || fail "fill"
+
+run -copy copy.vmdk -streams 4 -manifest base.manifest base.vmdk || fail "copy"
+run -verify base.manifest copy.vmdk || fail "verify of the copy"
+# A copy that fails partway keeps its journal; run again without the
+# injected errors it skips the chunks the first run copied.
+for seed in 1 2 3 4 5 6 7 8 9 10; do
+    rm -f resumed.vmdk resumed.vmdk.*
+    run -copy resumed.vmdk -resume -fileerrors 0.02 -seed $seed base.vmdk ||
+        [ ! -e resumed.vmdk.journal ] || break
+done
+[ -e resumed.vmdk.journal ] || fail "no copy failed partway"
+run -copy resumed.vmdk -resume base.vmdk || fail "resumed copy"
+grep -q "^Resuming copy" out.txt || fail "the journal was not read"
+grep -q "^Verified [1-9][0-9]* MBytes copied by an earlier run" out.txt ||
+    fail "the resumed copy skipped nothing"
+run -verify base.manifest resumed.vmdk || fail "verify of the resumed copy"
+[ -e resumed.vmdk.journal ] && fail "journal left after the copy"
+
+# Change one chunk of the source; the copy no longer matches it.
+run -fill -start 4096 -count 128 -val 0x33 base.vmdk || fail "second fill"
+run -verify base.manifest base.vmdk && fail "verify missed a changed chunk"
+
+# The child of the copy gets only the changed chunk.
+run -incremental copy.vmdk child.vmdk -base base.manifest \
+    -manifest child.manifest base.vmdk || fail "incremental"
+grep -q "^Wrote 0 MBytes of changed chunks" out.txt &&
+    fail "incremental wrote nothing"
+run -verify child.manifest child.vmdk || fail "verify of the child"
+run -verify child.manifest base.vmdk || fail "verify of the source"
+
+echo "PASS"
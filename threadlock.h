@@ -0,0 +1,144 @@
+#ifndef THREADLOCK_H
+#define THREADLOCK_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+// Mutex plus condition variable. wait() blocks until notified (spurious
+// wakeups are possible, so callers loop on their condition); the timed
+// variant returns false once msec milliseconds have passed.
+class ThreadLock
+{
+   public:
+      ThreadLock()
+      {
+#ifdef _WIN32
+         InitializeCriticalSection(&cs);
+         InitializeConditionVariable(&cond);
+#else
+         pthread_condattr_t attr;
+         pthread_mutex_init(&mutex, NULL);
+         pthread_condattr_init(&attr);
+         pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+         pthread_cond_init(&cond, &attr);
+         pthread_condattr_destroy(&attr);
+#endif
+      }
+      ~ThreadLock()
+      {
+#ifdef _WIN32
+         DeleteCriticalSection(&cs);
+#else
+         pthread_mutex_destroy(&mutex);
+         pthread_cond_destroy(&cond);
+#endif
+      }
+
+      void lock()
+      {
+#ifdef _WIN32
+         EnterCriticalSection(&cs);
+#else
+         pthread_mutex_lock(&mutex);
+#endif
+      }
+      void unlock()
+      {
+#ifdef _WIN32
+         LeaveCriticalSection(&cs);
+#else
+         pthread_mutex_unlock(&mutex);
+#endif
+      }
+      bool wait()
+      {
+#ifdef _WIN32
+         SleepConditionVariableCS(&cond, &cs, INFINITE);
+#else
+         pthread_cond_wait(&cond, &mutex);
+#endif
+         return true;
+      }
+      bool wait(unsigned msec)
+      {
+#ifdef _WIN32
+         return SleepConditionVariableCS(&cond, &cs, msec) != 0;
+#else
+         struct timespec ts;
+         clock_gettime(CLOCK_MONOTONIC, &ts);
+         ts.tv_sec += msec / 1000;
+         ts.tv_nsec += (long)(msec % 1000) * 1000000;
+         if (ts.tv_nsec >= 1000000000) {
+            ++ts.tv_sec;
+            ts.tv_nsec -= 1000000000;
+         }
+         return pthread_cond_timedwait(&cond, &mutex, &ts) == 0;
+#endif
+      }
+      void notify()
+      {
+#ifdef _WIN32
+         WakeConditionVariable(&cond);
+#else
+         pthread_cond_signal(&cond);
+#endif
+      }
+      void notifyAll()
+      {
+#ifdef _WIN32
+         WakeAllConditionVariable(&cond);
+#else
+         pthread_cond_broadcast(&cond);
+#endif
+      }
+   private:
+      ThreadLock(const ThreadLock&);
+      ThreadLock& operator = (const ThreadLock&);
+
+#ifdef _WIN32
+      CRITICAL_SECTION cs;
+      CONDITION_VARIABLE cond;
+#else
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+#endif
+};
+
+struct FakeLock
+{
+   void lock() {}
+   void unlock() {}
+   bool wait()
+   {
+      return false;
+   }
+   bool wait(unsigned /*msec*/)
+   {
+      return false;
+   }
+
+   void notify() {}
+   void notifyAll() {}
+};
+
+template <typename LCK>
+struct LockGuard
+{
+   explicit LockGuard(LCK& l)
+      : lock(l)
+   {
+      lock.lock();
+   }
+   ~LockGuard()
+   {
+      lock.unlock();
+   }
+   private:
+      LCK& lock;
+};
+
+#endif // THREADLOCK_H
@@ -6,22 +6,41 @@
 #include <QSettings>
 #include <QSignalMapper>
 #include <QFileDialog>
+#include <QTimer>
+#include <QStatusBar>
 #include "vixdisklibsamplegui.h"
 #include "ui_vixdisklibsamplegui.h"
 #include "worker.h"
+#include "outputcapture.h"
 #include "sslclient.h"
 
+// Captured output: lines kept until the GUI takes them, lines appended
+// per timer tick, and lines kept in the text widget.
+#define OUTPUT_RING_LINES       20000
+#define OUTPUT_POLL_MSEC        100
+#define OUTPUT_BATCH_LINES      2000
+#define OUTPUT_SCROLLBACK_LINES 10000
 
 vixdisklibsamplegui::vixdisklibsamplegui(QWidget *parent) :
     QMainWindow(parent), ui(new Ui::vixdisklibsamplegui),
     adv(new Ui::Advanced)
 {
+    m_output = new OutputCapture(OUTPUT_RING_LINES);
+    m_output->start();
     m_worker = new worker;
 
     advanced = new QDialog(0,0);
     ui->setupUi(this);
     adv->setupUi(advanced);
     ui->textEdit->setReadOnly(true);
+    ui->textEdit->setMaximumBlockCount(OUTPUT_SCROLLBACK_LINES);
+
+    m_outputTimer = new QTimer(this);
+    connect( m_outputTimer, SIGNAL(timeout()),
+            this, SLOT(drainWorkerOutput()) );
+    m_outputTimer->start(OUTPUT_POLL_MSEC);
+    connect( m_worker, SIGNAL(finished()),
+            this, SLOT(workerFinished()) );                         //re-enable the command buttons
     QDir dir;
     m_sSettingsFile = dir.absolutePath() + "/config.ini";
 
@@ -78,9 +97,6 @@ vixdisklibsamplegui::vixdisklibsamplegui(QWidget *parent) :
 
     connect( ui->hostIPEdit, SIGNAL(editingFinished()),
             this, SLOT(getThumbSlot()),Qt::DirectConnection );      //call sslclient::getThumb if hostname was changed
-
-//    connect( m_worker, SIGNAL(signalStdOut(QString text)),
-//            this, SLOT(printWorkerOutput(text)) );
 }
 
 vixdisklibsamplegui::~vixdisklibsamplegui()
@@ -88,12 +104,16 @@ vixdisklibsamplegui::~vixdisklibsamplegui()
     delete ui;
     delete advanced;
     delete adv;
+    m_worker->wait();                                               //let a running command finish
     delete m_worker;
+    delete m_output;
 }
 
 void vixdisklibsamplegui::ParseArguments()
 {
     ParseInitexConfig();
+    if (m_worker->isRunning())                                //the running command reads appGlobals,
+        return;                                               //the next one parses the fields again
 
     m_worker->appGlobals.host = ui->hostIPEdit->text();       //IP of VC/ESXi
     m_worker->appGlobals.thumbPrint = ui->thumbEdit->text();  //provides a SSL thumbprint string for validation.
@@ -103,6 +123,15 @@ void vixdisklibsamplegui::ParseArguments()
     m_worker->appGlobals.vmxSpec = ui->vmrefEdit->text();     //vmref of the VM
     m_worker->appGlobals.ssMoRef = ui->ssmorefEdit->text();   // Managed object reference of VM snapshot
     m_worker->appGlobals.diskPath = ui->vmdkPathEdit->text(); //path to VMDK
+    m_worker->appGlobals.diskPaths.clear();                   //several VMDKs separated by ';' are benchmarked concurrently
+    if (m_worker->appGlobals.diskPath.contains(";"))
+    {
+        QStringList paths = m_worker->appGlobals.diskPath.split(";", QString::SkipEmptyParts);
+        for (int i = 0; i < paths.size(); ++i)
+            m_worker->appGlobals.diskPaths << paths[i].trimmed();
+        if (!m_worker->appGlobals.diskPaths.isEmpty())
+            m_worker->appGlobals.diskPath = m_worker->appGlobals.diskPaths.last();
+    }
     m_worker->appGlobals.port = ui->portEdit->text().toInt(); //port to use to connect to VC/ESXi host (default = 443)
 
     switch (adv->modeCombo->currentIndex()) {                 //mode string to pass into VixDiskLib_ConnectEx
@@ -123,6 +152,9 @@ void vixdisklibsamplegui::ParseArguments()
     }
     m_worker->appGlobals.blockSize = adv->blocksizeSpin->text().toInt();          //blocksize (in sectors) needed for readbench
                                                                                   // or writebench
+    m_worker->appGlobals.bufSize = m_worker->appGlobals.blockSize;
+    m_worker->appGlobals.queueDepth = adv->qdepthSpin->text().toInt();            //async requests in flight for readbench
+                                                                                  // or writebench (1 = synchronous)
     if (adv->adapterSpin->currentIndex() == 1)
         m_worker->appGlobals.adapterType = VIXDISKLIB_ADAPTER_IDE;                //bus adapter type for 'create' option
                                                                                   //(default='scsi')
@@ -201,9 +233,10 @@ void vixdisklibsamplegui::ParseInitexConfig()
 
 void vixdisklibsamplegui::getThumbSlot()
 {
-    ParseArguments();
-    int port = (m_worker->appGlobals.port) ? m_worker->appGlobals.port : 443;
-    m_sslclient = new sslclient(m_worker->appGlobals.host, port, this);
+    int port = ui->portEdit->text().toInt();                  //from the fields, appGlobals may be in use
+    if (!port)
+        port = 443;
+    m_sslclient = new sslclient(ui->hostIPEdit->text(), port, this);
     QString thumb;
     m_sslclient->run(thumb);
     if (thumb != ui->thumbEdit->text() && thumb != "")
@@ -212,7 +245,64 @@ void vixdisklibsamplegui::getThumbSlot()
 
 void vixdisklibsamplegui::printWorkerOutput(const QString &text)
 {
-    ui->textEdit->append(text);
+    ui->textEdit->appendPlainText(text);
+}
+
+void vixdisklibsamplegui::drainWorkerOutput()
+{
+    std::vector<std::string> lines;
+    size_t dropped = m_output->drain(lines, OUTPUT_BATCH_LINES);
+    QString text;
+
+    if (dropped)
+        text += QString("[%1 lines dropped]\n").arg(dropped);
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        text += QString::fromLocal8Bit(lines[i].c_str());
+        text += '\n';
+    }
+    if (!text.isEmpty())
+    {
+        text.chop(1);                                               //appendPlainText adds the line break
+        printWorkerOutput(text);
+    }
+    statusBar()->showMessage(QString::fromLocal8Bit(m_output->pending().c_str()));
+}
+
+bool vixdisklibsamplegui::workerBusy()
+{
+    if (!m_worker->isRunning())
+        return false;
+    printf("A command is still running.\n");
+    return true;
+}
+
+void vixdisklibsamplegui::runWorker()
+{
+    if (workerBusy())
+        return;
+    setCommandButtonsEnabled(false);                                //until finished()
+    m_worker->start();                                              //worker::run() on its own thread keeps the GUI responsive
+}
+
+void vixdisklibsamplegui::setCommandButtonsEnabled(bool enabled)
+{
+    ui->readbenchButton->setEnabled(enabled);
+    ui->writebenchButton->setEnabled(enabled);
+    ui->createButton->setEnabled(enabled);
+    ui->redoButton->setEnabled(enabled);
+    ui->infoButton->setEnabled(enabled);
+    ui->readmetaButton->setEnabled(enabled);
+    ui->checkButton->setEnabled(enabled);
+    ui->fillButton->setEnabled(enabled);
+    ui->repairButton->setEnabled(enabled);
+    ui->dumpButton->setEnabled(enabled);
+                                                                    //shrink and defragment stay disabled
+}
+
+void vixdisklibsamplegui::workerFinished()
+{
+    setCommandButtonsEnabled(true);
 }
 
 
@@ -236,113 +326,143 @@ void vixdisklibsamplegui::on_libdirBrowseButton_clicked()
 
 void vixdisklibsamplegui::on_readbenchButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;                                  //reset previous value
-    m_worker->appGlobals.command |= COMMAND_READBENCH;
+    if (adv->qdepthSpin->value() > 1)                                  //more than one request in flight - use async
+        m_worker->appGlobals.command |= COMMAND_READASYNCBENCH;
+    else
+        m_worker->appGlobals.command |= COMMAND_READBENCH;
     m_worker->appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_writebenchButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
-    m_worker->appGlobals.command |= COMMAND_WRITEBENCH;
+    if (adv->qdepthSpin->value() > 1)
+        m_worker->appGlobals.command |= COMMAND_WRITEASYNCBENCH;
+    else
+        m_worker->appGlobals.command |= COMMAND_WRITEBENCH;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_createButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_CREATE;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_redoButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_REDO;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_infoButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_INFO;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_readmetaButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_DUMP_META;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_checkButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_CHECKREPAIR;
     m_worker->appGlobals.repair = 0;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_fillButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_FILL;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_shrinkButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_SHRINK;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_defragmentButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_DEFRAG;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_repairButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_CHECKREPAIR;
     m_worker->appGlobals.repair = 1;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::on_dumpButton_clicked()
 {
+    if (workerBusy())                                                  //appGlobals belong to the running command
+        return;
     m_worker->appGlobals.command = 0;
     m_worker->appGlobals.command |= COMMAND_DUMP;
     generateCmd();
     if (!adv->generateCmdCheck->isChecked())
-        m_worker->run();
+        runWorker();
 }
 
 void vixdisklibsamplegui::loadSettings()
@@ -414,6 +534,10 @@ void vixdisklibsamplegui::loadSettings()
     if (bSize)
         adv->blocksizeSpin->setValue(bSize);
 
+    int qDepth = settings.value("qdepth", "").toInt();
+    if (qDepth >= 1)
+        adv->qdepthSpin->setValue(qDepth);
+
     QString adapter = settings.value("adapter", "").toString();
     if (adapter == QString("iSCSI"))
         adv->adapterSpin->setCurrentIndex(0);
@@ -484,15 +608,25 @@ void vixdisklibsamplegui::generateCmd()
     out << "vixDiskLibSample.exe ";
 
     if (m_worker->appGlobals.command == COMMAND_READBENCH ||
-            m_worker->appGlobals.command == COMMAND_WRITEBENCH)
+            m_worker->appGlobals.command == COMMAND_WRITEBENCH ||
+            m_worker->appGlobals.command == COMMAND_READASYNCBENCH ||
+            m_worker->appGlobals.command == COMMAND_WRITEASYNCBENCH)
     {
         if (m_worker->appGlobals.command == COMMAND_READBENCH)
             out << "-readbench ";
-        else
+        else if (m_worker->appGlobals.command == COMMAND_WRITEBENCH)
             out << "-writebench ";
+        else if (m_worker->appGlobals.command == COMMAND_READASYNCBENCH)
+            out << "-readasyncbench ";
+        else
+            out << "-writeasyncbench ";
 
         out << m_worker->appGlobals.blockSize << " ";
 
+        if (m_worker->appGlobals.command == COMMAND_READASYNCBENCH ||
+                m_worker->appGlobals.command == COMMAND_WRITEASYNCBENCH)
+            out << "-qdepth " << m_worker->appGlobals.queueDepth << " ";
+
         if (m_worker->appGlobals.libdir != "")                                    //if libdir was specified
         {
             out << "-libdir ";
@@ -527,10 +661,15 @@ void vixdisklibsamplegui::generateCmd()
             out << "-fill ";
             if (m_worker->appGlobals.filler != 255)
                 out << "-val " << m_worker->appGlobals.filler << " ";
+            if (m_worker->appGlobals.queueDepth > 1)
+                out << "-qdepth " << m_worker->appGlobals.queueDepth << " ";
         }
         else
             out << "-dump ";
 
+        if (m_worker->appGlobals.bufSize)
+            out << "-bufsize " << m_worker->appGlobals.bufSize << " ";
+
         if (m_worker->appGlobals.startSector)
             out << "-start " << m_worker->appGlobals.startSector << " ";
         if (m_worker->appGlobals.numSectors > 1)                                  //1 - is a default value
@@ -594,6 +733,8 @@ void vixdisklibsamplegui::generateCmd()
     out << "-password " << m_worker->appGlobals.password << " ";
     if (m_worker->appGlobals.thumbPrint != "")
         out << "-thumb " << "\"" << m_worker->appGlobals.thumbPrint << "\"" << " ";
+    for (int i = 0; i + 1 < m_worker->appGlobals.diskPaths.size(); ++i)     //all but the last disk go to -disk
+        out << "-disk \"" << m_worker->appGlobals.diskPaths[i] << "\" ";
     out << "\"" << m_worker->appGlobals.diskPath << "\"";
 
     command.close();
@@ -613,7 +754,7 @@ void vixdisklibsamplegui::on_saveSettingsButton_clicked()
     settings.setValue("libdir",         m_worker->appGlobals.libdir);
     settings.setValue("vm",             m_worker->appGlobals.vmxSpec);
     settings.setValue("ssmoref",        m_worker->appGlobals.ssMoRef);
-    settings.setValue("diskPath",       m_worker->appGlobals.diskPath);
+    settings.setValue("diskPath",       ui->vmdkPathEdit->text());      //keeps the whole ";" separated list
     settings.setValue("cap",            m_worker->appGlobals.mbSize);
     settings.setValue("multiThread",    m_worker->appGlobals.numThreads);
 
@@ -645,6 +786,7 @@ void vixdisklibsamplegui::on_saveSettingsButton_clicked()
     }
 
     settings.setValue("blocksize",      m_worker->appGlobals.blockSize);
+    settings.setValue("qdepth",         m_worker->appGlobals.queueDepth);
 
     if (m_worker->appGlobals.adapterType == VIXDISKLIB_ADAPTER_IDE)
         settings.setValue("adapter",    "IDE");
@@ -748,6 +890,7 @@ void vixdisklibsamplegui::on_buttonBox_rejected()
     }
 
     adv->blocksizeSpin->setValue(m_worker->appGlobals.blockSize);                 //blocksize (in sectors) needed for readbench or writebench
+    adv->qdepthSpin->setValue(m_worker->appGlobals.queueDepth);                   //async requests in flight for readbench or writebench
     if (m_worker->appGlobals.adapterType == VIXDISKLIB_ADAPTER_IDE)               //bus adapter type for 'create' option (default='scsi')
         adv->adapterSpin->setCurrentIndex(1);
     else
@@ -10,6 +10,8 @@ class worker;
 class sslclient;
 class QSignalMapper;
 class QFileDialog;
+class QTimer;
+class OutputCapture;
 
 namespace Ui {
 class vixdisklibsamplegui;
@@ -25,12 +27,17 @@ class vixdisklibsamplegui : public QMainWindow
     worker* m_worker;
     QSignalMapper *m_mapper;
     sslclient *m_sslclient;
+    OutputCapture *m_output;                             //stdout and stderr of the worker and VixDiskLib
+    QTimer *m_outputTimer;                               //drains m_output into the text widget
 
 public:
     explicit vixdisklibsamplegui(QWidget *parent = 0);
     ~vixdisklibsamplegui();
     void loadSettings();                                //load settings from config file
     void generateCmd();                                 //generate CMD line to start vixdisklib manually
+    void runWorker();                                   //run the selected command on the worker thread
+    bool workerBusy();                                  //true, with a message, while a command runs
+    void setCommandButtonsEnabled(bool enabled);        //disabled while a command runs
 
 signals:
 
@@ -45,6 +52,10 @@ private slots:
 
     void printWorkerOutput(const QString &text);
 
+    void drainWorkerOutput();                           //append the captured output in one batch
+
+    void workerFinished();                              //the command is done, appGlobals are free again
+
     void on_advancedButton_clicked();
 
     void on_libdirBrowseButton_clicked();
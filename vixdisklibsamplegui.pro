@@ -15,21 +15,47 @@ TEMPLATE = app
 SOURCES += main.cpp\
         vixdisklibsamplegui.cpp \
     worker.cpp \
-    sslclient.cpp
+    connectionpool.cpp \
+    outputcapture.cpp \
+    sslclient.cpp \
+    benchreport.cpp \
+    diskbackend.cpp
 
 HEADERS  += vixdisklibsamplegui.h \
     vm_basic_types.h \
     worker.h \
-    sslclient.h
+    sslclient.h \
+    benchreport.h \
+    diskbackend.h \
+    threadlock.h \
+    connectionpool.h \
+    outputcapture.h
 
 FORMS    += vixdisklibsamplegui.ui \
     advanced.ui
 
-INCLUDEPATH +=  c:/source/boost_1_63_0
-LIBS += c:/source/vixdisklibsamplegui/vixdisklibsamplegui\vixDiskLib.lib
+# "qmake CONFIG+=novddk" builds with the file backend only, without VDDK
+novddk {
+    DEFINES += NO_VDDK
+}
 
-LIBS += -Lc:/source/boost_1_63_0/stage/lib \
-        -Llibboost_system-vc140-mt-s-1_63
+win32 {
+    INCLUDEPATH +=  c:/source/boost_1_63_0
+    !novddk: LIBS += c:/source/vixdisklibsamplegui/vixdisklibsamplegui\vixDiskLib.lib
+
+    LIBS += -Lc:/source/boost_1_63_0/stage/lib \
+            -Llibboost_system-vc140-mt-s-1_63
+
+    # AdjustTokenPrivileges for -hugepages
+    LIBS += -ladvapi32
+}
+
+# Boost and VDDK from the system, e.g. libboost-thread-dev and the VDDK
+# tarball's lib64 in the linker path.
+unix {
+    !novddk: LIBS += -lvixDiskLib
+    LIBS += -lboost_thread -lboost_system -lpthread -ldl
+}
 
 CONFIG += c++11
 
@@ -1,4 +1,5 @@
 #include "worker.h"
+#include "connectionpool.h"
 #include <QDebug>
 #include <QCoreApplication>
 #include <QFileInfo>
@@ -31,15 +32,70 @@ void worker::InitBuffer(uint32 *buf, uint32 numElems)
     }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * IsZeroBuffer --
+ *
+ *      Checks whether n bytes are all zero. Uses SSE2 when available,
+ *      testing 256 bytes per step so that non-zero data bails out early.
+ *
+ * Results:
+ *      true if every byte of buf is zero.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool worker::IsZeroBuffer(const uint8 *buf, size_t n)
+{
+    size_t i = 0;
+
+#ifdef VIX_HAVE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 256 <= n; i += 256) {
+        const __m128i *p = (const __m128i *)(buf + i);
+        __m128i acc = _mm_loadu_si128(p);
+        for (int k = 1; k < 16; k++) {
+            acc = _mm_or_si128(acc, _mm_loadu_si128(p + k));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+            return false;
+        }
+    }
+#endif
+    for (; i + sizeof(uint64) <= n; i += sizeof(uint64)) {
+        uint64 v;
+        memcpy(&v, buf + i, sizeof v);
+        if (v != 0) {
+            return false;
+        }
+    }
+    for (; i < n; i++) {
+        if (buf[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Serializes VixDiskLib_Open/Close between the multi-threaded copy threads.
+static ThreadLock openLock;
+
 /*
  *----------------------------------------------------------------------
  *
  * PrepareThreadData --
  *
- *      Open the source and destination disk for multi threaded copy.
+ *      Open the source and destination disk for multi threaded copy,
+ *      connecting first if appGlobals.perThreadConnection is set. Runs
+ *      on a setup thread, concurrently for all copy threads.
  *
  * Results:
- *      Fills in ThreadData in td.
+ *      Fills in ThreadData in td; td.error is set on failure.
  *
  * Side effects:
  *      None.
@@ -52,35 +108,61 @@ void worker::PrepareThreadData(VixDiskLibConnection &dstConnection, ThreadData &
     VixError vixError;
     VixDiskLibCreateParams createParams;
     VixDiskLibInfo *info = NULL;
-    string prefixName,randomFilename;
-
-    prefixName = "c:\\test";
-    GenerateRandomFilename(prefixName, randomFilename);
-    td.dstDisk = randomFilename;
-
-    vixError = VixDiskLib_Open(appGlobals.connection,
-                               appGlobals.diskPath.toUtf8().constData(),
-                               appGlobals.openFlags,
-                               &td.srcHandle);
-    CHECK_AND_THROW(vixError);
+    uint64 start;
 
-    vixError = VixDiskLib_GetInfo(td.srcHandle, &info);
-    CHECK_AND_THROW(vixError);
-    td.numSectors = info->capacity;
-    VixDiskLib_FreeInfo(info);
+    try {
+        td.srcConnection = appGlobals.connection;
+        if (appGlobals.perThreadConnection) {
+            start = GetTimeUsec();
+            vixError = Connect(td.srcConnection);
+            td.connectTime = GetTimeUsec() - start;
+            if (VIX_FAILED(vixError)) {
+                td.srcConnection = NULL;
+            }
+            CHECK_AND_THROW(vixError);
+        }
 
-    createParams.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
-    createParams.capacity = td.numSectors;
-    createParams.diskType = VIXDISKLIB_DISK_SPLIT_SPARSE;
-    createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+        start = GetTimeUsec();
+        {
+            // VDDK wants Open and Close serialized between threads.
+            LockGuard<ThreadLock> lg(openLock);
+            vixError = DiskLib().Open(td.srcConnection,
+                                      appGlobals.diskPath.toUtf8().constData(),
+                                      appGlobals.openFlags,
+                                      &td.srcHandle);
+        }
+        td.openTime = GetTimeUsec() - start;
+        CHECK_AND_THROW(vixError);
 
-    vixError = VixDiskLib_Create(dstConnection, td.dstDisk.c_str(),
-                                 &createParams, NULL, NULL);
-    CHECK_AND_THROW(vixError);
+        vixError = DiskLib().GetInfo(td.srcHandle, &info);
+        CHECK_AND_THROW(vixError);
+        td.numSectors = info->capacity;
+        DiskLib().FreeInfo(info);
+
+        createParams.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
+        createParams.capacity = td.numSectors;
+        createParams.diskType = VIXDISKLIB_DISK_SPLIT_SPARSE;
+        createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+        start = GetTimeUsec();
+        vixError = DiskLib().Create(dstConnection, td.dstDisk.c_str(),
+                                    &createParams, NULL, NULL);
+        td.createTime = GetTimeUsec() - start;
+        CHECK_AND_THROW(vixError);
 
-    vixError = VixDiskLib_Open(dstConnection, td.dstDisk.c_str(), 0,
-                               &td.dstHandle);
-    CHECK_AND_THROW(vixError);
+        start = GetTimeUsec();
+        {
+            LockGuard<ThreadLock> lg(openLock);
+            vixError = DiskLib().Open(dstConnection, td.dstDisk.c_str(), 0,
+                                      &td.dstHandle);
+        }
+        td.openTime += GetTimeUsec() - start;
+        CHECK_AND_THROW(vixError);
+    } catch (const VixDiskLibErrWrapper& e) {
+        cout << "PrepareThreadData (" << td.dstDisk << ") Error: " << e.ErrorCode()
+             << " " << e.Description() << "\n";
+        td.error = e.ErrorCode();
+    }
 }
 
 /*
@@ -99,26 +181,292 @@ void worker::PrepareThreadData(VixDiskLibConnection &dstConnection, ThreadData &
  *----------------------------------------------------------------------
  */
 
-void worker::PrintStat(bool read, timeval start, timeval end, uint32 numSectors)
+void worker::PrintStat(bool read, uint64 start, uint64 end, uint64 numSectors)
 {
     uint64 elapsed;
-    uint32 speed;
+    double speed;
 
-    elapsed = ((uint64)end.tv_sec * 1000000 + end.tv_usec -
-               ((uint64)start.tv_sec * 1000000 + start.tv_usec)) / 1000;
+    elapsed = end - start;
     if (elapsed == 0) {
        elapsed = 1;
     }
-    speed = (1000 * VIXDISKLIB_SECTOR_SIZE * (uint64)numSectors) / (1024 * 1024 * elapsed);
-    printf("%s %d MBytes in %d msec (%d MBytes/sec)\n", read ? "Read" : "Wrote",
-           (uint32)(numSectors /(2048)), (uint32)elapsed, speed);
+    speed = ((double)VIXDISKLIB_SECTOR_SIZE * numSectors * 1000000) /
+            ((double)(1024 * 1024) * elapsed);
+    printf("%s %llu MBytes in %llu msec (%.1f MBytes/sec)\n", read ? "Read" : "Wrote",
+           (unsigned long long)(numSectors / 2048),
+           (unsigned long long)(elapsed / 1000), speed);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintLatency --
+ *
+ *      Print per-request latency percentiles for read/write benchmarks.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::PrintLatency(const LatencyHistogram &latency)
+{
+    if (latency.count() == 0) {
+       return;
+    }
+    printf("  latency usec: p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu "
+           "(%llu requests)\n",
+           (unsigned long long)latency.percentile(50),
+           (unsigned long long)latency.percentile(90),
+           (unsigned long long)latency.percentile(99),
+           (unsigned long long)latency.percentile(99.9),
+           (unsigned long long)latency.max(),
+           (unsigned long long)latency.count());
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitReport --
+ *
+ *      Records the benchmark configuration (transport mode, buffer
+ *      size, open flags, compression) as the report's config section.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::InitReport(BenchReport &report, const char *command,
+                        VixDiskLibHandle handle)
+{
+    const char *compression;
+    char buf[64];
+    time_t now = time(NULL);
+
+    switch (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_COMPRESSION_MASK) {
+    case 0:
+       compression = "none";
+       break;
+    case VIXDISKLIB_FLAG_OPEN_COMPRESSION_ZLIB:
+       compression = "zlib";
+       break;
+    case VIXDISKLIB_FLAG_OPEN_COMPRESSION_FASTLZ:
+       compression = "fastlz";
+       break;
+    case VIXDISKLIB_FLAG_OPEN_COMPRESSION_SKIPZ:
+       compression = "skipz";
+       break;
+    default:
+       compression = "unknown";
+       break;
+    }
+
+    strftime(buf, sizeof buf, "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    report.setConfig("timestamp", buf);
+    report.setConfig("command", command);
+    report.setConfig("host", appGlobals.isRemote ?
+                     appGlobals.host.toStdString() : std::string("local"));
+    report.setConfig("disk", appGlobals.diskPaths.size() > 1 ?
+                     appGlobals.diskPaths.join(";").toStdString() :
+                     appGlobals.diskPath.toStdString());
+    report.setConfig("transport_mode", handle ?
+                     std::string(DiskLib().GetTransportMode(handle)) :
+                     appGlobals.transportModes.toStdString());
+    report.setConfig("backend", DiskLib().Name());
+    report.setConfig("buf_sectors", (uint64)appGlobals.bufSize);
+    report.setConfig("buf_bytes", (uint64)appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE);
+    report.setConfig("queue_depth", (uint64)appGlobals.queueDepth);
+    sprintf(buf, "0x%x", appGlobals.openFlags);
+    report.setConfig("open_flags", buf);
+    report.setConfig("compression", compression);
+    report.setConfig("large_pages", IoMemory::largePages ? "yes" : "no");
+    report.setConfig("pattern", AccessPattern::Name(appGlobals.accessPattern));
+    if (appGlobals.accessPattern == AccessPattern::STRIDED) {
+       report.setConfig("stride_blocks", (uint64)appGlobals.strideBlocks);
+    }
+    if (appGlobals.accessPattern == AccessPattern::ZIPF) {
+       sprintf(buf, "%g", appGlobals.zipfTheta);
+       report.setConfig("zipf_theta", buf);
+    }
+    report.setConfig("seed", appGlobals.seed);
+    report.setConfig("offset_mbytes", (uint64)appGlobals.offsetMB);
+    report.setConfig("working_set_mbytes", (uint64)appGlobals.workingSetMB);
+    report.setConfig("duration_sec", (uint64)appGlobals.benchSeconds);
+    report.setConfig("max_mbytes", (uint64)appGlobals.benchMBytes);
+    report.setConfig("warmup_sec", (uint64)appGlobals.warmupSeconds);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriteReport --
+ *
+ *      Writes the benchmark results to appGlobals.resultsFile, if set.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::WriteReport(const BenchReport &report)
+{
+    if (appGlobals.resultsFile == "") {
+       return;
+    }
+    if (!report.write(appGlobals.resultsFile.toUtf8().constData())) {
+       printf("Error: could not write results to %s\n",
+              appGlobals.resultsFile.toUtf8().constData());
+       return;
+    }
+    printf("Results written to %s\n", appGlobals.resultsFile.toUtf8().constData());
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintSeed --
+ *
+ *      Print the seed of random access patterns so that a run can be
+ *      repeated with -seed.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::PrintSeed()
+{
+    if (appGlobals.accessPattern == AccessPattern::RANDOM ||
+        appGlobals.accessPattern == AccessPattern::ZIPF) {
+       printf("Using %s access with seed %llu.\n",
+              AccessPattern::Name(appGlobals.accessPattern),
+              (unsigned long long)appGlobals.seed);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoMemory::EnableLargePages --
+ *
+ *      Turns on largePages. On Windows, MEM_LARGE_PAGES also needs the
+ *      "Lock pages in memory" (SeLockMemoryPrivilege) right to be enabled
+ *      in the process token; the account must have been granted it.
+ *
+ * Results:
+ *      false, with largePages left off, if large pages are unavailable.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool IoMemory::EnableLargePages()
+{
+#ifdef _WIN32
+    HANDLE token;
+    TOKEN_PRIVILEGES tp;
+    DWORD err;
+
+    if (GetLargePageMinimum() == 0) {
+       printf("Large pages are not supported, using normal pages.\n");
+       return false;
+    }
+    if (!OpenProcessToken(GetCurrentProcess(),
+                          TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+       printf("Large pages are unavailable (OpenProcessToken error %lu), "
+              "using normal pages.\n", GetLastError());
+       return false;
+    }
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    // AdjustTokenPrivileges succeeds even when the right is not granted;
+    // only the last error, ERROR_NOT_ALL_ASSIGNED, tells.
+    if (!LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME,
+                              &tp.Privileges[0].Luid) ||
+        !AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) ||
+        GetLastError() != ERROR_SUCCESS) {
+       err = GetLastError();
+    } else {
+       err = ERROR_SUCCESS;
+    }
+    CloseHandle(token);
+    if (err != ERROR_SUCCESS) {
+       printf("Large pages are unavailable: the account lacks the \"Lock "
+              "pages in memory\" right (error %lu), using normal pages.\n",
+              err);
+       return false;
+    }
+#endif
+    largePages = true;
+    return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IoMemory::LargePageSize --
+ *
+ *      Asks the OS for its huge/large page size: GetLargePageMinimum on
+ *      Windows, the Hugepagesize line of /proc/meminfo elsewhere. The
+ *      answer is read once.
+ *
+ * Results:
+ *      The size in bytes, 0 if the system has no large pages.
+ *
+ *----------------------------------------------------------------------
+ */
+
+size_t IoMemory::LargePageSize()
+{
+#ifdef _WIN32
+    return GetLargePageMinimum();
+#else
+    static size_t size = (size_t)-1;
+    if (size == (size_t)-1) {
+       size_t found = 0;
+       FILE *f = fopen("/proc/meminfo", "r");
+       if (f != NULL) {
+          char line[128];
+          unsigned long kb;
+          while (fgets(line, sizeof line, f) != NULL) {
+             if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                found = (size_t)kb * 1024;
+                break;
+             }
+          }
+          fclose(f);
+       }
+       size = found;
+    }
+    return size;
+#endif
 }
 
 //definition for static members
 
 WorkerConfig worker::appGlobals;
-VixDiskLibConnectParams worker::cnxParams;
+bool IoMemory::largePages = false;
+const char CopyJournal::MAGIC[8] = { 'V', 'D', 'L', 'J', 'R', 'N', 'L', '1' };
+const char ChunkManifest::HASH_NAME[] = "xxh64";
 bool worker::bVixInit;
+ConnectionPool worker::connPool;
 
 
 worker::worker()
@@ -135,14 +483,31 @@ worker::worker()
     appGlobals.filler = 0xff;
     appGlobals.openFlags = 0;
     appGlobals.numThreads = 1;
+    appGlobals.copyDepth = DEFAULT_COPY_DEPTH;
+    appGlobals.numWorkers = 0;
+    appGlobals.numStreams = DEFAULT_COPY_STREAMS;
+    appGlobals.resume = false;
+    appGlobals.hashThreads = DEFAULT_HASH_THREADS;
+    appGlobals.idleTimeout = DEFAULT_IDLE_TIMEOUT;
+    appGlobals.segmentSize = 0;
+    appGlobals.perThreadConnection = false;
+    appGlobals.fileBackend = false;
+    appGlobals.backendGiven = false;
+    appGlobals.skipZero = true;
+    appGlobals.benchSeconds = 0;
+    appGlobals.benchMBytes = 0;
+    appGlobals.warmupSeconds = 0;
+    appGlobals.offsetMB = 0;
+    appGlobals.accessPattern = AccessPattern::SEQUENTIAL;
+    appGlobals.strideBlocks = 8;
+    appGlobals.zipfTheta = 0.99;
+    appGlobals.workingSetMB = 0;
     appGlobals.success = true;
     appGlobals.isRemote = false;
 
     // Initialize random generator
-    struct timeval time;
-    gettimeofday(&time, NULL);
-
-    srand((time.tv_sec * 1000) + (time.tv_usec/1000));
+    srand((unsigned)(time(NULL) ^ GetTimeUsec()));
+    appGlobals.seed = (uint64)time(NULL) ^ GetTimeUsec();
 
 }
 
@@ -150,26 +515,11 @@ worker::~worker()
 {
     delete m_thread;
 
-    VixError vixError;
-    if (appGlobals.vmxSpec != NULL) {
-       vixError = VixDiskLib_EndAccess(&cnxParams, "Sample");
-    }
-    if (appGlobals.connection != NULL) {
-       VixDiskLib_Disconnect(appGlobals.connection);
-    }
+    connPool.shutdown();
+    appGlobals.connection = NULL;
     if (bVixInit) {
-       VixDiskLib_Exit();
-    }
-    if (cnxParams.vmxSpec)
-        delete[] cnxParams.vmxSpec;
-    if (cnxParams.serverName)
-        delete[] cnxParams.serverName;
-    if (cnxParams.creds.uid.userName)
-        delete[] cnxParams.creds.uid.userName;
-    if (cnxParams.creds.uid.password)
-        delete[] cnxParams.creds.uid.password;
-    if (cnxParams.thumbPrint)
-        delete[] cnxParams.thumbPrint;
+       DiskLib().Exit();
+    }
 }
 
 
@@ -192,6 +542,7 @@ worker::~worker()
 int worker::ParseArguments(int argc, char *argv[])
 {
     int i;
+    appGlobals.backendGiven = false;
     if (argc < 3) {
         printf("Error: Too few arguments. See usage below.\n\n");
         return PrintUsage();
@@ -285,6 +636,75 @@ int worker::ParseArguments(int argc, char *argv[])
             }
             appGlobals.srcPath = argv[++i];
             appGlobals.command |= COMMAND_CLONE;
+        } else if (!strcmp(argv[i], "-copy")) {
+            if (i >= argc - 2) {
+                printf("Error: The -copy command requires the path of the "
+                       "destination vmdk to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.dstPath = argv[++i];
+            appGlobals.command |= COMMAND_COPY;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-verify")) {
+            if (i >= argc - 2) {
+                printf("Error: The -verify command requires the path of the "
+                       "manifest to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.manifestPath = argv[++i];
+            appGlobals.command |= COMMAND_VERIFY;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-incremental")) {
+            if (i >= argc - 3) {
+                printf("Error: The -incremental command requires the paths of "
+                       "the parent and of the child vmdk to be specified. See "
+                       "usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.parentPath = argv[++i];
+            appGlobals.dstPath = argv[++i];
+            appGlobals.command |= COMMAND_INCREMENTAL;
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-base")) {
+            if (i >= argc - 2) {
+                printf("Error: The -base option requires the path of the "
+                       "manifest to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.baseManifestPath = argv[++i];
+        } else if (!strcmp(argv[i], "-manifest")) {
+            if (i >= argc - 2) {
+                printf("Error: The -manifest option requires the path of the "
+                       "manifest to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.manifestPath = argv[++i];
+        } else if (!strcmp(argv[i], "-hashthreads")) {
+            if (i >= argc - 2) {
+                printf("Error: The -hashthreads option requires the number of "
+                       "threads to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.hashThreads = strtol(argv[++i], NULL, 0);
+            if (appGlobals.hashThreads == 0) {
+                appGlobals.hashThreads = 1;
+            }
+        } else if (!strcmp(argv[i], "-idletimeout")) {
+            if (i >= argc - 2) {
+                printf("Error: The -idletimeout option requires a time in "
+                       "seconds to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.idleTimeout = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-resume")) {
+            appGlobals.resume = true;
+        } else if (!strcmp(argv[i], "-streams")) {
+            if (i >= argc - 2) {
+                printf("Error: The -streams option requires the number of "
+                       "streams to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.numStreams = strtol(argv[++i], NULL, 0);
         } else if (!strcmp(argv[i], "-readbench")) {
             if (0 && i >= argc - 2) {
                 printf("Error: The -readbench command requires a block size "
@@ -302,72 +722,331 @@ int worker::ParseArguments(int argc, char *argv[])
             }
             appGlobals.bufSize = strtol(argv[++i], NULL, 0);
             appGlobals.command |= COMMAND_WRITEBENCH;
-        } else if (!strcmp(argv[i], "-multithread")) {
+        } else if (!strcmp(argv[i], "-readasyncbench")) {
             if (i >= argc - 2) {
-                printf("Error: The -multithread option requires the number "
-                       "of threads to be specified. See usage below.\n\n");
+                printf("Error: The -readasyncbench command requires a block "
+                       "size (in sectors) to be specified. See usage below.\n\n");
                 return PrintUsage();
             }
-            appGlobals.command |= COMMAND_MULTITHREAD;
-            appGlobals.numThreads = strtol(argv[++i], NULL, 0);
+            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
+            appGlobals.command |= COMMAND_READASYNCBENCH;
             appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-host")) {
+        } else if (!strcmp(argv[i], "-writeasyncbench")) {
             if (i >= argc - 2) {
-                printf("Error: The -host option requires the IP address "
-                       "or name of the host to be specified. "
-                       "See usage below.\n\n");
+                printf("Error: The -writeasyncbench command requires a block "
+                       "size (in sectors) to be specified. See usage below.\n\n");
                 return PrintUsage();
             }
-            appGlobals.host = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-user")) {
+            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
+            appGlobals.command |= COMMAND_WRITEASYNCBENCH;
+        } else if (!strcmp(argv[i], "-readsweep") ||
+                   !strcmp(argv[i], "-writesweep")) {
+            bool read = !strcmp(argv[i], "-readsweep");
+            if (i >= argc - 3 ||
+                !ParseList(argv[i + 1], appGlobals.sweepBufSizes) ||
+                !ParseList(argv[i + 2], appGlobals.sweepDepths)) {
+                printf("Error: The %s command requires comma separated lists "
+                       "of block sizes (in sectors) and queue depths to be "
+                       "specified. See usage below.\n\n", argv[i]);
+                return PrintUsage();
+            }
+            i += 2;
+            if (read) {
+                appGlobals.command |= COMMAND_READSWEEP;
+                appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            } else {
+                appGlobals.command |= COMMAND_WRITESWEEP;
+            }
+        } else if (!strcmp(argv[i], "-pattern")) {
             if (i >= argc - 2) {
-                printf("Error: The -user option requires a username "
-                       "to be specified. See usage below.\n\n");
+                printf("Error: The -pattern option requires one of seq, "
+                       "random, stride or zipf. See usage below.\n\n");
                 return PrintUsage();
             }
-            appGlobals.userName = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-password")) {
+            ++i;
+            if (!strcmp(argv[i], "seq")) {
+                appGlobals.accessPattern = AccessPattern::SEQUENTIAL;
+            } else if (!strcmp(argv[i], "random")) {
+                appGlobals.accessPattern = AccessPattern::RANDOM;
+            } else if (!strcmp(argv[i], "stride")) {
+                appGlobals.accessPattern = AccessPattern::STRIDED;
+            } else if (!strcmp(argv[i], "zipf")) {
+                appGlobals.accessPattern = AccessPattern::ZIPF;
+            } else {
+                printf("Error: Unknown access pattern: %s\n", argv[i]);
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-stride")) {
             if (i >= argc - 2) {
-                printf("Error: The -password option requires a password "
+                printf("Error: The -stride option requires the distance "
+                       "in blocks to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.strideBlocks = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-zipf")) {
+            if (i >= argc - 2) {
+                printf("Error: The -zipf option requires the skew "
                        "to be specified. See usage below.\n\n");
                 return PrintUsage();
             }
-            appGlobals.password = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-thumb")) {
+            appGlobals.zipfTheta = strtod(argv[++i], NULL);
+            if (appGlobals.zipfTheta <= 0 || appGlobals.zipfTheta >= 1) {
+                printf("Error: The -zipf skew must be between 0 and 1.\n\n");
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-seed")) {
             if (i >= argc - 2) {
-                printf("Error: The -thumb option requires an SSL thumbprint "
+                printf("Error: The -seed option requires a number "
                        "to be specified. See usage below.\n\n");
-               return PrintUsage();
+                return PrintUsage();
             }
-            appGlobals.thumbPrint = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-port")) {
+            appGlobals.seed = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-workingset")) {
             if (i >= argc - 2) {
-                printf("Error: The -port option requires the host's port "
-                       "number to be specified. See usage below.\n\n");
+                printf("Error: The -workingset option requires the size "
+                       "in MBytes to be specified. See usage below.\n\n");
                 return PrintUsage();
             }
-            appGlobals.port = strtol(argv[++i], NULL, 0);
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-nfchostport")) {
-           if (i >= argc - 2) {
-              return PrintUsage();
-           }
-           appGlobals.nfcHostPort = strtol(argv[++i], NULL, 0);
-           appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-vm")) {
+            appGlobals.workingSetMB = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-duration")) {
             if (i >= argc - 2) {
-                printf("Error: The -vm option requires the moref id of "
-                       "the vm to be specified. See usage below.\n\n");
+                printf("Error: The -duration option requires the number of "
+                       "seconds to be specified. See usage below.\n\n");
                 return PrintUsage();
             }
-            appGlobals.vmxSpec = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-libdir")) {
-           if (i >= argc - 2) {
+            appGlobals.benchSeconds = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-maxmb")) {
+            if (i >= argc - 2) {
+                printf("Error: The -maxmb option requires the number of "
+                       "MBytes to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.benchMBytes = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-warmup")) {
+            if (i >= argc - 2) {
+                printf("Error: The -warmup option requires the number of "
+                       "seconds to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.warmupSeconds = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-offset")) {
+            if (i >= argc - 2) {
+                printf("Error: The -offset option requires the start of the "
+                       "window in MBytes to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.offsetMB = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-qdepth")) {
+            if (i >= argc - 2) {
+                printf("Error: The -qdepth option requires the number of "
+                       "requests in flight to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.queueDepth = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-disk")) {
+            if (i >= argc - 2) {
+                printf("Error: The -disk option requires the path of an "
+                       "additional vmdk to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.diskPaths << argv[++i];
+        } else if (!strcmp(argv[i], "-multithread")) {
+            if (i >= argc - 2) {
+                printf("Error: The -multithread option requires the number "
+                       "of threads to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.command |= COMMAND_MULTITHREAD;
+            appGlobals.numThreads = strtol(argv[++i], NULL, 0);
+            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-chunk")) {
+            if (i >= argc - 2) {
+                printf("Error: The -chunk option requires the chunk size "
+                       "(in sectors) to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.chunkSize = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-copydepth")) {
+            if (i >= argc - 2) {
+                printf("Error: The -copydepth option requires the number of "
+                       "chunks in flight to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.copyDepth = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-bufsize")) {
+            if (i >= argc - 2) {
+                printf("Error: The -bufsize option requires the buffer size "
+                       "(in sectors) to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-dumpfile")) {
+            if (i >= argc - 2) {
+                printf("Error: The -dumpfile option requires a file name "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.dumpFile = argv[++i];
+        } else if (!strcmp(argv[i], "-results")) {
+            if (i >= argc - 2) {
+                printf("Error: The -results option requires a file name "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.resultsFile = argv[++i];
+        } else if (!strcmp(argv[i], "-backend")) {
+            if (i >= argc - 2 ||
+                (strcmp(argv[i + 1], "vddk") && strcmp(argv[i + 1], "file"))) {
+                printf("Error: The -backend option requires 'vddk' or 'file' "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileBackend = !strcmp(argv[++i], "file");
+            appGlobals.backendGiven = true;
+        } else if (!strcmp(argv[i], "-filelatency")) {
+            if (i >= argc - 2) {
+                printf("Error: The -filelatency option requires a latency in "
+                       "usec to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.latencyUsec = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-fileasyncthreads")) {
+            if (i >= argc - 2) {
+                printf("Error: The -fileasyncthreads option requires the number "
+                       "of threads to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.asyncThreads = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-filebandwidth")) {
+            if (i >= argc - 2) {
+                printf("Error: The -filebandwidth option requires a bandwidth "
+                       "in MB/s to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.bandwidthMB = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-fileerrors")) {
+            if (i >= argc - 2) {
+                printf("Error: The -fileerrors option requires an error rate "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.errorRate = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-model")) {
+            TransportModel model;
+            if (i >= argc - 2 || !TransportModel::Preset(argv[i + 1], model)) {
+                printf("Error: The -model option requires 'nbd', 'nbdssl', "
+                       "'hotadd' or 'san' to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.transport = argv[++i];
+        } else if (!strcmp(argv[i], "-modellatency")) {
+            if (i >= argc - 2) {
+                printf("Error: The -modellatency option requires a latency in "
+                       "usec to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.modelLatencyUsec = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-modelwire")) {
+            if (i >= argc - 2) {
+                printf("Error: The -modelwire option requires a time in "
+                       "usec per MB to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.modelUsecPerMB = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-modelconcurrency")) {
+            if (i >= argc - 2) {
+                printf("Error: The -modelconcurrency option requires a number "
+                       "of requests to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.modelMaxConcurrent = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-modeltls")) {
+            if (i >= argc - 2) {
+                printf("Error: The -modeltls option requires a CPU time in "
+                       "usec per MB to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.fileParams.modelTlsUsecPerMB = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-hugepages")) {
+            if (!IoMemory::largePages) {
+                IoMemory::EnableLargePages();
+            }
+        } else if (!strcmp(argv[i], "-workers")) {
+            if (i >= argc - 2) {
+                printf("Error: The -workers option requires the number of "
+                       "workers to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.numWorkers = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-segment")) {
+            if (i >= argc - 2) {
+                printf("Error: The -segment option requires the segment size "
+                       "(in sectors) to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.segmentSize = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-perthreadconn")) {
+            appGlobals.perThreadConnection = true;
+        } else if (!strcmp(argv[i], "-noskipzero")) {
+            appGlobals.skipZero = false;
+        } else if (!strcmp(argv[i], "-host")) {
+            if (i >= argc - 2) {
+                printf("Error: The -host option requires the IP address "
+                       "or name of the host to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.host = argv[++i];
+            appGlobals.isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-user")) {
+            if (i >= argc - 2) {
+                printf("Error: The -user option requires a username "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.userName = argv[++i];
+            appGlobals.isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-password")) {
+            if (i >= argc - 2) {
+                printf("Error: The -password option requires a password "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.password = argv[++i];
+            appGlobals.isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-thumb")) {
+            if (i >= argc - 2) {
+                printf("Error: The -thumb option requires an SSL thumbprint "
+                       "to be specified. See usage below.\n\n");
+               return PrintUsage();
+            }
+            appGlobals.thumbPrint = argv[++i];
+            appGlobals.isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-port")) {
+            if (i >= argc - 2) {
+                printf("Error: The -port option requires the host's port "
+                       "number to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.port = strtol(argv[++i], NULL, 0);
+            appGlobals.isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-nfchostport")) {
+           if (i >= argc - 2) {
+              return PrintUsage();
+           }
+           appGlobals.nfcHostPort = strtol(argv[++i], NULL, 0);
+           appGlobals.isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-vm")) {
+            if (i >= argc - 2) {
+                printf("Error: The -vm option requires the moref id of "
+                       "the vm to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            appGlobals.vmxSpec = argv[++i];
+            appGlobals.isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-libdir")) {
+           if (i >= argc - 2) {
               printf("Error: The -libdir option requires the folder location "
                      "of the VDDK installation to be specified. "
                      "See usage below.\n\n");
@@ -403,6 +1082,8 @@ int worker::ParseArguments(int argc, char *argv[])
                 return PrintUsage();
             }
             appGlobals.transportModes = argv[++i];
+        } else if (!strcmp(argv[i], "-batch")) {
+            appGlobals.command |= COMMAND_BATCH;
         } else if (!strcmp(argv[i], "-check")) {
             if (i >= argc - 2) {
                 printf("Error: The -check command requires a true or false "
@@ -418,6 +1099,9 @@ int worker::ParseArguments(int argc, char *argv[])
         }
     }
     appGlobals.diskPath = argv[i];
+    if (!appGlobals.diskPaths.isEmpty()) {
+        appGlobals.diskPaths << appGlobals.diskPath;
+    }
 
     if (BitCount(appGlobals.command) != 1) {
        printf("Error: Missing command. See usage below.\n");
@@ -435,23 +1119,98 @@ int worker::ParseArguments(int argc, char *argv[])
        }
     }
 
+    if (appGlobals.backendGiven) {
+       appGlobals.fileParams.seed = appGlobals.seed;
+       SwitchBackend(appGlobals.fileBackend ?
+                     DiskBackend::NewFile(appGlobals.fileParams) : NULL);
+    }
+
     /*
      * TODO: More error checking for params, really
      */
     return 0;
 }
 
+/*
+ *--------------------------------------------------------------------------
+ *
+ * SwitchBackend --
+ *
+ *      Replaces the disk library, NULL installs the default one. The
+ *      pooled connections are closed and the old library is exited, so
+ *      DoInit initializes the new one.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Drops appGlobals.connection.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void worker::SwitchBackend(DiskBackend *backend)
+{
+    connPool.shutdown();
+    appGlobals.connection = NULL;
+    if (bVixInit) {
+       DiskLib().Exit();
+       bVixInit = false;
+    }
+    DiskBackend::Set(backend);
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ConnectParamsWrapper::ConnectParamsWrapper --
+ *
+ *      Fills in the connection parameters of the source from cfg. The
+ *      strings point into the wrapper's own copies, so params is only
+ *      valid while the wrapper lives. A local connection leaves them
+ *      all empty.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+ConnectParamsWrapper::ConnectParamsWrapper(WorkerConfig &cfg)
+    : vmxSpec(cfg.vmxSpec), serverName(cfg.host), userName(cfg.userName),
+      password(cfg.password), cookie(cfg.cookie), thumbPrint(cfg.thumbPrint)
+{
+    memset(&params, 0, sizeof params);
+    if (!cfg.isRemote) {
+        return;
+    }
+    params.vmxSpec = const_cast<char*>(vmxSpec.CharPtr());
+    params.serverName = const_cast<char*>(serverName.CharPtr());
+    if (cfg.cookie == "") {
+        params.credType = VIXDISKLIB_CRED_UID;
+        params.creds.uid.userName = const_cast<char*>(userName.CharPtr());
+        params.creds.uid.password = const_cast<char*>(password.CharPtr());
+    } else {
+        params.credType = VIXDISKLIB_CRED_SESSIONID;
+        params.creds.sessionId.cookie = const_cast<char*>(cookie.CharPtr());
+        params.creds.sessionId.userName = const_cast<char*>(userName.CharPtr());
+        params.creds.sessionId.key = const_cast<char*>(password.CharPtr());
+    }
+    params.thumbPrint = const_cast<char*>(thumbPrint.CharPtr());
+    params.port = cfg.port;
+    params.nfcHostPort = cfg.nfcHostPort;
+}
+
 /*--------------------------------------------------------------------------
 *
 * DoInit --
 *
-*      TBD.
+*      Initializes VixDiskLib on first use and leases the source
+*      connection from connPool, which reuses the connection of an
+*      earlier command with the same parameters.
 *
 * Results:
 *      None.
 *
 * Side effects:
-*      None.
+*      Sets appGlobals.connection, returned to the pool by run().
 *
 *--------------------------------------------------------------------------
 */
@@ -460,85 +1219,54 @@ void worker::DoInit()
 {
     VixError vixError;
     try {
-        if (appGlobals.isRemote) {
-            CharArWrapper vmxSpec(appGlobals.vmxSpec);                  //a tricky way to copy QString to cast char* (don't forget fo delete[] allocated memory)
-            cnxParams.vmxSpec = new char[vmxSpec.size()];
-            strcpy(cnxParams.vmxSpec, vmxSpec.CharPtr());
-
-            CharArWrapper serverName(appGlobals.host);
-            cnxParams.serverName = new char[serverName.size()];
-            strcpy(cnxParams.serverName, serverName.CharPtr());
-
-            if (appGlobals.cookie == "") {
-                cnxParams.credType = VIXDISKLIB_CRED_UID;
-                CharArWrapper password(appGlobals.password);
-                cnxParams.creds.uid.password = new char[password.size()];
-                strcpy(cnxParams.creds.uid.password, password.CharPtr());
-                CharArWrapper password(appGlobals.password);
-                cnxParams.creds.uid.password = new char[password.size()];
-                strcpy(cnxParams.creds.uid.password, password.CharPtr());
-                      } else {
-                        cnxParams.credType = VIXDISKLIB_CRED_SESSIONID;
-                        cnxParams.creds.sessionId.cookie = appGlobals.cookie;
-                        cnxParams.creds.sessionId.userName = appGlobals.userName;
-                        cnxParams.creds.sessionId.key = appGlobals.password;
-                      }
-
-//            cnxParams.credType = VIXDISKLIB_CRED_UID;
-
-//            CharArWrapper userName(appGlobals.userName);
-//            cnxParams.creds.uid.userName = new char[userName.size()];
-//            strcpy(cnxParams.creds.uid.userName, userName.CharPtr());
-
-//            CharArWrapper password(appGlobals.password);
-//            cnxParams.creds.uid.password = new char[password.size()];
-//            strcpy(cnxParams.creds.uid.password, password.CharPtr());
-
-            CharArWrapper thumbPrint(appGlobals.thumbPrint);
-            cnxParams.thumbPrint = new char[thumbPrint.size()];
-            strcpy(cnxParams.thumbPrint, thumbPrint.CharPtr());
-
-            cnxParams.port = appGlobals.port;
-            cnxParams.nfcHostPort = appGlobals.nfcHostPort;
-        }
+        ConnectParamsWrapper cnx(appGlobals);                               //the pool copies what it keeps
 
         CharArWrapper lib(appGlobals.libdir);
         CharArWrapper cfg(appGlobals.cfgFile);
 
-        if (appGlobals.useInitEx) {
-            vixError = VixDiskLib_InitEx(VIXDISKLIB_VERSION_MAJOR,
-                                         VIXDISKLIB_VERSION_MINOR,
-                                         &LogFunc, &WarnFunc, &PanicFunc,
-                                         lib.CharPtr(),
-                                         cfg.CharPtr());
-
-        } else {
-            vixError = VixDiskLib_Init(VIXDISKLIB_VERSION_MAJOR,
-                                       VIXDISKLIB_VERSION_MINOR,
-                                       NULL, NULL, NULL, // Log, warn, panic
-                                       lib.CharPtr());
+        if (!bVixInit) {
+            if (appGlobals.useInitEx) {
+                vixError = DiskLib().InitEx(VIXDISKLIB_VERSION_MAJOR,
+                                            VIXDISKLIB_VERSION_MINOR,
+                                            &LogFunc, &WarnFunc, &PanicFunc,
+                                            lib.CharPtr(),
+                                            cfg.CharPtr());
+
+            } else {
+                vixError = DiskLib().Init(VIXDISKLIB_VERSION_MAJOR,
+                                          VIXDISKLIB_VERSION_MINOR,
+                                          NULL, NULL, NULL, // Log, warn, panic
+                                          lib.CharPtr());
+            }
+            CHECK_AND_THROW(vixError);
+            bVixInit = true;
         }
-        CHECK_AND_THROW(vixError);
-        bVixInit = true;
 
         QString exeName("VixDiskLib_PrepareForAccess() started by " +
                         QFileInfo(QCoreApplication::applicationFilePath()).absoluteFilePath());
 
         CharArWrapper exe(exeName);
+
         CharArWrapper ssMoRef(appGlobals.ssMoRef);
         CharArWrapper trModes(appGlobals.transportModes);
+        bool reused;
+        uint64 start = GetTimeUsec();
 
-        if (appGlobals.vmxSpec != "") {
-            vixError = VixDiskLib_PrepareForAccess(&cnxParams, exe.CharPtr());
-            CHECK_AND_THROW(vixError);
+        if (appGlobals.connection != NULL) {
+            connPool.release(appGlobals.connection);
+            appGlobals.connection = NULL;
         }
-        if (appGlobals.ssMoRef == "" && appGlobals.transportModes == "") {
-            vixError = VixDiskLib_Connect(&cnxParams,
-                                          &appGlobals.connection);
+        connPool.setIdleTimeout(appGlobals.idleTimeout);
+        vixError = connPool.acquire(cnx.params,
+                                    appGlobals.vmxSpec != "" ? exe.CharPtr() : NULL,
+                                    ssMoRef.CharPtr(), trModes.CharPtr(),
+                                    (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY) != 0,
+                                    appGlobals.connection, reused);
+        CHECK_AND_THROW(vixError);
+        if (reused) {
+            printf("Reusing the open connection.\n");
         } else {
-            Bool ro = (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY);
-            vixError = VixDiskLib_ConnectEx(&cnxParams, ro, ssMoRef.CharPtr(),
-                                            trModes.CharPtr(), &appGlobals.connection);
+            printf("Connected in %.1f ms.\n", (GetTimeUsec() - start) / 1000.0);
         }
     } catch (const VixDiskLibErrWrapper& e) {
         cout << "Error: [" << e.File() << ":" << e.Line() << "]  " <<
@@ -546,6 +1274,38 @@ void worker::DoInit()
     }
 }
 
+/*
+ *--------------------------------------------------------------------------
+ *
+ * Connect --
+ *
+ *      Opens a connection to the source with the parameters set up by
+ *      DoInit, through VixDiskLib_ConnectEx if a snapshot or transport
+ *      modes were given.
+ *
+ * Results:
+ *      VixError.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+VixError worker::Connect(VixDiskLibConnection &connection)
+{
+    ConnectParamsWrapper cnx(appGlobals);
+    CharArWrapper ssMoRef(appGlobals.ssMoRef);
+    CharArWrapper trModes(appGlobals.transportModes);
+
+    if (appGlobals.ssMoRef == "" && appGlobals.transportModes == "") {
+        return DiskLib().Connect(&cnx.params, &connection);
+    }
+    Bool ro = (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY);
+    return DiskLib().ConnectEx(&cnx.params, ro, ssMoRef.CharPtr(),
+                               trModes.CharPtr(), &connection);
+}
+
 /*
  *--------------------------------------------------------------------------
  *
@@ -575,11 +1335,11 @@ void worker::DoCreate()
     createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
     createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
 
-    vixError = VixDiskLib_Create(appGlobals.connection,
-                                 appGlobals.diskPath.toUtf8().constData(),
-                                 &createParams,
-                                 NULL,
-                                 NULL);
+    vixError = DiskLib().Create(appGlobals.connection,
+                                appGlobals.diskPath.toUtf8().constData(),
+                                &createParams,
+                                NULL,
+                                NULL);
     CHECK_AND_THROW(vixError);
 }
 
@@ -605,10 +1365,10 @@ void worker::DoRedo()
 
     VixError vixError;
     VixDisk parentDisk(appGlobals.connection, appGlobals.parentPath.toUtf8().data(), 0);
-    vixError = VixDiskLib_CreateChild(parentDisk.Handle(),
-                                      appGlobals.diskPath.toUtf8().constData(),
-                                      VIXDISKLIB_DISK_MONOLITHIC_SPARSE,
-                                      NULL, NULL);
+    vixError = DiskLib().CreateChild(parentDisk.Handle(),
+                                     appGlobals.diskPath.toUtf8().constData(),
+                                     VIXDISKLIB_DISK_MONOLITHIC_SPARSE,
+                                     NULL, NULL);
     CHECK_AND_THROW(vixError);
 }
 
@@ -633,18 +1393,68 @@ void worker::DoFill()
     DoInit();
 
     VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().data(), appGlobals.openFlags);
-    uint8 buf[VIXDISKLIB_SECTOR_SIZE];
-    VixDiskLibSectorType startSector;
+    VixDiskLibSectorType sector, count;
+    VixDiskLibSectorType endSector = appGlobals.startSector + appGlobals.numSectors;
+    uint32 bufUpdate;
+    uint64 start, end, total;
+    LatencyHistogram latency;
 
-    memset(buf, appGlobals.filler, sizeof buf);
+    if (appGlobals.bufSize == 0) {
+       appGlobals.bufSize = DEFAULT_BUFSIZE;
+    }
+    // The same filler buffer backs every write, so async writes need no pool.
+    IoBuffer buf(appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE,
+                 (uint8)appGlobals.filler);
+    bool async = appGlobals.queueDepth > 1;
+    AioBenchStat stat(async ? appGlobals.queueDepth : 1);
 
-    for (startSector = 0; startSector < appGlobals.numSectors; ++startSector) {
+    total = GetTimeUsec();
+    start = total;
+    bufUpdate = 0;
+    for (sector = appGlobals.startSector; sector < endSector; sector += count) {
        VixError vixError;
-       vixError = VixDiskLib_Write(disk.Handle(),
-                                   appGlobals.startSector + startSector,
-                                   1, buf);
-       CHECK_AND_THROW(vixError);
+
+       count = endSector - sector;
+       if (count > appGlobals.bufSize) {
+          count = appGlobals.bufSize;
+       }
+       if (async) {
+          if (!stat.acquire()) {
+             break;
+          }
+          AioBenchRequest *req = new AioBenchRequest(stat, count);
+          req->submitted = GetTimeUsec();
+          vixError = DiskLib().WriteAsync(disk.Handle(), sector, count,
+                                          &buf[0], &AioBenchCB, req);
+          if (vixError != VIX_ASYNC) {
+             AioBenchCB(req, vixError);
+          }
+       } else {
+          uint64 submitted = GetTimeUsec();
+          vixError = DiskLib().Write(disk.Handle(), sector, count, &buf[0]);
+          CHECK_AND_THROW(vixError);
+          latency.record(GetTimeUsec() - submitted);
+       }
+
+       bufUpdate += count;
+       if (bufUpdate >= BUFS_PER_STAT) {
+          end = GetTimeUsec();
+          PrintStat(false, start, end, bufUpdate);
+          start = end;
+          bufUpdate = 0;
+       }
     }
+    if (async) {
+       DiskLib().Wait(disk.Handle());
+       stat.drain();
+       if (VIX_FAILED(stat.error)) {
+          THROW_ERROR(stat.error);
+       }
+       latency.merge(stat.latency);
+    }
+    end = GetTimeUsec();
+    PrintStat(false, total, end, appGlobals.numSectors);
+    PrintLatency(latency);
 }
 
 /*
@@ -668,15 +1478,44 @@ void worker::DoDump()
     DoInit();
 
     VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().data(), appGlobals.openFlags);
-    uint8 buf[VIXDISKLIB_SECTOR_SIZE];
-    VixDiskLibSectorType i;
+    VixDiskLibSectorType sector, count;
+    VixDiskLibSectorType endSector = appGlobals.startSector + appGlobals.numSectors;
+    std::ofstream raw;
+
+    if (appGlobals.bufSize == 0) {
+       appGlobals.bufSize = DEFAULT_BUFSIZE;
+    }
+    IoBuffer buf(appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE);
+
+    if (appGlobals.dumpFile != "") {
+       raw.open(appGlobals.dumpFile.toUtf8().constData(),
+                std::ios::out | std::ios::binary | std::ios::trunc);
+       if (!raw) {
+          throw VixDiskLibErrWrapper("Unable to open dump file", __FILE__, __LINE__);
+       }
+    }
 
-    for (i = 0; i < appGlobals.numSectors; i++) {
-        VixError vixError = VixDiskLib_Read(disk.Handle(),
-                                            appGlobals.startSector + i,
-                                            1, buf);
+    for (sector = appGlobals.startSector; sector < endSector; sector += count) {
+        count = endSector - sector;
+        if (count > appGlobals.bufSize) {
+           count = appGlobals.bufSize;
+        }
+        VixError vixError = DiskLib().Read(disk.Handle(), sector, count, &buf[0]);
         CHECK_AND_THROW(vixError);
-        DumpBytes(buf, sizeof buf, 16);
+        if (raw.is_open()) {
+           raw.write((const char *)&buf[0], count * VIXDISKLIB_SECTOR_SIZE);
+           if (!raw) {
+              throw VixDiskLibErrWrapper("Unable to write dump file", __FILE__, __LINE__);
+           }
+        } else {
+           DumpBytes(&buf[0], count * VIXDISKLIB_SECTOR_SIZE, 16,
+                     sector * VIXDISKLIB_SECTOR_SIZE);
+        }
+    }
+    if (raw.is_open()) {
+       raw.close();
+       printf("Dumped %d sectors to %s\n", (uint32)appGlobals.numSectors,
+              appGlobals.dumpFile.toUtf8().constData());
     }
 }
 
@@ -702,18 +1541,18 @@ void worker::DoReadMetadata()
 
     size_t requiredLen;
     VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().data(), appGlobals.openFlags);
-    VixError vixError = VixDiskLib_ReadMetadata(disk.Handle(),
-                                                appGlobals.metaKey.toUtf8().constData(),
-                                                NULL, 0, &requiredLen);
+    VixError vixError = DiskLib().ReadMetadata(disk.Handle(),
+                                               appGlobals.metaKey.toUtf8().constData(),
+                                               NULL, 0, &requiredLen);
     if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
         THROW_ERROR(vixError);
     }
     std::vector <char> val(requiredLen);
-    vixError = VixDiskLib_ReadMetadata(disk.Handle(),
-                                       appGlobals.metaKey.toUtf8().constData(),
-                                       &val[0],
-                                       requiredLen,
-                                       NULL);
+    vixError = DiskLib().ReadMetadata(disk.Handle(),
+                                      appGlobals.metaKey.toUtf8().constData(),
+                                      &val[0],
+                                      requiredLen,
+                                      NULL);
     CHECK_AND_THROW(vixError);
     cout << appGlobals.metaKey.toUtf8().constData() << " = " << &val[0] << endl;
 }
@@ -739,9 +1578,9 @@ void worker::DoWriteMetadata()
     DoInit();
 
     VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().data(), appGlobals.openFlags);
-    VixError vixError = VixDiskLib_WriteMetadata(disk.Handle(),
-                                                 appGlobals.metaKey.toUtf8().constData(),
-                                                 appGlobals.metaVal.toUtf8().constData());
+    VixError vixError = DiskLib().WriteMetadata(disk.Handle(),
+                                                appGlobals.metaKey.toUtf8().constData(),
+                                                appGlobals.metaVal.toUtf8().constData());
     CHECK_AND_THROW(vixError);
 }
 
@@ -769,25 +1608,25 @@ void worker::DoDumpMetadata()
     char *key;
     size_t requiredLen;
 
-    VixError vixError = VixDiskLib_GetMetadataKeys(disk.Handle(),
-                                                   NULL, 0, &requiredLen);
+    VixError vixError = DiskLib().GetMetadataKeys(disk.Handle(),
+                                                  NULL, 0, &requiredLen);
     if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
        THROW_ERROR(vixError);
     }
     std::vector<char> buf(requiredLen);
-    vixError = VixDiskLib_GetMetadataKeys(disk.Handle(), &buf[0], requiredLen, NULL);
+    vixError = DiskLib().GetMetadataKeys(disk.Handle(), &buf[0], requiredLen, NULL);
     CHECK_AND_THROW(vixError);
     key = &buf[0];
 
     while (*key) {
-        vixError = VixDiskLib_ReadMetadata(disk.Handle(), key, NULL, 0,
-                                           &requiredLen);
+        vixError = DiskLib().ReadMetadata(disk.Handle(), key, NULL, 0,
+                                          &requiredLen);
         if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
            THROW_ERROR(vixError);
         }
         std::vector <char> val(requiredLen);
-        vixError = VixDiskLib_ReadMetadata(disk.Handle(), key, &val[0],
-                                           requiredLen, NULL);
+        vixError = DiskLib().ReadMetadata(disk.Handle(), key, &val[0],
+                                          requiredLen, NULL);
         CHECK_AND_THROW(vixError);
         cout << key << " = " << &val[0] << endl;
         key += (1 + strlen(key));
@@ -820,11 +1659,10 @@ void worker::DoInfo()
     VixDiskLibInfo *info = NULL;
     VixError vixError;
 
-    vixError = VixDiskLib_GetInfo(disk.Handle(), &info);
+    vixError = DiskLib().GetInfo(disk.Handle(), &info);
 
     CHECK_AND_THROW(vixError);
 
-    emit signalStdOut("capacity          = "); //info->capacity); << " sectors" << endl;
     //cout << "number of links   = " << info->numLinks << endl;
     //cout << "adapter type      = ";
 
@@ -852,10 +1690,10 @@ void worker::DoInfo()
     cout << "physical geometry = " << info->physGeo.cylinders <<
        "/" << info->physGeo.heads << "/" << info->physGeo.sectors << endl;
 
-    VixDiskLib_FreeInfo(info);
+    DiskLib().FreeInfo(info);
 
     cout << "Transport modes supported by vixDiskLib: " <<
-            VixDiskLib_ListTransportModes() << endl;
+            DiskLib().ListTransportModes() << endl;
 }
 
 /*
@@ -863,8 +1701,10 @@ void worker::DoInfo()
  *
  * DoTestMultiThread --
  *
- *      Starts a given number of threads, each of which will copy the
- *      source disk to a temp. file.
+ *      Copies the source disk to appGlobals.numThreads temp. files.
+ *      Every copy is split into segments of appGlobals.segmentSize
+ *      sectors that appGlobals.numWorkers workers share through a
+ *      work-stealing ChunkScheduler.
  *
  * Results:
  *      None.
@@ -883,41 +1723,121 @@ void worker::DoTestMultiThread()
     VixDiskLibConnection dstConnection;
     VixError vixError;
     vector<ThreadData> threadData(appGlobals.numThreads);
+    uint64 setup, start, end;
+    uint64 totalSectors = 0, skippedSectors = 0;
+    uint64 connectTime = 0, openTime = 0, createTime = 0;
+    size_t numWorkers = appGlobals.numWorkers ? appGlobals.numWorkers
+                                              : appGlobals.numThreads;
+    CopyJob job(threadData, numWorkers);
+    size_t w;
     int i;
 
-    vixError = VixDiskLib_Connect(&cnxParams, &dstConnection);
-    CHECK_AND_THROW(vixError);
+    if (appGlobals.chunkSize == 0) {
+       appGlobals.chunkSize = DEFAULT_CHUNKSIZE;
+    }
+    if (appGlobals.segmentSize == 0) {
+       appGlobals.segmentSize = DEFAULT_SEGMENT_SIZE;
+    }
 
- #ifdef _WIN32
-    vector<HANDLE> threads(appGlobals.numThreads);
+    vixError = DiskLib().Connect(&cnxParams, &dstConnection);
+    CHECK_AND_THROW(vixError);
 
     for (i = 0; i < appGlobals.numThreads; i++) {
-       unsigned int threadId;
-
-       PrepareThreadData(dstConnection, threadData[i]);
-       threads[i] = (HANDLE)_beginthreadex(NULL, 0, &CopyThread,
-                                           (void*)&threadData[i], 0, &threadId);
+       string prefixName("c:\\test");
+       GenerateRandomFilename(prefixName, threadData[i].dstDisk);
     }
-    WaitForMultipleObjects(appGlobals.numThreads, &threads[0], TRUE, INFINITE);
- #else
-    vector<pthread_t> threads(appGlobals.numThreads);
+
+    setup = GetTimeUsec();
+    {
+       TaskExecutor tasks(appGlobals.numThreads);
+       for (i = 0; i < appGlobals.numThreads; i++) {
+          tasks.addTask(boost::bind(&PrepareThreadData, boost::ref(dstConnection),
+                                    boost::ref(threadData[i])));
+       }
+    }   // ~TaskExecutor waits for every setup to finish
+    start = GetTimeUsec();
 
     for (i = 0; i < appGlobals.numThreads; i++) {
-       PrepareThreadData(dstConnection, threadData[i]);
-       pthread_create(&threads[i], NULL, &CopyThread, (void*)&threadData[i]);
-    }
-    for (i = 0; i < appGlobals.numThreads; i++) {
-       void *hlp;
-       pthread_join(threads[i], &hlp);
+       if (VIX_FAILED(threadData[i].error)) {
+          appGlobals.success = false;
+       }
     }
- #endif
+
+    if (appGlobals.success) {
+       // Queue every disk's segments on its home worker; idle workers
+       // steal from the back of the other queues.
+       for (i = 0; i < appGlobals.numThreads; i++) {
+          CopySegment seg;
+          seg.disk = i;
+          for (seg.start = 0; seg.start < threadData[i].numSectors;
+               seg.start += seg.count) {
+             seg.count = std::min(appGlobals.segmentSize,
+                                  threadData[i].numSectors - seg.start);
+             job.scheduler.add(i % numWorkers, seg);
+          }
+       }
+
+       job.start = GetTimeUsec();
+       TaskExecutor tasks(numWorkers);
+       for (w = 0; w < numWorkers; w++) {
+          tasks.addTask(boost::bind(&CopyWorker, boost::ref(job), w));
+       }
+    }   // ~TaskExecutor waits for all workers
+    end = GetTimeUsec();
 
     for (i = 0; i < appGlobals.numThreads; i++) {
-       VixDiskLib_Close(threadData[i].srcHandle);
-       VixDiskLib_Close(threadData[i].dstHandle);
-       VixDiskLib_Unlink(dstConnection, threadData[i].dstDisk.c_str());
+       const ThreadData &td = threadData[i];
+
+       printf("Copy[%d] connect %llu msec, open %llu msec, create %llu msec, "
+              "copy %llu msec\n", i,
+              (unsigned long long)(td.connectTime / 1000),
+              (unsigned long long)(td.openTime / 1000),
+              (unsigned long long)(td.createTime / 1000),
+              (unsigned long long)(td.elapsed / 1000));
+       connectTime += td.connectTime;
+       openTime += td.openTime;
+       createTime += td.createTime;
+       totalSectors += td.numSectors;
+       skippedSectors += td.skippedSectors;
     }
-    VixDiskLib_Disconnect(dstConnection);
+    for (w = 0; w < numWorkers; w++) {
+       printf("Worker[%d] copied %llu segments (%llu stolen), %llu MBytes\n",
+              (int)w, (unsigned long long)job.segments[w],
+              (unsigned long long)job.scheduler.stolen(w),
+              (unsigned long long)(job.sectors[w] / 2048));
+    }
+    printf("Setup: %llu msec wall, %s connection; summed over threads "
+           "connect %llu msec, open %llu msec, create %llu msec\n",
+           (unsigned long long)((start - setup) / 1000),
+           appGlobals.perThreadConnection ? "per-thread" : "shared",
+           (unsigned long long)(connectTime / 1000),
+           (unsigned long long)(openTime / 1000),
+           (unsigned long long)(createTime / 1000));
+    if (appGlobals.success) {
+       printf("Aggregate: ");
+       PrintStat(false, start, end, totalSectors);
+       printf("Skipped %d MBytes of zero chunks (%d%%).\n",
+              (uint32)(skippedSectors / 2048),
+              (uint32)(totalSectors ? 100 * skippedSectors / totalSectors : 0));
+    }
+
+    for (i = 0; i < appGlobals.numThreads; i++) {
+       ThreadData &td = threadData[i];
+       {
+          LockGuard<ThreadLock> lg(openLock);
+          if (td.srcHandle) {
+             DiskLib().Close(td.srcHandle);
+          }
+          if (td.dstHandle) {
+             DiskLib().Close(td.dstHandle);
+          }
+       }
+       DiskLib().Unlink(dstConnection, td.dstDisk.c_str());
+       if (td.srcConnection && td.srcConnection != appGlobals.connection) {
+          DiskLib().Disconnect(td.srcConnection);
+       }
+    }
+    DiskLib().Disconnect(dstConnection);
     if (!appGlobals.success) {
        THROW_ERROR(VIX_E_FAIL);
     }
@@ -945,7 +1865,7 @@ void worker::DoClone()
 
     VixDiskLibConnection srcConnection;
     VixDiskLibConnectParams cnxParams = { 0 };
-    VixError vixError = VixDiskLib_Connect(&cnxParams, &srcConnection);
+    VixError vixError = DiskLib().Connect(&cnxParams, &srcConnection);
     CHECK_AND_THROW(vixError);
 
     /*
@@ -958,19 +1878,654 @@ void worker::DoClone()
     createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
     createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
 
-    vixError = VixDiskLib_Clone(appGlobals.connection,
-                                appGlobals.diskPath.toUtf8().constData(),
-                                srcConnection,
-                                appGlobals.srcPath.toUtf8().constData(),
-                                &createParams,
-                                CloneProgressFunc,
-                                NULL,   // clientData
-                                TRUE);  // doOverWrite
-    VixDiskLib_Disconnect(srcConnection);
+    vixError = DiskLib().Clone(appGlobals.connection,
+                               appGlobals.diskPath.toUtf8().constData(),
+                               srcConnection,
+                               appGlobals.srcPath.toUtf8().constData(),
+                               &createParams,
+                               CloneProgressFunc,
+                               NULL,   // clientData
+                               TRUE);  // doOverWrite
+    DiskLib().Disconnect(srcConnection);
     CHECK_AND_THROW(vixError);
     cout << "\n Done" << "\n";
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoCopy --
+ *
+ *      Copies the disk to a new local sparse disk at appGlobals.dstPath.
+ *      The sector range is divided into appGlobals.numStreams disjoint
+ *      extents that are copied concurrently, each through its own
+ *      read-only source handle (and own connection with
+ *      -perthreadconn). Every stream also opens the destination; if
+ *      the destination cannot be opened more than once, the streams
+ *      share one destination handle and take turns submitting writes.
+ *
+ *      With -resume, completed chunks are checkpointed in a journal next
+ *      to the destination. If the journal of an interrupted copy of the
+ *      same source and the destination exist, the destination is reused
+ *      and each checkpointed chunk is only read back from it and checked
+ *      against its checksum instead of being copied again.
+ *
+ *      With -manifest, appGlobals.hashThreads threads hash every chunk
+ *      while it is being written and the hashes are saved as a manifest
+ *      for -verify.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates the destination disk; it is left in place on failure.
+ *      The journal is deleted once the copy has succeeded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::DoCopy()
+{
+    DoInit();
+
+    VixDiskLibConnectParams localParams = { 0 };
+    VixDiskLibConnection dstConnection;
+    VixDiskLibCreateParams createParams;
+    VixDiskLibSectorType capacity, extent;
+    ThreadLock dstLock;
+    CopyJournal journal;
+    ChunkManifest manifest;
+    bool hashing = !appGlobals.manifestPath.isEmpty();
+    std::string journalPath = appGlobals.dstPath.toStdString() + ".journal";
+    bool sharedDst = false;
+    bool reuseDst = false;
+    uint64 start, end;
+    uint64 totalSectors = 0, skippedSectors = 0, resumedSectors = 0;
+    VixError vixError;
+    VixError error = VIX_OK;
+    size_t numStreams = appGlobals.numStreams ? appGlobals.numStreams : 1;
+    size_t i;
+
+    if (appGlobals.chunkSize == 0) {
+       appGlobals.chunkSize = DEFAULT_CHUNKSIZE;
+    }
+
+    VixDisk src(appGlobals.connection, appGlobals.diskPath.toUtf8().constData(),
+                appGlobals.openFlags);
+    capacity = src.getInfo()->capacity;
+
+    // Extents are whole chunks, so no chunk is split between streams.
+    extent = (capacity / numStreams + appGlobals.chunkSize - 1) /
+             appGlobals.chunkSize * appGlobals.chunkSize;
+    if (extent == 0) {
+       extent = appGlobals.chunkSize;
+    }
+    numStreams = (size_t)((capacity + extent - 1) / extent);
+    vector<CopyStream> streams(numStreams);
+
+    if (appGlobals.resume) {
+       // The journal belongs to this source only if its path and first
+       // chunk are unchanged.
+       std::string source = appGlobals.host.toStdString() + ':' +
+                            appGlobals.diskPath.toStdString();
+       VixDiskLibSectorType count = std::min(appGlobals.chunkSize, capacity);
+       IoBuffer first((size_t)count * VIXDISKLIB_SECTOR_SIZE);
+       uint64 firstHash;
+
+       vixError = DiskLib().Read(src.Handle(), 0, count, first.data());
+       CHECK_AND_THROW(vixError);
+       firstHash = ChunkManifest::Hash(first.data(), first.size());
+       if (!journal.open(journalPath, source, firstHash, capacity,
+                         appGlobals.chunkSize)) {
+          printf("Cannot write journal %s.\n", journalPath.c_str());
+          THROW_ERROR(VIX_E_FILE_ERROR);
+       }
+       // Even without a checkpoint the destination is the one this copy
+       // created, so it is reused rather than failing to create it.
+       reuseDst = journal.resumed() && QFileInfo(appGlobals.dstPath).exists();
+       if (reuseDst) {
+          printf("Resuming copy, %llu of %llu chunks to verify.\n",
+                 (unsigned long long)journal.done(),
+                 (unsigned long long)journal.chunks());
+       } else if (journal.done() > 0) {
+          // The destination is gone, so are the chunks in the journal.
+          journal.remove();
+          if (!journal.open(journalPath, source, firstHash, capacity,
+                            appGlobals.chunkSize)) {
+             THROW_ERROR(VIX_E_FILE_ERROR);
+          }
+       }
+    }
+
+    vixError = DiskLib().Connect(&localParams, &dstConnection);
+    CHECK_AND_THROW(vixError);
+
+    if (!reuseDst) {
+       createParams.adapterType = appGlobals.adapterType;
+       createParams.capacity = capacity;
+       createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+       createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+       vixError = DiskLib().Create(dstConnection,
+                                   appGlobals.dstPath.toUtf8().constData(),
+                                   &createParams, NULL, NULL);
+       if (VIX_FAILED(vixError)) {
+          // Don't let a later run take over a file this copy did not
+          // create.
+          if (appGlobals.resume) {
+             journal.remove();
+          }
+          DiskLib().Disconnect(dstConnection);
+          THROW_ERROR(vixError);
+       }
+    }
+
+    for (i = 0; i < numStreams && error == VIX_OK; i++) {
+       CopyStream &cs = streams[i];
+
+       cs.startSector = i * extent;
+       cs.numSectors = std::min(extent, capacity - cs.startSector);
+       cs.srcConnection = appGlobals.connection;
+       if (appGlobals.perThreadConnection) {
+          error = Connect(cs.srcConnection);
+          if (VIX_FAILED(error)) {
+             cs.srcConnection = NULL;
+             break;
+          }
+       }
+       error = DiskLib().Open(cs.srcConnection,
+                              appGlobals.diskPath.toUtf8().constData(),
+                              appGlobals.openFlags, &cs.srcHandle);
+       if (VIX_FAILED(error)) {
+          break;
+       }
+       if (!sharedDst) {
+          vixError = DiskLib().Open(dstConnection,
+                                    appGlobals.dstPath.toUtf8().constData(),
+                                    0, &cs.dstHandle);
+          if (VIX_FAILED(vixError)) {
+             if (i == 0) {
+                error = vixError;
+                break;
+             }
+             printf("Destination can only be opened once (%s), streams "
+                    "share one handle.\n",
+                    VixDiskLibErrWrapper(vixError, __FILE__, __LINE__).Description().c_str());
+             sharedDst = true;
+          } else {
+             cs.ownsDst = true;
+          }
+       }
+       if (sharedDst) {
+          cs.dstHandle = streams[0].dstHandle;
+       }
+    }
+
+    if (error == VIX_OK) {
+       printf("Copying %llu MBytes in %d streams of %llu MBytes.\n",
+              (unsigned long long)(capacity / 2048), (int)numStreams,
+              (unsigned long long)(extent / 2048));
+       if (hashing) {
+          manifest.init(appGlobals.diskPath.toStdString(), capacity,
+                        appGlobals.chunkSize);
+       }
+       start = GetTimeUsec();
+       {
+          // Streams wait for their chunks to be hashed before they
+          // finish, so the hashers are idle by the time they go away.
+          TaskExecutor hashers(hashing ? appGlobals.hashThreads : 0);
+          TaskExecutor tasks(numStreams);
+          for (i = 0; i < numStreams; i++) {
+             tasks.addTask(boost::bind(&CopyExtent, boost::ref(streams[i]),
+                                       sharedDst ? &dstLock : (ThreadLock*)NULL,
+                                       appGlobals.resume ? &journal : (CopyJournal*)NULL,
+                                       hashing ? &manifest : (ChunkManifest*)NULL,
+                                       &hashers));
+          }
+       }   // ~TaskExecutor waits for all streams
+       end = GetTimeUsec();
+
+       for (i = 0; i < numStreams; i++) {
+          const CopyStream &cs = streams[i];
+
+          printf("Stream[%d] ", (int)i);
+          PrintStat(false, 0, cs.elapsed, cs.sectors);
+          if (VIX_FAILED(cs.error) && error == VIX_OK) {
+             error = cs.error;
+          }
+          totalSectors += cs.sectors;
+          skippedSectors += cs.skippedSectors;
+          resumedSectors += cs.resumedSectors;
+       }
+       printf("Aggregate: ");
+       PrintStat(false, start, end, totalSectors);
+       printf("Skipped %d MBytes of zero chunks (%d%%).\n",
+              (uint32)(skippedSectors / 2048),
+              (uint32)(capacity ? 100 * skippedSectors / capacity : 0));
+       if (reuseDst) {
+          printf("Verified %d MBytes copied by an earlier run.\n",
+                 (uint32)(resumedSectors / 2048));
+       }
+    }
+
+    for (i = 0; i < numStreams; i++) {
+       CopyStream &cs = streams[i];
+       if (cs.srcHandle) {
+          DiskLib().Close(cs.srcHandle);
+       }
+       if (cs.ownsDst) {
+          DiskLib().Close(cs.dstHandle);
+       }
+       if (cs.srcConnection && cs.srcConnection != appGlobals.connection) {
+          DiskLib().Disconnect(cs.srcConnection);
+       }
+    }
+    DiskLib().Disconnect(dstConnection);
+    if (VIX_FAILED(error)) {
+       if (appGlobals.resume) {
+          printf("Run the same command again to resume the copy.\n");
+       }
+       THROW_ERROR(error);
+    }
+    if (appGlobals.resume) {
+       journal.remove();
+    }
+    if (hashing) {
+       if (!manifest.write(appGlobals.manifestPath.toStdString())) {
+          printf("Cannot write manifest %s.\n",
+                 appGlobals.manifestPath.toUtf8().constData());
+          THROW_ERROR(VIX_E_FILE_ERROR);
+       }
+       printf("Wrote hashes of %llu chunks to %s.\n",
+              (unsigned long long)manifest.chunks(),
+              appGlobals.manifestPath.toUtf8().constData());
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyExtent --
+ *
+ *      Copies one stream's extent with CopyRange. dstLock is set when
+ *      the streams share a destination handle, journal with -resume and
+ *      manifest with -manifest.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Fills in the stream's statistics and error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::CopyExtent(CopyStream &stream, ThreadLock *dstLock,
+                        CopyJournal *journal, ChunkManifest *manifest,
+                        TaskExecutor *hashers)
+{
+    uint32 depth = appGlobals.copyDepth ? appGlobals.copyDepth
+                                        : DEFAULT_COPY_DEPTH;
+    VixError vixError;
+    uint64 start;
+
+    if (depth > VIX_COPY_BUFPOOL_SIZE) {
+       depth = VIX_COPY_BUFPOOL_SIZE;
+    }
+    // DoCopy always creates a sparse destination.
+    CopyStat stat(appGlobals.chunkSize * VIXDISKLIB_SECTOR_SIZE, depth,
+                  appGlobals.skipZero, journal, manifest,
+                  manifest ? hashers : NULL);
+
+    start = GetTimeUsec();
+    vixError = CopyRange(stream.srcHandle, stream.dstHandle,
+                         stream.startSector, stream.numSectors, stat, dstLock);
+    if (VIX_FAILED(vixError)) {
+       CopyWait(stream.dstHandle, stat);
+    } else {
+       vixError = CopyWait(stream.dstHandle, stat);
+    }
+    stream.elapsed = GetTimeUsec() - start;
+    stream.sectors = stat.sectors;
+    stream.skippedSectors = stat.skipped;
+    stream.resumedSectors = stat.resumed;
+    stream.error = vixError;
+    if (VIX_FAILED(vixError)) {
+       printf("Stream at sector %llu failed: %s\n",
+              (unsigned long long)stream.startSector,
+              VixDiskLibErrWrapper(vixError, __FILE__, __LINE__).Description().c_str());
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoVerify --
+ *
+ *      Reads the disk chunk by chunk and compares the hash of every
+ *      chunk with the manifest written by -copy -manifest. Hashing runs
+ *      on appGlobals.hashThreads threads while the next chunks are read.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws if the disk does not match the manifest.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::DoVerify()
+{
+    DoInit();
+
+    ChunkManifest manifest;
+    VixDiskLibSectorType capacity, sector, count;
+    VixError vixError = VIX_OK;
+    uint64 start, end, chunk;
+    size_t i;
+
+    if (!manifest.read(appGlobals.manifestPath.toStdString())) {
+       printf("Cannot read manifest %s.\n",
+              appGlobals.manifestPath.toUtf8().constData());
+       THROW_ERROR(VIX_E_FILE_ERROR);
+    }
+
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().constData(),
+                 appGlobals.openFlags);
+    capacity = disk.getInfo()->capacity;
+    if (capacity != manifest.diskCapacity()) {
+       printf("Disk has %llu sectors, the manifest %llu.\n",
+              (unsigned long long)capacity,
+              (unsigned long long)manifest.diskCapacity());
+       THROW_ERROR(VIX_E_INVALID_ARG);
+    }
+
+    VerifyJob job(manifest);
+
+    start = GetTimeUsec();
+    {
+       TaskExecutor hashers(appGlobals.hashThreads);
+       for (chunk = 0; chunk < manifest.chunks(); ++chunk) {
+          sector = chunk * manifest.chunkSectors();
+          count = std::min(manifest.chunkSectors(), capacity - sector);
+
+          uint8 *buf = job.pool.getBuffer();
+          vixError = DiskLib().Read(disk.Handle(), sector, count, buf);
+          if (VIX_FAILED(vixError)) {
+             job.pool.returnBuffer(buf);
+             break;
+          }
+          hashers.addTask(boost::bind(&VerifyChunk, boost::ref(job), buf,
+                                      chunk, count * VIXDISKLIB_SECTOR_SIZE));
+       }
+    }   // ~TaskExecutor waits for the last chunks
+    end = GetTimeUsec();
+    CHECK_AND_THROW(vixError);
+
+    PrintStat(true, start, end, capacity);
+    std::sort(job.mismatches.begin(), job.mismatches.end());
+    for (i = 0; i < job.mismatches.size() && i < 16; i++) {
+       sector = job.mismatches[i] * manifest.chunkSectors();
+       printf("Mismatch in chunk %llu, sectors %llu-%llu.\n",
+              (unsigned long long)job.mismatches[i], (unsigned long long)sector,
+              (unsigned long long)(std::min(sector + manifest.chunkSectors(),
+                                            capacity) - 1));
+    }
+    if (!job.mismatches.empty()) {
+       printf("Verify FAILED: %d of %llu chunks differ from the manifest.\n",
+              (int)job.mismatches.size(), (unsigned long long)job.verified);
+       THROW_ERROR(VIX_E_FAIL);
+    }
+    printf("Verified %llu chunks against the manifest.\n",
+           (unsigned long long)job.verified);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VerifyChunk --
+ *
+ *      Runs on the hashing threads of DoVerify: hashes one chunk and
+ *      compares it with the manifest.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Returns the chunk buffer to the job's pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::VerifyChunk(VerifyJob &job, uint8 *buf, uint64 chunk, size_t bytes)
+{
+    bool match = job.manifest.has(chunk) &&
+                 ChunkManifest::Hash(buf, bytes) == job.manifest.hash(chunk);
+
+    job.pool.returnBuffer(buf);
+    LockGuard<ThreadLock> lg(job.lock);
+    ++job.verified;
+    if (!match) {
+       job.mismatches.push_back(chunk);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoIncremental --
+ *
+ *      Incremental copy without changed block tracking. Creates
+ *      appGlobals.dstPath as a child of the local disk
+ *      appGlobals.parentPath, then reads the source chunk by chunk and
+ *      hashes every chunk on appGlobals.hashThreads threads. Only the
+ *      chunks whose hash differs from the base manifest, which describes
+ *      the parent, are written to the child.
+ *
+ *      The chunk size is the one of the base manifest. With -manifest
+ *      the hashes of the source are saved for the next run.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates the child disk; it is left in place on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::DoIncremental()
+{
+    DoInit();
+
+    VixDiskLibConnectParams localParams = { 0 };
+    VixDiskLibConnection dstConnection;
+    VixDiskLibHandle dstHandle = NULL;
+    ChunkManifest base, manifest;
+    VixDiskLibSectorType capacity, sector, count, chunkSize;
+    ThreadLock dstLock;
+    uint32 depth = appGlobals.copyDepth ? appGlobals.copyDepth
+                                        : DEFAULT_COPY_DEPTH;
+    VixError vixError;
+    uint64 start, end, chunk;
+
+    if (depth > VIX_COPY_BUFPOOL_SIZE) {
+       depth = VIX_COPY_BUFPOOL_SIZE;
+    }
+    if (!base.read(appGlobals.baseManifestPath.toStdString())) {
+       printf("Cannot read base manifest %s.\n",
+              appGlobals.baseManifestPath.toUtf8().constData());
+       THROW_ERROR(VIX_E_FILE_ERROR);
+    }
+    // Not stored in appGlobals, -chunk stays as given for later commands.
+    chunkSize = (VixDiskLibSectorType)base.chunkSectors();
+    printf("Parent %s, base manifest of %s in chunks of %llu sectors.\n",
+           appGlobals.parentPath.toUtf8().constData(),
+           base.diskPath().c_str(), (unsigned long long)chunkSize);
+
+    VixDisk src(appGlobals.connection, appGlobals.diskPath.toUtf8().constData(),
+                appGlobals.openFlags);
+    capacity = src.getInfo()->capacity;
+    if (capacity != base.diskCapacity()) {
+       printf("Disk has %llu sectors, the base manifest %llu.\n",
+              (unsigned long long)capacity,
+              (unsigned long long)base.diskCapacity());
+       THROW_ERROR(VIX_E_INVALID_ARG);
+    }
+    manifest.init(appGlobals.diskPath.toStdString(), capacity, chunkSize);
+
+    vixError = DiskLib().Connect(&localParams, &dstConnection);
+    CHECK_AND_THROW(vixError);
+    {
+       VixDisk parentDisk(dstConnection, appGlobals.parentPath.toUtf8().constData(), 0);
+       vixError = DiskLib().CreateChild(parentDisk.Handle(),
+                                        appGlobals.dstPath.toUtf8().constData(),
+                                        VIXDISKLIB_DISK_MONOLITHIC_SPARSE,
+                                        NULL, NULL);
+    }
+    if (VIX_SUCCEEDED(vixError)) {
+       vixError = DiskLib().Open(dstConnection,
+                                 appGlobals.dstPath.toUtf8().constData(),
+                                 0, &dstHandle);
+    }
+    if (VIX_FAILED(vixError)) {
+       DiskLib().Disconnect(dstConnection);
+       THROW_ERROR(vixError);
+    }
+
+    // Unchanged chunks are accounted as skipped. Zero chunks must be
+    // written like any other, the parent may hold data there.
+    CopyStat stat(chunkSize * VIXDISKLIB_SECTOR_SIZE, depth, false, NULL,
+                  &manifest);
+
+    start = GetTimeUsec();
+    {
+       TaskExecutor hashers(appGlobals.hashThreads);
+       for (chunk = 0; chunk < manifest.chunks(); ++chunk) {
+          sector = chunk * chunkSize;
+          count = std::min(chunkSize, capacity - sector);
+          {
+             LockGuard<ThreadLock> lg(stat.lock);
+             while (stat.inFlight >= stat.maxInFlight) {
+                stat.lock.wait();
+             }
+             if (VIX_FAILED(stat.error)) {
+                break;
+             }
+             ++stat.inFlight;
+          }
+
+          uint8 *buf = stat.pool.getBuffer();
+          CopyRequest *req = new CopyRequest(buf, stat, count);
+
+          req->chunk = chunk;
+          vixError = DiskLib().Read(src.Handle(), sector, count, buf);
+          if (VIX_FAILED(vixError)) {
+             CopyCB(req, vixError);
+             break;
+          }
+          hashers.addTask(boost::bind(&IncrementalChunk, req, dstHandle,
+                                      &dstLock, boost::cref(base)));
+       }
+    }   // ~TaskExecutor waits for the hashing, not for the writes
+    vixError = CopyWait(dstHandle, stat);
+    end = GetTimeUsec();
+
+    DiskLib().Close(dstHandle);
+    DiskLib().Disconnect(dstConnection);
+    CHECK_AND_THROW(vixError);
+
+    PrintStat(true, start, end, capacity);
+    printf("Wrote %d MBytes of changed chunks to the child (%d%%), "
+           "%d MBytes unchanged.\n",
+           (uint32)(stat.sectors / 2048),
+           (uint32)(capacity ? 100 * stat.sectors / capacity : 0),
+           (uint32)(stat.skipped / 2048));
+
+    if (!appGlobals.manifestPath.isEmpty()) {
+       if (!manifest.write(appGlobals.manifestPath.toStdString())) {
+          printf("Cannot write manifest %s.\n",
+                 appGlobals.manifestPath.toUtf8().constData());
+          THROW_ERROR(VIX_E_FILE_ERROR);
+       }
+       printf("Wrote hashes of %llu chunks to %s.\n",
+              (unsigned long long)manifest.chunks(),
+              appGlobals.manifestPath.toUtf8().constData());
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IncrementalChunk --
+ *
+ *      Runs on the hashing threads of DoIncremental: hashes one chunk
+ *      into the new manifest and, if it differs from the base
+ *      manifest, writes it to the child disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Completes the request when it is not written, see CopyRelease.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::IncrementalChunk(CopyRequest *req, VixDiskLibHandle dst,
+                              ThreadLock *dstLock, const ChunkManifest &base)
+{
+    uint64 hash = ChunkManifest::Hash(req->buf,
+                                      req->numSectors * VIXDISKLIB_SECTOR_SIZE);
+    VixError vixError;
+
+    req->stat.manifest->set(req->chunk, hash);
+    if (base.has(req->chunk) && base.hash(req->chunk) == hash) {
+       req->skipped = true;
+       CopyCB(req, VIX_OK);
+       return;
+    }
+
+    LockGuard<ThreadLock> lg(*dstLock);
+    vixError = DiskLib().WriteAsync(dst, req->chunk * base.chunkSectors(),
+                                    req->numSectors, req->buf, &CopyCB, req);
+    if (vixError != VIX_ASYNC) {
+       CopyCB(req, vixError);
+    }
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ParseList --
+ *
+ *      Parses a comma separated list of positive numbers, e.g. "64,128,256".
+ *
+ * Results:
+ *      false if the list is empty or malformed.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+bool worker::ParseList(const char *arg, std::vector<unsigned> &list)
+{
+    list.clear();
+    while (*arg) {
+       char *end;
+       long value = strtol(arg, &end, 0);
+       if (end == arg || value <= 0 || (*end != ',' && *end != '\0')) {
+          list.clear();
+          return false;
+       }
+       list.push_back((unsigned)value);
+       arg = *end ? end + 1 : end;
+    }
+    return !list.empty();
+}
+
 /*
  *--------------------------------------------------------------------------
  *
@@ -1001,6 +2556,30 @@ void worker::run()
 {
     m_thread->start();
 
+    RunCommand();
+
+    m_thread->quit();
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * RunCommand --
+ *
+ *      Runs appGlobals.command.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Returns the source connection to connPool, where it stays open
+ *      for the next command until the idle timeout.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void worker::RunCommand()
+{
     switch (appGlobals.command) {
     case COMMAND_CREATE:
         DoCreate();
@@ -1038,9 +2617,36 @@ void worker::run()
     case COMMAND_WRITEBENCH:
         DoRWBench(false);
         break;
-    case COMMAND_CHECKREPAIR:
-        if (appGlobals.repair)
-            DoCheckRepair(true);
+    case COMMAND_READASYNCBENCH:
+        if (appGlobals.diskPaths.size() > 1)
+            DoAsyncIO(true);
+        else
+            DoAsyncBench(true);
+        break;
+    case COMMAND_WRITEASYNCBENCH:
+        if (appGlobals.diskPaths.size() > 1)
+            DoAsyncIO(false);
+        else
+            DoAsyncBench(false);
+        break;
+    case COMMAND_COPY:
+        DoCopy();
+        break;
+    case COMMAND_VERIFY:
+        DoVerify();
+        break;
+    case COMMAND_INCREMENTAL:
+        DoIncremental();
+        break;
+    case COMMAND_READSWEEP:
+        DoSweepBench(true);
+        break;
+    case COMMAND_WRITESWEEP:
+        DoSweepBench(false);
+        break;
+    case COMMAND_CHECKREPAIR:
+        if (appGlobals.repair)
+            DoCheckRepair(true);
         else
             DoCheckRepair(false);
         break;
@@ -1050,60 +2656,786 @@ void worker::run()
     case COMMAND_DEFRAG:
         //TBD
         break;
+    case COMMAND_BATCH:
+        DoBatch();
+        break;
+    }
+
+    if (appGlobals.connection != NULL) {
+        connPool.release(appGlobals.connection);
+        appGlobals.connection = NULL;
+    }
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * SplitArgs --
+ *
+ *      Splits a line of a job file into arguments at white space.
+ *      Double quotes group an argument with spaces, like paths of the
+ *      form "[datastore] vm/vm.vmdk".
+ *
+ * Results:
+ *      false on an unterminated quote.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+bool worker::SplitArgs(const string &line, std::vector<string> &args)
+{
+    size_t i = 0, n = line.size();
+
+    args.clear();
+    while (i < n) {
+        string arg;
+        bool quoted = false;
+
+        while (i < n && isspace((unsigned char)line[i])) {
+            ++i;
+        }
+        if (i == n) {
+            break;
+        }
+        while (i < n && (quoted || !isspace((unsigned char)line[i]))) {
+            if (line[i] == '"') {
+                quoted = !quoted;
+            } else {
+                arg += line[i];
+            }
+            ++i;
+        }
+        if (quoted) {
+            return false;
+        }
+        args.push_back(arg);
+    }
+    return true;
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoBatch --
+ *
+ *      Runs the jobs of the job file appGlobals.diskPath one after
+ *      another in this process. Every line holds the arguments of one
+ *      command as they would be passed on the command line, e.g.
+ *
+ *          -info "[ds1] vm1/vm1.vmdk"
+ *          -readasyncbench 128 -qdepth 32 -results vm1.json "[ds1] vm1/vm1.vmdk"
+ *          -copy d:\backup\vm2.vmdk -manifest vm2.mf "[ds1] vm2/vm2.vmdk"
+ *
+ *      Empty lines and lines starting with '#' are skipped. The options
+ *      given with -batch (host, credentials, libdir, ...) are the
+ *      defaults of every job, and jobs with the same connection
+ *      parameters share one pooled connection, so the library is
+ *      initialized and every host is logged into once per batch.
+ *
+ *      Jobs run one at a time since every command works on appGlobals;
+ *      a job can still spread over several disks with the multi-disk
+ *      benchmarks, -multithread and -copy -streams.
+ *
+ *      -backend (with the -file* and -model* options) and -hugepages
+ *      on a job line apply to that job only; the backend and large page
+ *      setting of the batch are put back after it. Without -backend,
+ *      the job's backend options are ignored.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Clears appGlobals.success if a job failed.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void worker::DoBatch()
+{
+    struct Job {
+        unsigned line;
+        string text;
+        bool ok;
+        uint64 elapsed;             // usec
+    };
+
+    QByteArray jobPath = appGlobals.diskPath.toUtf8();
+    std::ifstream jobs(jobPath.constData());
+    WorkerConfig defaults = appGlobals;
+    bool largePages = IoMemory::largePages;
+    std::vector<Job> done;
+    unsigned lineNumber = 0, failed = 0;
+    uint64 batchStart = GetTimeUsec();
+    string line;
+    size_t j;
+
+    if (!jobs) {
+        printf("Error: Cannot open the job file %s.\n", jobPath.constData());
+        appGlobals.success = false;
+        return;
+    }
+
+    // The backend was installed when -batch was parsed.
+    defaults.command = 0;
+    defaults.backendGiven = false;
+    defaults.connection = NULL;
+
+    while (std::getline(jobs, line)) {
+        std::vector<string> args;
+        std::vector<char *> argv;
+        Job job = { 0, line, false, 0 };
+        uint64 start;
+
+        ++lineNumber;
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        job.line = lineNumber;
+        job.text = line;
+        if (!SplitArgs(line, args)) {
+            printf("Error: %s:%u: unterminated quote.\n", jobPath.constData(),
+                   lineNumber);
+            done.push_back(job);
+            ++failed;
+            continue;
+        }
+        if (args.empty() || args[0][0] == '#') {
+            continue;
+        }
+
+        argv.push_back(const_cast<char *>("batch"));
+        for (j = 0; j < args.size(); ++j) {
+            argv.push_back(&args[j][0]);
+        }
+
+        printf("\n=== Job %u (line %u): %s\n", (unsigned)done.size() + 1,
+               lineNumber, line.c_str());
+        appGlobals = defaults;
+        start = GetTimeUsec();
+        job.ok = ParseArguments((int)argv.size(), &argv[0]) == 0;
+        if (job.ok && appGlobals.command == COMMAND_BATCH) {
+            printf("Error: -batch cannot be nested.\n");
+            job.ok = false;
+        }
+        if (job.ok) {
+            try {
+                RunCommand();
+                job.ok = appGlobals.success;
+            } catch (const VixDiskLibErrWrapper& e) {
+                cout << "Error: [" << e.File() << ":" << e.Line() << "]  " <<
+                        std::hex << e.ErrorCode() << std::dec << " " <<
+                        e.Description() << "\n";
+                job.ok = false;
+            } catch (const std::exception& e) {
+                printf("Error: %s\n", e.what());
+                job.ok = false;
+            }
+            if (appGlobals.connection != NULL) {
+                connPool.release(appGlobals.connection);
+                appGlobals.connection = NULL;
+            }
+        }
+        // Process-wide settings of the job go back to the batch's.
+        if (appGlobals.backendGiven) {
+            SwitchBackend(defaults.fileBackend ?
+                          DiskBackend::NewFile(defaults.fileParams) : NULL);
+        }
+        IoMemory::largePages = largePages;
+
+        job.elapsed = GetTimeUsec() - start;
+        done.push_back(job);
+        if (!job.ok) {
+            ++failed;
+        }
+    }
+
+    appGlobals = defaults;
+    appGlobals.command = COMMAND_BATCH;
+    appGlobals.success = failed == 0;
+
+    printf("\n%-5s %-6s %-8s %10s  %s\n", "job", "line", "result", "seconds",
+           "command");
+    for (j = 0; j < done.size(); ++j) {
+        printf("%-5u %-6u %-8s %10.1f  %s\n", (unsigned)j + 1, done[j].line,
+               done[j].ok ? "ok" : "FAILED", done[j].elapsed / 1000000.0,
+               done[j].text.c_str());
+    }
+    printf("%u of %u jobs failed, %.1f seconds in total.\n", failed,
+           (unsigned)done.size(), (GetTimeUsec() - batchStart) / 1000000.0);
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * Execute --
+ *
+ *      Runs one command line without the GUI, e.g. "-batch jobFile".
+ *
+ * Results:
+ *      0 on success, 1 if the arguments were wrong or the command
+ *      failed.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int worker::Execute(int argc, char *argv[])
+{
+    if (ParseArguments(argc, argv) != 0) {
+        return 1;
+    }
+    try {
+        RunCommand();
+    } catch (const VixDiskLibErrWrapper& e) {
+        cout << "Error: [" << e.File() << ":" << e.Line() << "]  " <<
+                std::hex << e.ErrorCode() << std::dec << " " <<
+                e.Description() << "\n";
+        return 1;
+    } catch (const std::exception& e) {
+        printf("Error: %s\n", e.what());
+        return 1;
+    }
+    return appGlobals.success ? 0 : 1;
+}
+
+// Lookup tables for DumpBytes: "xx " for every byte value and the
+// character shown in the ASCII column.
+static struct DumpTables
+{
+    char hex[256][3];
+    char ascii[256];
+
+    DumpTables()
+    {
+        static const char digits[] = "0123456789abcdef";
+        for (int c = 0; c < 256; c++) {
+            hex[c][0] = digits[c >> 4];
+            hex[c][1] = digits[c & 0xf];
+            hex[c][2] = ' ';
+            ascii[c] = (c < ' ' || c >= 127) ? '.' : (char)c;
+        }
+    }
+} dumpTables;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpBytes --
+ *
+ *      Displays an array of n bytes, step bytes per line, with offsets
+ *      counted from offset. The whole dump is formatted into a single
+ *      buffer through lookup tables and written out at once.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::DumpBytes(const uint8 *buf, size_t n, int step, uint64 offset)
+{
+    // offset, " : ", hex column, "  ", ascii column, newline
+    const size_t lineLen = 12 + 3 + 3 * step + 2 + step + 1;
+    vector<char> out(((n + step - 1) / step) * lineLen +
+                     n / VIXDISKLIB_SECTOR_SIZE + 2);
+    char *p = &out[0];
+    size_t i, k;
+
+    for (i = 0; i < n; i += step) {
+       size_t len = n - i < (size_t)step ? n - i : step;
+       uint64 off = offset + i;
+
+       for (int shift = 44; shift >= 0; shift -= 4) {
+          *p++ = dumpTables.hex[(off >> shift) & 0xf][1];
+       }
+       *p++ = ' ';
+       *p++ = ':';
+       *p++ = ' ';
+       for (k = 0; k < len; k++) {
+          memcpy(p, dumpTables.hex[buf[i + k]], 3);
+          p += 3;
+       }
+       for (; k < (size_t)step; k++) {
+          *p++ = ' ';
+          *p++ = ' ';
+          *p++ = ' ';
+       }
+       *p++ = ' ';
+       *p++ = ' ';
+       for (k = 0; k < len; k++) {
+          *p++ = dumpTables.ascii[buf[i + k]];
+       }
+       *p++ = '\n';
+       if ((i + step) % VIXDISKLIB_SECTOR_SIZE == 0) {
+          *p++ = '\n';
+       }
+    }
+    *p++ = '\n';
+    fwrite(&out[0], 1, p - &out[0], stdout);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoRWBench --
+ *
+ *      Perform read/write benchmarks according to settings in
+ *      appGlobals. Note that a write benchmark will destroy the data
+ *      in the target disk.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::DoRWBench(bool read)
+{
+    DoInit();
+
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().data(), appGlobals.openFlags);
+    size_t bufSize;
+    VixDiskLibInfo *info;
+    VixError err;
+    uint64 maxOps, ops;
+    uint32 bufUpdate;
+    uint64 start, end, total, submitted, deadline, warmupEnd;
+    uint64 maxSectors = (uint64)appGlobals.benchMBytes * 2048;
+    bool bounded = appGlobals.benchSeconds != 0 || maxSectors != 0;
+    bool warming = appGlobals.warmupSeconds != 0;
+    VixDiskLibSectorType firstSector;
+    LatencyHistogram latency, totalLatency;
+    BenchReport report;
+
+    if (appGlobals.bufSize == 0) {
+       appGlobals.bufSize = DEFAULT_BUFSIZE;
+    }
+    bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
+
+    IoBuffer buf(bufSize);
+    if (!read) {
+       InitBuffer((uint32*)buf.data(), bufSize / sizeof(uint32));
+    }
+
+    err = DiskLib().GetInfo(disk.Handle(), &info);
+    if (VIX_FAILED(err)) {
+       throw VixDiskLibErrWrapper(err, __FILE__, __LINE__);
+    }
+
+    AccessPattern pattern = NewPattern(info->capacity, maxOps, firstSector);
+    DiskLib().FreeInfo(info);
+    if (maxOps == 0) {
+       bounded = warming = false;
+    }
+
+    printf("Processing %d buffers of %d bytes, %s access.\n", (uint32)maxOps,
+           (uint32)bufSize, AccessPattern::Name(appGlobals.accessPattern));
+    PrintSeed();
+
+    InitReport(report, read ? "readbench" : "writebench", disk.Handle());
+    total = GetTimeUsec();
+    warmupEnd = total + (uint64)appGlobals.warmupSeconds * 1000000;
+    deadline = warmupEnd + (uint64)appGlobals.benchSeconds * 1000000;
+    if (warming) {
+       printf("Warming up for %u seconds.\n", appGlobals.warmupSeconds);
+    }
+    report.beginRun(read ? "read" : "write", warmupEnd);
+    report.setRunParam("buf_sectors", appGlobals.bufSize);
+    report.setRunParam("queue_depth", 1);
+    start = total;
+    bufUpdate = 0;
+    for (ops = 0; ; ) {
+       VixError vixError;
+       VixDiskLibSectorType sector;
+
+       submitted = GetTimeUsec();
+       if (warming && submitted >= warmupEnd) {
+          warming = false;
+          total = start = submitted;
+       }
+       if (!warming) {
+          if (!bounded && ops >= maxOps) {
+             break;
+          }
+          if ((maxSectors != 0 && ops * appGlobals.bufSize >= maxSectors) ||
+              (appGlobals.benchSeconds != 0 && submitted >= deadline)) {
+             break;
+          }
+       }
+
+       sector = firstSector + pattern.next() * appGlobals.bufSize;
+       if (read) {
+          vixError = DiskLib().Read(disk.Handle(), sector,
+                                    appGlobals.bufSize, buf.data());
+       } else {
+          vixError = DiskLib().Write(disk.Handle(), sector,
+                                     appGlobals.bufSize, buf.data());
+
+       }
+       if (VIX_FAILED(vixError)) {
+          throw VixDiskLibErrWrapper(vixError, __FILE__, __LINE__);
+       }
+       end = GetTimeUsec();
+       if (warming) {
+          continue;
+       }
+       latency.record(end - submitted);
+       ++ops;
+
+       bufUpdate += appGlobals.bufSize;
+       if (bufUpdate >= BUFS_PER_STAT) {
+          PrintStat(read, start, end, bufUpdate);
+          PrintLatency(latency);
+          report.addSample(start, end, bufUpdate, latency);
+          totalLatency.merge(latency);
+          latency.reset();
+          start = end;
+          bufUpdate = 0;
+       }
+    }
+    end = GetTimeUsec();
+    totalLatency.merge(latency);
+    PrintStat(read, total, end, (uint64)appGlobals.bufSize * ops);
+    PrintLatency(totalLatency);
+
+    report.setTotal(total, end, (uint64)appGlobals.bufSize * ops, totalLatency);
+    WriteReport(report);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoAsyncBench --
+ *
+ *      Perform read/write benchmarks keeping appGlobals.queueDepth
+ *      async requests in flight. Note that a write benchmark will
+ *      destroy the data in the target disk.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::DoAsyncBench(bool read)
+{
+    DoInit();
+
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().data(), appGlobals.openFlags);
+    BenchResult result;
+    BenchReport report;
+
+    if (appGlobals.bufSize == 0) {
+       appGlobals.bufSize = DEFAULT_BUFSIZE;
+    }
+    if (appGlobals.queueDepth == 0) {
+       appGlobals.queueDepth = DEFAULT_QUEUEDEPTH;
+    }
+    if (appGlobals.queueDepth > VIX_AIO_BUFPOOL_SIZE) {
+       appGlobals.queueDepth = VIX_AIO_BUFPOOL_SIZE;
+    }
+
+    printf("Processing %d buffers of %d bytes, %d requests in flight, "
+           "%s access.\n",
+           (uint32)(disk.getInfo()->capacity / appGlobals.bufSize),
+           (uint32)(appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE),
+           appGlobals.queueDepth, AccessPattern::Name(appGlobals.accessPattern));
+    PrintSeed();
+
+    InitReport(report, read ? "readasyncbench" : "writeasyncbench", disk.Handle());
+    VixDiskAsyncReadWrite(disk.Handle(), disk.getInfo()->capacity, read, true,
+                          result, &report);
+    if (VIX_FAILED(result.error)) {
+       report.setError(VixDiskLibErrWrapper(result.error, __FILE__, __LINE__).Description());
+    }
+    WriteReport(report);
+
+    if (VIX_FAILED(result.error)) {
+       THROW_ERROR(result.error);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewPattern --
+ *
+ *      Builds the access pattern for a benchmark over the
+ *      appGlobals.workingSetMB MBytes of the disk (the rest of the disk
+ *      if not set) starting at appGlobals.offsetMB, in blocks of
+ *      appGlobals.bufSize sectors.
+ *
+ * Results:
+ *      The pattern; numBlocks is set to the size of the working set and
+ *      firstSector to its start.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+AccessPattern worker::NewPattern(VixDiskLibSectorType capacity,
+                                 uint64 &numBlocks,
+                                 VixDiskLibSectorType &firstSector)
+{
+    VixDiskLibSectorType workingSet;
+
+    firstSector = std::min<VixDiskLibSectorType>((uint64)appGlobals.offsetMB * 2048,
+                                                 capacity);
+    workingSet = capacity - firstSector;
+    if (appGlobals.workingSetMB != 0 &&
+        (uint64)appGlobals.workingSetMB * 2048 < workingSet) {
+       workingSet = (uint64)appGlobals.workingSetMB * 2048;
+    }
+    numBlocks = workingSet / appGlobals.bufSize;
+    return AccessPattern(appGlobals.accessPattern, numBlocks,
+                         appGlobals.strideBlocks, appGlobals.zipfTheta,
+                         appGlobals.seed);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VixDiskAsyncReadWrite --
+ *
+ *      Reads or writes the working set once with buffers of
+ *      appGlobals.bufSize sectors in the order of
+ *      appGlobals.accessPattern, keeping up to appGlobals.queueDepth
+ *      requests in flight. Buffers are recycled through an
+ *      AioBufferPool. If appGlobals.benchSeconds or
+ *      appGlobals.benchMBytes is set, the pattern keeps going until the
+ *      first limit is reached instead.
+ *
+ * Results:
+ *      Fills in result.
+ *
+ * Side effects:
+ *      Prints interval and total statistics if verbose is set.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::VixDiskAsyncReadWrite(VixDiskLibHandle handle,
+                                   VixDiskLibSectorType capacity,
+                                   bool read, bool verbose,
+                                   BenchResult &result,
+                                   BenchReport *report)
+{
+    size_t bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
+    // One buffer per request in flight, not the pool's maximum.
+    AioBufferPool aioBufPool(bufSize, appGlobals.queueDepth);
+    AioBenchStat stat(appGlobals.queueDepth);
+    LatencyHistogram latency;       // the last interval, taken from stat
+    uint64 maxOps, i, ops;
+    uint64 lastSectors = 0;
+    uint64 start, end, total, deadline, now;
+    uint64 maxSectors = (uint64)appGlobals.benchMBytes * 2048;
+    bool bounded = appGlobals.benchSeconds != 0 || maxSectors != 0;
+    bool warming = appGlobals.warmupSeconds != 0;
+    VixDiskLibSectorType firstSector;
+
+    if (!read) {
+       // Seed every pooled buffer once so that writes are not compressible.
+       vector<uint8*> bufs(aioBufPool.size());
+       for (i = 0; i < bufs.size(); i++) {
+          bufs[i] = aioBufPool.getBuffer();
+          InitBuffer((uint32*)bufs[i], bufSize / sizeof(uint32));
+       }
+       for (i = 0; i < bufs.size(); i++) {
+          aioBufPool.returnBuffer(bufs[i]);
+       }
     }
 
-    m_thread->quit();
+    AccessPattern pattern = NewPattern(capacity, maxOps, firstSector);
+    if (maxOps == 0) {
+       bounded = warming = false;
+    }
+
+    result.latency.reset();
+    total = GetTimeUsec();
+    start = total;
+    deadline = total + ((uint64)appGlobals.warmupSeconds +
+                        appGlobals.benchSeconds) * 1000000;
+    if (warming) {
+       // Requests submitted during warmup are not accounted.
+       stat.measureFrom = total + (uint64)appGlobals.warmupSeconds * 1000000;
+       if (verbose) {
+          printf("Warming up for %u seconds.\n", appGlobals.warmupSeconds);
+       }
+    }
+    if (report) {
+       report->beginRun(read ? "read" : "write", stat.measureFrom ?
+                        stat.measureFrom : total);
+       report->setRunParam("buf_sectors", appGlobals.bufSize);
+       report->setRunParam("queue_depth", appGlobals.queueDepth);
+    }
+    for (ops = 0; ; ) {
+       VixError vixError;
+       VixDiskLibSectorType sector;
+
+       if (!warming) {
+          if (!bounded && ops >= maxOps) {
+             break;
+          }
+          if (maxSectors != 0 && ops * appGlobals.bufSize >= maxSectors) {
+             break;
+          }
+       }
+       if (!stat.acquire()) {
+          break;
+       }
+       now = GetTimeUsec();
+       if (warming && now >= stat.measureFrom) {
+          warming = false;
+          total = start = now;
+       }
+       if (appGlobals.benchSeconds != 0 && now >= deadline) {
+          LockGuard<ThreadLock> lg(stat.lock);
+          --stat.inFlight;
+          break;
+       }
+       if (!warming) {
+          ++ops;
+       }
+
+       sector = firstSector + pattern.next() * appGlobals.bufSize;
+       uint8 *buf = aioBufPool.getBuffer();
+       AioBenchRequest *req = new AioBenchRequest(buf, aioBufPool, stat,
+                                                  appGlobals.bufSize);
+       req->submitted = GetTimeUsec();
+       if (read) {
+          vixError = DiskLib().ReadAsync(handle, sector,
+                                         appGlobals.bufSize, buf,
+                                         &AioBenchCB, req);
+       } else {
+          vixError = DiskLib().WriteAsync(handle, sector,
+                                          appGlobals.bufSize, buf,
+                                          &AioBenchCB, req);
+       }
+       if (vixError != VIX_ASYNC) {
+          AioBenchCB(req, vixError);
+       }
+
+       if (verbose) {
+          uint64 sectors;
+          {
+             LockGuard<ThreadLock> lg(stat.lock);
+             sectors = stat.sectors;
+             if (sectors - lastSectors >= BUFS_PER_STAT) {
+                // latency is empty; stat.latency starts over.
+                latency.swap(stat.latency);
+             }
+          }
+          if (sectors - lastSectors >= BUFS_PER_STAT) {
+             end = GetTimeUsec();
+             PrintStat(read, start, end, sectors - lastSectors);
+             PrintLatency(latency);
+             if (report) {
+                report->addSample(start, end, sectors - lastSectors, latency);
+             }
+             result.latency.merge(latency);
+             latency.reset();
+             start = end;
+             lastSectors = sectors;
+          }
+       }
+    }
+
+    DiskLib().Wait(handle);
+    stat.drain();
+    end = GetTimeUsec();
+
+    result.sectors = stat.sectors;
+    result.ops = stat.ops;
+    result.latency.merge(stat.latency);
+    result.error = stat.error;
+    result.elapsed = end - total;
+    result.poolWaits = aioBufPool.stats().waits;
+    result.poolHighWater = aioBufPool.stats().highWater;
+    if (verbose) {
+       PrintStat(read, total, end, result.sectors);
+       PrintLatency(result.latency);
+       printf("  buffer pool: %llu waits, high water %u of %u buffers\n",
+              (unsigned long long)result.poolWaits,
+              (uint32)result.poolHighWater, (uint32)aioBufPool.size());
+    }
+    if (report) {
+       report->setRunParam("pool_waits", result.poolWaits);
+       report->setRunParam("pool_high_water", result.poolHighWater);
+       report->setTotal(total, end, result.sectors, result.latency);
+    }
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * DumpBytes --
+ * AioBenchCB --
  *
- *      Displays an array of n bytes.
+ *      Completion callback for async benchmark requests. Returns the
+ *      buffer to its pool and accounts the request in its AioBenchStat.
  *
  * Results:
- *      None.
+ *      None
  *
  * Side effects:
- *      None.
+ *      Frees the request.
  *
  *----------------------------------------------------------------------
  */
 
-void worker::DumpBytes(const uint8 *buf, size_t n, int step)
+void worker::AioBenchCB(void *cbData, VixError err)
 {
-    size_t lines = n / step;
-    size_t i;
+    AioBenchRequest *req = static_cast<AioBenchRequest*>(cbData);
+    if (req == NULL) {
+       return;
+    }
 
-    for (i = 0; i < lines; i++) {
-       int k, last;
-       printf("%04x : ", i * step);
-       for (k = 0; n != 0 && k < step; k++, n--) {
-          printf("%02x ", buf[i * step + k]);
-       }
-       printf("  ");
-       last = k;
-       while (k --) {
-          unsigned char c = buf[i * step + last - k - 1];
-          if (c < ' ' || c >= 127) {
-             c = '.';
+    uint64 latency = GetTimeUsec() - req->submitted;
+
+    if (req->cbData) {
+       req->cbData->returnBuffer();
+    }
+    {
+       AioBenchStat &stat = req->stat;
+       LockGuard<ThreadLock> lg(stat.lock);
+       if (VIX_FAILED(err)) {
+          if (stat.error == VIX_OK) {
+             stat.error = err;
           }
-          printf("%c", c);
+       } else if (req->submitted >= stat.measureFrom) {
+          ++stat.ops;
+          stat.sectors += req->numSectors;
+          stat.latency.record(latency);
        }
-       printf("\n");
+       --stat.inFlight;
+       // Notify under the lock: the waiter may destroy stat as soon as
+       // it sees the last request complete.
+       stat.lock.notify();
     }
-    printf("\n");
+    delete req;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * DoRWBench --
+ * DoCheckRepair --
  *
- *      Perform read/write benchmarks according to settings in
- *      appGlobals. Note that a write benchmark will destroy the data
- *      in the target disk.
+ *      Check a sparse disk for internal consistency.
  *
  * Results:
  *      None
@@ -1114,115 +3446,241 @@ void worker::DumpBytes(const uint8 *buf, size_t n, int step)
  *----------------------------------------------------------------------
  */
 
-void worker::DoRWBench(bool read)
+void worker::DoCheckRepair(Bool repair)
 {
     DoInit();
 
-    VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().data(), appGlobals.openFlags);
-    size_t bufSize;
-    uint8 *buf;
-    VixDiskLibInfo *info;
     VixError err;
-    uint32 maxOps, i;
-    uint32 bufUpdate;
-    struct timeval start, end, total;
-
-    if (appGlobals.bufSize == 0) {
-       appGlobals.bufSize = DEFAULT_BUFSIZE;
-    }
-    bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
-
-    buf = new uint8[bufSize];
-    if (!read) {
-       InitBuffer((uint32*)buf, bufSize / sizeof(uint32));
-    }
 
-    err = VixDiskLib_GetInfo(disk.Handle(), &info);
+    err = DiskLib().CheckRepair(appGlobals.connection, appGlobals.diskPath.toUtf8().data(),
+                                repair);
     if (VIX_FAILED(err)) {
-       delete [] buf;
        throw VixDiskLibErrWrapper(err, __FILE__, __LINE__);
     }
+}
 
-    maxOps = info->capacity / appGlobals.bufSize;
-    VixDiskLib_FreeInfo(info);
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoAsyncIO --
+ *
+ *      Opens every disk in appGlobals.diskPaths and runs the async
+ *      read/write benchmark on all of them concurrently, one
+ *      TaskExecutor thread per disk.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    printf("Processing %d buffers of %d bytes.\n", maxOps, (uint32)bufSize);
+void worker::DoAsyncIO(bool read)
+{
+    DoInit();
 
-    gettimeofday(&total, NULL);
-    start = total;
-    bufUpdate = 0;
-    for (i = 0; i < maxOps; i++) {
-       VixError vixError;
+    size_t numDisks = appGlobals.diskPaths.size();
+    std::vector<VixDisk::Ptr> disks(numDisks);
+    std::vector<BenchResult> results(numDisks);
+    LatencyHistogram latency;
+    BenchReport report;
+    uint64 start, end;
+    uint64 totalSectors = 0;
+    VixError error = VIX_OK;
+    size_t i;
 
-       if (read) {
-          vixError = VixDiskLib_Read(disk.Handle(),
-                                     i * appGlobals.bufSize,
-                                     appGlobals.bufSize, buf);
-       } else {
-          vixError = VixDiskLib_Write(disk.Handle(),
-                                      i * appGlobals.bufSize,
-                                      appGlobals.bufSize, buf);
+    if (appGlobals.bufSize == 0) {
+       appGlobals.bufSize = DEFAULT_BUFSIZE;
+    }
+    if (appGlobals.queueDepth == 0) {
+       appGlobals.queueDepth = DEFAULT_QUEUEDEPTH;
+    }
+    if (appGlobals.queueDepth > VIX_AIO_BUFPOOL_SIZE) {
+       appGlobals.queueDepth = VIX_AIO_BUFPOOL_SIZE;
+    }
 
-       }
-       if (VIX_FAILED(vixError)) {
-          delete [] buf;
-          throw VixDiskLibErrWrapper(vixError, __FILE__, __LINE__);
-       }
+    for (i = 0; i < numDisks; ++i) {
+       disks[i] = boost::make_shared<VixDisk>(appGlobals.connection,
+                                              appGlobals.diskPaths[i].toUtf8().constData(),
+                                              appGlobals.openFlags, (int)i);
+    }
 
-       bufUpdate += appGlobals.bufSize;
-       if (bufUpdate >= BUFS_PER_STAT) {
-          gettimeofday(&end, NULL);
-          PrintStat(read, start, end, bufUpdate);
-          start = end;
-          bufUpdate = 0;
+    printf("Processing %d disks with buffers of %d bytes, "
+           "%d requests in flight per disk.\n", (uint32)numDisks,
+           (uint32)(appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE),
+           appGlobals.queueDepth);
+    PrintSeed();
+
+    start = GetTimeUsec();
+    {
+       TaskExecutor tasks(numDisks);
+       for (i = 0; i < numDisks; ++i) {
+          tasks.addTask(boost::bind(&VixDiskAsyncReadWrite,
+                                    disks[i]->Handle(),
+                                    disks[i]->getInfo()->capacity,
+                                    read, false, boost::ref(results[i]),
+                                    (BenchReport*)NULL));
        }
+    }   // ~TaskExecutor waits for all disks to finish
+    end = GetTimeUsec();
+
+    InitReport(report, read ? "readasyncbench" : "writeasyncbench",
+               disks[0]->Handle());
+    for (i = 0; i < numDisks; ++i) {
+       const BenchResult &r = results[i];
+       std::ostringstream name;
+
+       printf("Disk[%d] ", (int)i);
+       PrintStat(read, 0, r.elapsed, r.sectors);
+       PrintLatency(r.latency);
+       latency.merge(r.latency);
+
+       name << (read ? "read" : "write") << " disk" << i;
+       report.beginRun(name.str(), start);
+       report.setRunParam("buf_sectors", appGlobals.bufSize);
+       report.setRunParam("queue_depth", appGlobals.queueDepth);
+       report.setTotal(start, start + r.elapsed, r.sectors, r.latency);
+       if (VIX_FAILED(r.error)) {
+          std::string desc = VixDiskLibErrWrapper(r.error, __FILE__, __LINE__).Description();
+          printf("Disk[%d] failed: %s\n", (int)i, desc.c_str());
+          report.setError(desc);
+          if (error == VIX_OK) {
+             error = r.error;
+          }
+       }
+       totalSectors += r.sectors;
+    }
+    printf("Aggregate: ");
+    PrintStat(read, start, end, totalSectors);
+    PrintLatency(latency);
+
+    report.beginRun(read ? "read aggregate" : "write aggregate", start);
+    report.setRunParam("buf_sectors", appGlobals.bufSize);
+    report.setRunParam("queue_depth", appGlobals.queueDepth);
+    report.setRunParam("disks", numDisks);
+    report.setTotal(start, end, totalSectors, latency);
+    WriteReport(report);
+
+    if (VIX_FAILED(error)) {
+       THROW_ERROR(error);
     }
-    gettimeofday(&end, NULL);
-    PrintStat(read, total, end, appGlobals.bufSize * maxOps);
-    delete [] buf;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * DoCheckRepair --
+ * DoSweepBench --
  *
- *      Check a sparse disk for internal consistency.
+ *      Runs the async read/write benchmark for every combination of
+ *      appGlobals.sweepBufSizes and appGlobals.sweepDepths over a
+ *      single connection and disk handle, then prints a comparison
+ *      table. Every combination runs for appGlobals.benchSeconds
+ *      (default DEFAULT_SWEEP_SECONDS) or appGlobals.benchMBytes,
+ *      whichever comes first. Note that a write sweep will destroy
+ *      the data in the target disk.
  *
  * Results:
  *      None
  *
  * Side effects:
- *      None.
+ *      Changes appGlobals.bufSize and appGlobals.queueDepth.
  *
  *----------------------------------------------------------------------
  */
 
-void worker::DoCheckRepair(Bool repair)
+void worker::DoSweepBench(bool read)
 {
     DoInit();
 
-    VixError err;
+    VixDisk disk(appGlobals.connection, appGlobals.diskPath.toUtf8().data(), appGlobals.openFlags);
+    VixDiskLibSectorType capacity = disk.getInfo()->capacity;
+    size_t numBufs = appGlobals.sweepBufSizes.size();
+    size_t numDepths = appGlobals.sweepDepths.size();
+    std::vector<BenchResult> results(numBufs * numDepths);
+    std::ostringstream bufList, byteList, depthList;
+    BenchReport report;
+    VixError error = VIX_OK;
+    size_t b, d;
+
+    if (appGlobals.benchSeconds == 0 && appGlobals.benchMBytes == 0) {
+       appGlobals.benchSeconds = DEFAULT_SWEEP_SECONDS;
+    }
 
-    err = VixDiskLib_CheckRepair(appGlobals.connection, appGlobals.diskPath.toUtf8().data(),
-                                 repair);
-    if (VIX_FAILED(err)) {
-       throw VixDiskLibErrWrapper(err, __FILE__, __LINE__);
+    InitReport(report, read ? "readsweep" : "writesweep", disk.Handle());
+    for (b = 0; b < numBufs; ++b) {
+       bufList << (b ? "," : "") << appGlobals.sweepBufSizes[b];
+       byteList << (b ? "," : "")
+                << appGlobals.sweepBufSizes[b] * VIXDISKLIB_SECTOR_SIZE;
+    }
+    for (d = 0; d < numDepths; ++d) {
+       depthList << (d ? "," : "") << appGlobals.sweepDepths[d];
+    }
+    report.setConfig("buf_sectors", bufList.str());
+    report.setConfig("buf_bytes", byteList.str());
+    report.setConfig("queue_depth", depthList.str());
+
+    printf("Sweeping %d block sizes x %d queue depths, %s.\n",
+           (int)numBufs, (int)numDepths,
+           appGlobals.benchSeconds ? "time bounded" : "size bounded");
+    PrintSeed();
+
+    for (b = 0; b < numBufs && error == VIX_OK; ++b) {
+       for (d = 0; d < numDepths && error == VIX_OK; ++d) {
+          BenchResult &r = results[b * numDepths + d];
+
+          appGlobals.bufSize = appGlobals.sweepBufSizes[b];
+          appGlobals.queueDepth = std::min<unsigned>(appGlobals.sweepDepths[d],
+                                                     VIX_AIO_BUFPOOL_SIZE);
+          printf("  bufsize %u sectors, qdepth %u ...\n",
+                 (uint32)appGlobals.bufSize, appGlobals.queueDepth);
+          VixDiskAsyncReadWrite(disk.Handle(), capacity, read, false, r, &report);
+          if (VIX_FAILED(r.error)) {
+             std::string desc = VixDiskLibErrWrapper(r.error, __FILE__, __LINE__).Description();
+             printf("  failed: %s\n", desc.c_str());
+             report.setError(desc);
+             error = r.error;
+          }
+       }
+    }
+
+    printf("\n%10s %7s %10s %10s %10s %10s %10s\n", "bufsize KB", "qdepth",
+           "MB/sec", "IOPS", "p50 usec", "p99 usec", "max usec");
+    for (b = 0; b < numBufs; ++b) {
+       double best = 0;
+       size_t bestDepth = 0;
+       for (d = 0; d < numDepths; ++d) {
+          const BenchResult &r = results[b * numDepths + d];
+          double speed = ((double)VIXDISKLIB_SECTOR_SIZE * r.sectors) /
+                         ((double)(1024 * 1024) * std::max<uint64>(r.elapsed, 1)) * 1000000;
+          if (speed > best) {
+             best = speed;
+             bestDepth = d;
+          }
+       }
+       for (d = 0; d < numDepths; ++d) {
+          const BenchResult &r = results[b * numDepths + d];
+          uint64 elapsed = std::max<uint64>(r.elapsed, 1);
+          printf("%10u %7u %10.1f %10.0f %10llu %10llu %10llu%s\n",
+                 appGlobals.sweepBufSizes[b] * VIXDISKLIB_SECTOR_SIZE / 1024,
+                 appGlobals.sweepDepths[d],
+                 ((double)VIXDISKLIB_SECTOR_SIZE * r.sectors) /
+                 ((double)(1024 * 1024) * elapsed) * 1000000,
+                 (double)r.ops * 1000000 / elapsed,
+                 (unsigned long long)r.latency.percentile(50),
+                 (unsigned long long)r.latency.percentile(99),
+                 (unsigned long long)r.latency.max(),
+                 (d == bestDepth && best > 0) ? " *" : "");
+       }
     }
-}
 
-//void worker::DoAsyncIO(bool read)
-//{
-//    std::vector<VixDisk::Ptr> disks(appGlobals.diskPaths.size());
-//    TaskExecutor tasks(appGlobals.diskPaths.size());
-//    for (int i = 0 ; i < appGlobals.diskPaths.size() ; ++i) {
-//       VixDisk::Ptr disk = boost::make_shared<VixDisk>(appGlobals.connection,
-//                    appGlobals.diskPaths[i].c_str(),
-//                    appGlobals.openFlags, i);
-//       disks[i] = disk;
-//       tasks.addTask(boost::bind(&VixDiskAsyncReadWrite, disk, read));
-//    }
-//}
+    WriteReport(report);
+
+    if (VIX_FAILED(error)) {
+       THROW_ERROR(error);
+    }
+}
 
 /*
  *--------------------------------------------------------------------------
@@ -1253,29 +3711,120 @@ int worker::PrintUsage()
     printf(" -dump : dumps the contents of specified range of sectors "
            "in hexadecimal\n");
     printf(" -fill : fills specified range of sectors with byte value "
-           "specified by -val\n");
+           "specified by -val, writing -bufsize sectors per request with "
+           "-qdepth writes in flight\n");
     printf(" -wmeta key value : writes (key,value) entry into disk's metadata table\n");
     printf(" -rmeta key : displays the value of the specified metada entry\n");
     printf(" -meta : dumps all entries of the disk's metadata\n");
     printf(" -clone sourcePath : clone source vmdk possibly to a remote site\n");
+    printf(" -copy destPath : copy the disk to a new local sparse vmdk, splitting "
+           "it into -streams extents copied concurrently\n");
     printf(" -readbench blocksize: Does a read benchmark on a disk using the \n");
     printf("specified I/O block size (in sectors).\n");
     printf(" -writebench blocksize: Does a write benchmark on a disk using the\n");
     printf("specified I/O block size (in sectors). WARNING: This will\n");
     printf("overwrite the contents of the disk specified.\n");
+    printf(" -readasyncbench blocksize: Does a read benchmark keeping -qdepth\n");
+    printf("async requests of the specified block size (in sectors) in flight.\n");
+    printf(" -writeasyncbench blocksize: Does a write benchmark keeping -qdepth\n");
+    printf("async requests of the specified block size (in sectors) in flight.\n");
+    printf("WARNING: This will overwrite the contents of the disk specified.\n");
+    printf(" -readsweep blocksizes depths: Runs -readasyncbench for every combination\n");
+    printf("of the comma separated block sizes (in sectors) and queue depths on one\n");
+    printf("connection and prints a comparison table, e.g. -readsweep 64,256,1024 1,4,16\n");
+    printf(" -writesweep blocksizes depths: Same as -readsweep for writes.\n");
+    printf("WARNING: This will overwrite the contents of the disk specified.\n");
     printf(" -check repair: Check a sparse disk for internal consistency, "
            "where repair is a boolean value to indicate if a repair operation "
-           "should be attempted.\n\n");
+           "should be attempted.\n");
+    printf(" -batch : 'diskPath' is a job file with the arguments of one command "
+           "per line, run one after another on shared connections; the other "
+           "options are the defaults of every job\n\n");
 
     printf("options:\n");
     printf(" -adapter [ide|scsi] : bus adapter type for 'create' option "
            "(default='scsi')\n");
     printf(" -start n : start sector for 'dump/fill' options (default=0)\n");
     printf(" -count n : number of sectors for 'dump/fill' options (default=1)\n");
+    printf(" -dumpfile file : write raw sector contents to file instead of "
+           "hex for 'dump' option\n");
+    printf(" -bufsize n : sectors per request for 'dump/fill' options (default=%d)\n",
+           DEFAULT_BUFSIZE);
+    printf(" -results file : write benchmark configuration, interval samples and "
+           "totals to file, as CSV if it ends in .csv and JSON otherwise\n");
     printf(" -val byte : byte value to fill with for 'write' option (default=255)\n");
     printf(" -cap megabytes : capacity in MB for -create option (default=100)\n");
     printf(" -single : open file as single disk link (default=open entire chain)\n");
     printf(" -multithread n: start n threads and copy the file to n new files\n");
+    printf(" -chunk n : chunk size in sectors for copies (default=%d)\n",
+           DEFAULT_CHUNKSIZE);
+    printf(" -copydepth n : chunks in flight per copy stream "
+           "(default=%d, max=%d)\n", DEFAULT_COPY_DEPTH, VIX_COPY_BUFPOOL_SIZE);
+    printf(" -backend vddk|file : disk library to use; 'file' keeps disks in "
+           "local sparse files, no VDDK or host needed (default=vddk)\n");
+    printf(" -filelatency usec : with -backend file, delay every read and write\n");
+    printf(" -filebandwidth MB : with -backend file, limit the throughput of all "
+           "disks to MB/s\n");
+    printf(" -fileerrors rate : with -backend file, fail this fraction of reads "
+           "and writes, e.g. 0.001\n");
+    printf(" -fileasyncthreads n : with -backend file, threads doing the I/O "
+           "and callbacks of async requests once they are due (default=%d)\n",
+           (int)FileBackendParams().asyncThreads);
+    printf(" -model nbd|nbdssl|hotadd|san : with -backend file, emulate the cost "
+           "of this transport on every connection; -mode selects it too\n");
+    printf(" -modellatency usec, -modelwire usecPerMB, -modelconcurrency n, "
+           "-modeltls usecPerMB : override the request latency, wire time, "
+           "requests in service per connection and TLS CPU time of the model\n");
+    printf(" -hugepages : back I/O buffers with huge/large pages when the OS "
+           "allows it\n");
+    printf(" -verify manifestPath : check the disk against a manifest written "
+           "by -copy -manifest\n");
+    printf(" -incremental parentPath childPath : create a child of the local "
+           "parent and write only the chunks that differ from -base\n");
+    printf(" -base manifestPath : manifest describing the parent of "
+           "-incremental\n");
+    printf(" -manifest path : with -copy or -incremental, save a hash of every "
+           "chunk to path\n");
+    printf(" -idletimeout sec : keep the connection open for later commands "
+           "this long after the last one (default=%d, 0=disconnect)\n",
+           DEFAULT_IDLE_TIMEOUT);
+    printf(" -hashthreads n : threads hashing chunks for -manifest and -verify "
+           "(default=%d)\n", DEFAULT_HASH_THREADS);
+    printf(" -resume : checkpoint -copy in destPath.journal and continue an "
+           "interrupted copy\n");
+    printf(" -streams n : number of concurrent extents of -copy (default=%d)\n",
+           DEFAULT_COPY_STREAMS);
+    printf(" -workers n : number of workers sharing the -multithread copies "
+           "(default=number of copies)\n");
+    printf(" -segment n : size in sectors of the pieces -multithread copies are "
+           "split into for the workers (default=%d)\n", DEFAULT_SEGMENT_SIZE);
+    printf(" -perthreadconn : give every -multithread copy thread its own "
+           "source connection instead of sharing one\n");
+    printf(" -noskipzero : write all-zero chunks to sparse copy destinations "
+           "instead of skipping them\n");
+    printf(" -disk path : additional disk for -readasyncbench/-writeasyncbench; "
+           "may be repeated, all disks are benchmarked concurrently\n");
+    printf(" -pattern seq|random|stride|zipf : order in which benchmarks visit "
+           "blocks (default=seq)\n");
+    printf(" -stride n : distance in blocks between requests for -pattern stride "
+           "(default=8)\n");
+    printf(" -zipf theta : skew between 0 and 1 of the hot spots for -pattern zipf "
+           "(default=0.99)\n");
+    printf(" -seed n : seed for random access patterns, printed by every run "
+           "(default=time based)\n");
+    printf(" -offset megabytes : start of the disk window used by benchmarks "
+           "(default=0)\n");
+    printf(" -workingset megabytes : size of the disk window used by benchmarks "
+           "(default=rest of the disk)\n");
+    printf(" -duration sec : run benchmarks and every sweep combination for "
+           "sec seconds, wrapping around the window (sweep default=%d)\n",
+           DEFAULT_SWEEP_SECONDS);
+    printf(" -maxmb n : stop benchmarks and every sweep combination after "
+           "n MBytes\n");
+    printf(" -warmup sec : run benchmarks for sec seconds before measuring; "
+           "warmup I/O is excluded from all results\n");
+    printf(" -qdepth n : number of requests in flight for async benchmarks "
+           "(default=%d, max=%d)\n", DEFAULT_QUEUEDEPTH, VIX_AIO_BUFPOOL_SIZE);
     printf(" -host hostname : hostname/IP address of VC/vSphere host (Mandatory)\n");
     printf(" -user userid : user name on host (Mandatory) \n");
     printf(" -password password : password on host. (Mandatory)\n");
@@ -1326,13 +3875,13 @@ void worker::GenerateRandomFilename(const std::string &prefix, std::string &rand
 /*
  *----------------------------------------------------------------------
  *
- * gettimeofday --
+ * GetTimeUsec --
  *
- *      Mimics BSD style gettimeofday in a way that is close enough
- *      for some I/O benchmarking.
+ *      Reads a monotonic, high resolution clock for I/O benchmarking:
+ *      QueryPerformanceCounter on Windows, CLOCK_MONOTONIC elsewhere.
  *
  * Results:
- *      None.
+ *      Time in usec since an arbitrary fixed point.
  *
  * Side effects:
  *      None.
@@ -1340,12 +3889,24 @@ void worker::GenerateRandomFilename(const std::string &prefix, std::string &rand
  *----------------------------------------------------------------------
  */
 
-void worker::gettimeofday(timeval *tv, void *)
+uint64 worker::GetTimeUsec()
 {
-    uint64 ticks = GetTickCount();
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
 
-    tv->tv_sec = ticks / 1000;
-    tv->tv_usec = 1000 * (ticks % 1000);
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64)(now.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
 }
 
 /*
@@ -1440,43 +4001,347 @@ Bool worker::CloneProgressFunc(void *, int percentCompleted)
 /*
  *----------------------------------------------------------------------
  *
- * CopyThread --
+ * CopyWorker --
  *
- *       Copies a source disk to the given file.
+ *      Copies the segments handed out by job.scheduler until none are
+ *      left. Every worker reads through its own source handle, opening
+ *      one on demand for disks it steals from, while writes to a
+ *      destination are serialized on job.dstLocks.
  *
  * Results:
- *       0 if succeeded, 1 if not.
+ *      None.
  *
  * Side effects:
- *      Creates a new disk; sets appGlobals.success to false if fails
+ *      Updates the ThreadData totals; sets job.error and
+ *      appGlobals.success on failure.
  *
  *----------------------------------------------------------------------
  */
 
-unsigned worker::CopyThread(void *arg)
+void worker::CopyWorker(CopyJob &job, size_t id)
 {
-    ThreadData *td = (ThreadData *)arg;
+    size_t numDisks = job.disks.size();
+    size_t numWorkers = job.scheduler.workers();
+    std::vector<VixDiskLibHandle> srcHandles(numDisks, (VixDiskLibHandle)NULL);
+    uint32 depth = appGlobals.copyDepth ? appGlobals.copyDepth
+                                        : DEFAULT_COPY_DEPTH;
+    CopySegment seg;
+    size_t d;
+
+    if (depth > VIX_COPY_BUFPOOL_SIZE) {
+        depth = VIX_COPY_BUFPOOL_SIZE;
+    }
+    // PrepareThreadData always creates a sparse destination.
+    CopyStat stat(appGlobals.chunkSize * VIXDISKLIB_SECTOR_SIZE, depth,
+                  appGlobals.skipZero);
+
+    // A disk's own handle belongs to its home worker.
+    for (d = id; d < numDisks; d += numWorkers) {
+        srcHandles[d] = job.disks[d].srcHandle;
+    }
 
     try {
-        VixDiskLibSectorType i;
-        VixError vixError;
-        uint8 buf[VIXDISKLIB_SECTOR_SIZE];
+        while (job.scheduler.next(id, seg)) {
+            ThreadData &td = job.disks[seg.disk];
+            VixError vixError;
+            uint64 sectors = stat.sectors, skipped = stat.skipped;
+
+            {
+                LockGuard<ThreadLock> lg(job.lock);
+                if (VIX_FAILED(job.error)) {
+                    break;
+                }
+            }
+            if (srcHandles[seg.disk] == NULL) {
+                LockGuard<ThreadLock> lg(openLock);
+                vixError = DiskLib().Open(td.srcConnection,
+                                          appGlobals.diskPath.toUtf8().constData(),
+                                          appGlobals.openFlags | VIXDISKLIB_FLAG_OPEN_READ_ONLY,
+                                          &srcHandles[seg.disk]);
+                CHECK_AND_THROW(vixError);
+            }
 
-        for (i = 0; i < td->numSectors; i ++) {
-            vixError = VixDiskLib_Read(td->srcHandle, i, 1, buf);
-            CHECK_AND_THROW(vixError);
-            vixError = VixDiskLib_Write(td->dstHandle, i, 1, buf);
+            vixError = CopyRange(srcHandles[seg.disk], td.dstHandle, seg.start,
+                                 seg.count, stat, &job.dstLocks[seg.disk]);
+            if (VIX_FAILED(vixError)) {
+                CopyWait(td.dstHandle, stat);
+            } else {
+                vixError = CopyWait(td.dstHandle, stat);
+            }
             CHECK_AND_THROW(vixError);
-        }
 
+            ++job.segments[id];
+            job.sectors[id] += stat.sectors - sectors;
+            {
+                LockGuard<ThreadLock> lg(job.lock);
+                td.skippedSectors += stat.skipped - skipped;
+                td.elapsed = GetTimeUsec() - job.start;
+            }
+        }
     } catch (const VixDiskLibErrWrapper& e) {
-        cout << "CopyThread (" << td->dstDisk << ")Error: " << e.ErrorCode()
-             <<" " << e.Description();
-        appGlobals.success = FALSE;
-        return TASK_FAIL;
+        cout << "CopyWorker[" << id << "] (" << job.disks[seg.disk].dstDisk
+             << ") Error: " << e.ErrorCode() << " " << e.Description() << "\n";
+        LockGuard<ThreadLock> lg(job.lock);
+        if (job.error == VIX_OK) {
+            job.error = e.ErrorCode();
+        }
+        appGlobals.success = false;
+    }
+
+    LockGuard<ThreadLock> lg(openLock);
+    for (d = 0; d < numDisks; ++d) {
+        if (srcHandles[d] && srcHandles[d] != job.disks[d].srcHandle) {
+            DiskLib().Close(srcHandles[d]);
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyRange --
+ *
+ *      Copies numSectors sectors starting at startSector from srcHandle
+ *      to dstHandle in chunks of appGlobals.chunkSize sectors. Each
+ *      chunk is read synchronously into a pooled buffer and written
+ *      asynchronously, so reads overlap with the writes of previous
+ *      chunks; at most stat.maxInFlight chunks are outstanding. If
+ *      dstLock is given, writes are submitted while holding it so that
+ *      several threads can share dstHandle.
+ *
+ * Results:
+ *      VIX_OK if all chunks were read and submitted, the first error
+ *      otherwise. Writes may still be in flight, see CopyWait.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VixError worker::CopyRange(VixDiskLibHandle srcHandle,
+                           VixDiskLibHandle dstHandle,
+                           VixDiskLibSectorType startSector,
+                           VixDiskLibSectorType numSectors,
+                           CopyStat &stat,
+                           ThreadLock *dstLock)
+{
+    VixDiskLibSectorType sector, count;
+    VixDiskLibSectorType endSector = startSector + numSectors;
+    VixError vixError;
+
+    for (sector = startSector; sector < endSector; sector += count) {
+        count = endSector - sector;
+        if (count > appGlobals.chunkSize) {
+            count = appGlobals.chunkSize;
+        }
+        {
+            LockGuard<ThreadLock> lg(stat.lock);
+            while (stat.inFlight >= stat.maxInFlight) {
+                stat.lock.wait();
+            }
+            if (VIX_FAILED(stat.error)) {
+                return stat.error;
+            }
+            ++stat.inFlight;
+        }
+
+        uint8 *buf = stat.pool.getBuffer();
+        CopyRequest *req = new CopyRequest(buf, stat, count);
+
+        req->chunk = sector / appGlobals.chunkSize;
+        if (stat.journal) {
+            if (stat.journal->isDone(req->chunk)) {
+                if (dstLock) {
+                    dstLock->lock();
+                }
+                vixError = DiskLib().Read(dstHandle, sector, count, buf);
+                if (dstLock) {
+                    dstLock->unlock();
+                }
+                if (VIX_SUCCEEDED(vixError) &&
+                    CopyJournal::Checksum(buf, count * VIXDISKLIB_SECTOR_SIZE) ==
+                    stat.journal->checksum(req->chunk)) {
+                    req->resumed = true;
+                    if (stat.hasher) {
+                        ++req->refs;
+                        stat.hasher->addTask(boost::bind(&CopyHash, req));
+                    }
+                    CopyCB(req, VIX_OK);
+                    continue;
+                }
+                stat.journal->clear(req->chunk);
+            }
+        }
+
+        vixError = DiskLib().Read(srcHandle, sector, count, buf);
+        if (VIX_FAILED(vixError)) {
+            CopyCB(req, vixError);
+            return vixError;
+        }
+        if (stat.hasher) {
+            ++req->refs;
+            stat.hasher->addTask(boost::bind(&CopyHash, req));
+        } else if (stat.journal) {
+            req->checksum = CopyJournal::Checksum(buf, count * VIXDISKLIB_SECTOR_SIZE);
+        }
+        if (stat.skipZero && IsZeroBuffer(buf, count * VIXDISKLIB_SECTOR_SIZE)) {
+            req->skipped = true;
+            CopyCB(req, VIX_OK);
+            continue;
+        }
+        if (dstLock) {
+            dstLock->lock();
+        }
+        vixError = DiskLib().WriteAsync(dstHandle, sector, count, buf,
+                                        &CopyCB, req);
+        if (dstLock) {
+            dstLock->unlock();
+        }
+        if (vixError != VIX_ASYNC) {
+            CopyCB(req, vixError);
+            if (VIX_FAILED(vixError)) {
+                return vixError;
+            }
+        }
+    }
+    return VIX_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyWait --
+ *
+ *      Waits until every chunk submitted by CopyRange has been written.
+ *      Safe to call while other threads submit to the same handle.
+ *
+ * Results:
+ *      VIX_OK if all writes succeeded, the first error otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VixError worker::CopyWait(VixDiskLibHandle dstHandle, CopyStat &stat)
+{
+    // Not under the destination lock: threads sharing dstHandle would
+    // wait for each other's writes one at a time. stat.inFlight counts
+    // only this caller's chunks.
+    DiskLib().Wait(dstHandle);
+
+    LockGuard<ThreadLock> lg(stat.lock);
+    while (stat.inFlight != 0) {
+        stat.lock.wait();
+    }
+    return stat.error;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyCB --
+ *
+ *      Completion callback for pipelined copy writes, also called for
+ *      chunks that are not written.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      May complete the request, see CopyRelease.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::CopyCB(void *cbData, VixError err)
+{
+    CopyRequest *req = static_cast<CopyRequest*>(cbData);
+    if (req == NULL) {
+        return;
     }
 
-    cout << "CopyThread to " << td->dstDisk << " succeeded.\n";
-    return TASK_OK;
+    req->error = err;
+    CopyRelease(req);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyHash --
+ *
+ *      Runs on the hashing threads: hashes a chunk of a copy into the
+ *      manifest while its write is in flight.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      May complete the request, see CopyRelease.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::CopyHash(CopyRequest *req)
+{
+    uint64 hash = ChunkManifest::Hash(req->buf,
+                                      req->numSectors * VIXDISKLIB_SECTOR_SIZE);
+
+    req->stat.manifest->set(req->chunk, hash);
+    req->checksum = CopyJournal::Fold(hash);
+    CopyRelease(req);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyRelease --
+ *
+ *      Drops a reference to a chunk of a copy. The last one returns the
+ *      chunk buffer to its pool, checkpoints the chunk in the copy's
+ *      journal, if any, and accounts it in its CopyStat.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Frees the request.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void worker::CopyRelease(CopyRequest *req)
+{
+    VixError err;
+
+    if (--req->refs > 0) {
+        return;
+    }
+
+    err = req->error;
+    req->cbData.returnBuffer();
+    if (req->stat.journal && VIX_SUCCEEDED(err) && !req->resumed &&
+        !req->stat.journal->markDone(req->chunk, req->checksum)) {
+        err = VIX_E_FILE_ERROR;
+    }
+    {
+        CopyStat &stat = req->stat;
+        LockGuard<ThreadLock> lg(stat.lock);
+        if (VIX_FAILED(err)) {
+            if (stat.error == VIX_OK) {
+                stat.error = err;
+            }
+        } else if (req->resumed) {
+            stat.resumed += req->numSectors;
+        } else if (req->skipped) {
+            stat.skipped += req->numSectors;
+        } else {
+            stat.sectors += req->numSectors;
+        }
+        --stat.inFlight;
+        stat.lock.notify();
+    }
+    delete req;
+}
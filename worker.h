@@ -12,6 +12,8 @@
 #else
 #include <dlfcn.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 #include <time.h>
@@ -19,16 +21,31 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <fstream>
 #include <iomanip>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <new>
+#include <algorithm>
+#include <deque>
+#include <atomic>
+#include <math.h>
 
 #include "vixDiskLib.h"
+#include "diskbackend.h"
+#include "benchreport.h"
+#include "threadlock.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VIX_HAVE_SSE2 1
+#endif
 
 #include <QObject>
 #include <QThread>
+#include <QStringList>
 
 using std::cout;
 using std::string;
@@ -53,6 +70,12 @@ using std::vector;
 #define COMMAND_DEFRAG              (1 << 14)
 #define COMMAND_READASYNCBENCH      (1 << 15)
 #define COMMAND_WRITEASYNCBENCH     (1 << 16)
+#define COMMAND_READSWEEP           (1 << 17)
+#define COMMAND_WRITESWEEP          (1 << 18)
+#define COMMAND_COPY                (1 << 19)
+#define COMMAND_VERIFY              (1 << 20)
+#define COMMAND_INCREMENTAL         (1 << 21)
+#define COMMAND_BATCH               (1 << 22)
 
 #define VIXDISKLIB_VERSION_MAJOR 6
 #define VIXDISKLIB_VERSION_MINOR 5
@@ -63,6 +86,32 @@ using std::vector;
 // Default buffer size (in sectors) for read/write benchmarks
 #define DEFAULT_BUFSIZE 128
 
+// Default number of requests kept in flight by the async benchmarks
+#define DEFAULT_QUEUEDEPTH 16
+
+// Default chunk size (in sectors) and number of chunks in flight for
+// pipelined disk copies
+#define DEFAULT_CHUNKSIZE 2048
+#define DEFAULT_COPY_DEPTH 4
+
+// Default number of concurrent streams of a -copy
+#define DEFAULT_COPY_STREAMS 4
+
+// Default number of threads hashing chunks for a manifest
+#define DEFAULT_HASH_THREADS 2
+
+// Default time (in seconds) an unused connection is kept open for the
+// next command
+#define DEFAULT_IDLE_TIMEOUT 300
+
+// Default size (in sectors) of the segments -multithread copies are
+// split into for scheduling between workers (256 MBytes)
+#define DEFAULT_SEGMENT_SIZE (512 * 1024)
+
+// Default duration (in seconds) of every block size/queue depth
+// combination of a benchmark sweep
+#define DEFAULT_SWEEP_SECONDS 10
+
 // Print updated statistics for read/write benchmarks roughly every
 // BUFS_PER_STAT sectors (current value is 64MBytes worth of data)
 #define BUFS_PER_STAT (128 * 1024)
@@ -71,14 +120,302 @@ using std::vector;
 static const char randChars[] = "0123456789"
    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 
+// Log-linear histogram of latencies in usec. Values below SUB_COUNT are
+// counted exactly; every larger power of two is split into SUB_COUNT
+// linear buckets, so any percentile is within ~3% of the true value.
+class LatencyHistogram
+{
+   public:
+      enum {
+         SUB_BITS = 5,
+         SUB_COUNT = 1 << SUB_BITS,
+         BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT
+      };
+
+      LatencyHistogram()
+         : counts(BUCKETS, 0), total(0), sum(0), maxValue(0)
+      {}
+
+      void record(uint64 value)
+      {
+         ++counts[index(value)];
+         ++total;
+         sum += value;
+         if (value > maxValue) {
+            maxValue = value;
+         }
+      }
+
+      void merge(const LatencyHistogram& other)
+      {
+         for (size_t i = 0; i < counts.size(); ++i) {
+            counts[i] += other.counts[i];
+         }
+         total += other.total;
+         sum += other.sum;
+         if (other.maxValue > maxValue) {
+            maxValue = other.maxValue;
+         }
+      }
+
+      void reset()
+      {
+         std::fill(counts.begin(), counts.end(), 0);
+         total = sum = maxValue = 0;
+      }
+
+      void swap(LatencyHistogram& other)
+      {
+         counts.swap(other.counts);
+         std::swap(total, other.total);
+         std::swap(sum, other.sum);
+         std::swap(maxValue, other.maxValue);
+      }
+
+      uint64 count() const { return total; }
+      uint64 max() const { return maxValue; }
+      uint64 mean() const { return total ? sum / total : 0; }
+
+      // Upper bound of the bucket holding the given percentile (0..100).
+      uint64 percentile(double pct) const
+      {
+         if (total == 0) {
+            return 0;
+         }
+         uint64 rank = (uint64)(pct / 100.0 * total + 0.5);
+         uint64 seen = 0;
+         if (rank == 0) {
+            rank = 1;
+         }
+         for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+               uint64 high = highestEquivalent(i);
+               return high < maxValue ? high : maxValue;
+            }
+         }
+         return maxValue;
+      }
+
+   private:
+      static int msb(uint64 v)
+      {
+         int n = 0;
+         for (int shift = 32; shift > 0; shift >>= 1) {
+            if (v >> shift) {
+               v >>= shift;
+               n += shift;
+            }
+         }
+         return n;
+      }
+
+      static size_t index(uint64 v)
+      {
+         if (v < SUB_COUNT) {
+            return (size_t)v;
+         }
+         int shift = msb(v) - SUB_BITS;
+         return (shift + 1) * SUB_COUNT + (size_t)((v >> shift) - SUB_COUNT);
+      }
+
+      static uint64 highestEquivalent(size_t i)
+      {
+         if (i < SUB_COUNT) {
+            return i;
+         }
+         int shift = (int)(i / SUB_COUNT) - 1;
+         uint64 sub = i % SUB_COUNT + SUB_COUNT;
+         return ((sub + 1) << shift) - 1;
+      }
+
+      std::vector<uint64> counts;
+      uint64 total;
+      uint64 sum;
+      uint64 maxValue;
+};
+
+// Generates the block numbers visited by a benchmark: sequential,
+// uniform random, strided, or Zipfian hot spots over numBlocks blocks.
+// The generator is seeded explicitly so that runs can be repeated.
+class AccessPattern
+{
+   public:
+      enum Mode {
+         SEQUENTIAL,
+         RANDOM,
+         STRIDED,
+         ZIPF
+      };
+
+      AccessPattern(Mode m, uint64 blocks, uint64 strideBlocks = 1,
+                    double zipfTheta = 0.99, uint64 seed = 1)
+         : mode(m), numBlocks(blocks ? blocks : 1),
+           stride(strideBlocks ? strideBlocks : 1), pos(0), lane(0),
+           state(seed), theta(zipfTheta), alpha(0), zetan(0), eta(0)
+      {
+         if (mode == ZIPF) {
+            double zeta2 = zeta(2, theta);
+            zetan = zeta(numBlocks, theta);
+            alpha = 1.0 / (1.0 - theta);
+            eta = (1.0 - pow(2.0 / numBlocks, 1.0 - theta)) /
+                  (1.0 - zeta2 / zetan);
+         }
+      }
+
+      uint64 next()
+      {
+         uint64 block;
+
+         switch (mode) {
+         case RANDOM:
+            return nextRandom() % numBlocks;
+         case STRIDED:
+            block = pos;
+            pos += stride;
+            if (pos >= numBlocks) {
+               lane = (lane + 1) % stride;
+               pos = lane % numBlocks;
+            }
+            return block;
+         case ZIPF:
+            // Scatter the hot ranks over the disk instead of packing
+            // them at its start.
+            return scramble(zipfRank()) % numBlocks;
+         default:
+            block = pos;
+            pos = (pos + 1) % numBlocks;
+            return block;
+         }
+      }
+
+      static const char *Name(Mode m)
+      {
+         switch (m) {
+         case RANDOM:   return "random";
+         case STRIDED:  return "stride";
+         case ZIPF:     return "zipf";
+         default:       return "seq";
+         }
+      }
+
+   private:
+      // splitmix64: small, fast and good enough for picking offsets.
+      uint64 nextRandom()
+      {
+         uint64 z = (state += 0x9E3779B97F4A7C15ULL);
+         z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+         z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+         return z ^ (z >> 31);
+      }
+
+      static uint64 scramble(uint64 v)
+      {
+         v = (v ^ (v >> 33)) * 0xFF51AFD7ED558CCDULL;
+         v = (v ^ (v >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+         return v ^ (v >> 33);
+      }
+
+      // Rank drawn from a Zipf distribution, as in Gray et al., "Quickly
+      // Generating Billion-Record Synthetic Databases".
+      uint64 zipfRank()
+      {
+         double u = (double)(nextRandom() >> 11) / (double)(1ULL << 53);
+         double uz = u * zetan;
+
+         if (uz < 1.0) {
+            return 0;
+         }
+         if (uz < 1.0 + pow(0.5, theta)) {
+            return 1;
+         }
+         return (uint64)(numBlocks * pow(eta * u - eta + 1.0, alpha));
+      }
+
+      // Generalized harmonic number; past 1M terms the tail is taken
+      // from the Euler-Maclaurin approximation to keep setup fast.
+      static double zeta(uint64 n, double theta)
+      {
+         const uint64 exact = 1 << 20;
+         double sum = 0;
+         uint64 i, m = n < exact ? n : exact;
+
+         for (i = 1; i <= m; i++) {
+            sum += 1.0 / pow((double)i, theta);
+         }
+         if (n > m) {
+            sum += (pow((double)n, 1.0 - theta) - pow((double)m, 1.0 - theta)) /
+                   (1.0 - theta) +
+                   0.5 * (1.0 / pow((double)n, theta) - 1.0 / pow((double)m, theta));
+         }
+         return sum;
+      }
+
+      Mode mode;
+      uint64 numBlocks;
+      uint64 stride;
+      uint64 pos;
+      uint64 lane;
+      uint64 state;
+      double theta;
+      double alpha;
+      double zetan;
+      double eta;
+};
+
 // Per-thread information for multi-threaded VixDiskLib test.
 struct ThreadData {
    std::string dstDisk;
+   VixDiskLibConnection srcConnection;  // appGlobals.connection or the thread's own
+   VixDiskLibHandle srcHandle;
+   VixDiskLibHandle dstHandle;
+   VixDiskLibSectorType numSectors;
+   uint64 connectTime;              // usec connecting, 0 on the shared connection
+   uint64 openTime;                 // usec opening source and destination
+   uint64 createTime;               // usec creating the destination
+   uint64 elapsed;                  // copy time in usec
+   uint64 skippedSectors;           // sectors of all-zero chunks not written
+   VixError error;                  // setup error, VIX_OK otherwise
+};
+
+// One stream of a -copy: a disjoint extent of the source copied through
+// its own source handle and, if the destination allows it, its own
+// destination handle.
+struct CopyStream {
+   VixDiskLibConnection srcConnection;  // appGlobals.connection or the stream's own
    VixDiskLibHandle srcHandle;
    VixDiskLibHandle dstHandle;
+   bool ownsDst;                    // dstHandle was opened for this stream, not shared
+   VixDiskLibSectorType startSector;
    VixDiskLibSectorType numSectors;
+   uint64 elapsed;                  // copy time in usec
+   uint64 sectors;                  // sectors written
+   uint64 skippedSectors;           // sectors of all-zero chunks not written
+   uint64 resumedSectors;           // sectors already copied by an earlier run
+   VixError error;                  // first error, VIX_OK otherwise
+};
+
+// Results of a single benchmark pass over one disk.
+struct BenchResult {
+   uint64 sectors;                  // sectors transferred
+   uint64 elapsed;                  // wall time in usec
+   uint64 ops;                      // completed requests
+   LatencyHistogram latency;        // per-request latencies in usec
+   uint64 poolWaits;                // submissions that waited for a buffer
+   size_t poolHighWater;            // most buffers in flight at once
+   VixError error;                  // first error seen, VIX_OK otherwise
 };
 
+struct AioBenchStat;
+struct CopyStat;
+struct CopyJob;
+class CopyJournal;
+class TaskExecutor;
+class ChunkManifest;
+class ConnectionPool;
+struct CopyRequest;
+struct VerifyJob;
+
 
 #define THROW_ERROR(vixError) \
    throw VixDiskLibErrWrapper((vixError), __FILE__, __LINE__)
@@ -109,16 +446,40 @@ struct WorkerConfig
     VixDiskLibAdapterType adapterType;
     QString transportModes;
     QString diskPath;
+    QStringList diskPaths;
     QString parentPath;
     QString metaKey;
     QString metaVal;
+    QString dumpFile;
+    QString resultsFile;
     int filler;
     unsigned mbSize;
     VixDiskLibSectorType numSectors;
     VixDiskLibSectorType startSector;
     VixDiskLibSectorType bufSize;
+    VixDiskLibSectorType chunkSize;
+    unsigned copyDepth;             // chunks in flight per copy stream, -copydepth
+    unsigned queueDepth;
+    std::vector<unsigned> sweepBufSizes;
+    std::vector<unsigned> sweepDepths;
+    unsigned benchSeconds;
+    unsigned benchMBytes;
+    unsigned warmupSeconds;
+    unsigned offsetMB;
+    AccessPattern::Mode accessPattern;
+    unsigned strideBlocks;
+    double zipfTheta;
+    uint64 seed;
+    unsigned workingSetMB;
     uint32 openFlags;
     unsigned numThreads;
+    unsigned numWorkers;
+    VixDiskLibSectorType segmentSize;
+    bool perThreadConnection;
+    bool fileBackend;               // -backend file instead of VixDiskLib
+    bool backendGiven;              // -backend was given, ParseArguments installed it
+    FileBackendParams fileParams;
+    bool skipZero;
     bool success;
     bool isRemote;
     QString host;
@@ -130,6 +491,13 @@ struct WorkerConfig
     int port;
     int nfcHostPort;
     QString srcPath;
+    QString dstPath;
+    unsigned numStreams;
+    bool resume;
+    QString manifestPath;
+    QString baseManifestPath;
+    unsigned hashThreads;
+    unsigned idleTimeout;           // seconds a pooled connection outlives its last command
     VixDiskLibConnection connection;
     QString vmxSpec;
     bool useInitEx;
@@ -157,6 +525,13 @@ struct CharArWrapper                                                    //wrappe
     int size() { return text.size(); }
 };
 
+struct ConnectParamsWrapper                                              //VixDiskLibConnectParams of the source, pointing into the copies below
+{
+    CharArWrapper vmxSpec, serverName, userName, password, cookie, thumbPrint;
+    VixDiskLibConnectParams params;
+    explicit ConnectParamsWrapper(WorkerConfig &cfg);
+};
+
 class worker : public QThread
 {    
     Q_OBJECT
@@ -164,24 +539,65 @@ class worker : public QThread
     QThread *m_thread;
 
     static WorkerConfig appGlobals;
-    static VixDiskLibConnectParams cnxParams;                           //Connection setup parameters
     static bool bVixInit;
+    static ConnectionPool connPool;                                     //Source connections kept open across commands.
     friend class vixdisklibsamplegui;
     static void InitBuffer(uint32 *buf, uint32 numElems);               //Fill an array of uint32 with random values, to defeat any attempts to compress it.
+    static bool IsZeroBuffer(const uint8 *buf, size_t n);               //Checks whether n bytes are all zero.
 
+    static VixError Connect(VixDiskLibConnection &connection);          //Connects to the source given in appGlobals.
     static void PrepareThreadData(VixDiskLibConnection &dstConnection,  //Open the source and destination disk for multi threaded copy.
                                   ThreadData &td);
-    static void PrintStat(bool read, struct timeval start,              //Print performance statistics for read/write benchmarks.
-                          struct timeval end, uint32 numSectors);
+    static void PrintStat(bool read, uint64 start,                      //Print performance statistics for read/write benchmarks.
+                          uint64 end, uint64 numSectors);
+    static void PrintLatency(const LatencyHistogram &latency);          //Print latency percentiles for read/write benchmarks.
+    static void PrintSeed(void);                                        //Print the seed of random access patterns.
+    static void InitReport(BenchReport &report, const char *command,    //Records the benchmark configuration in a results report.
+                           VixDiskLibHandle handle);
+    static void WriteReport(const BenchReport &report);                 //Writes the results report to appGlobals.resultsFile.
     static void GenerateRandomFilename(const string& prefix,            //Generate and return a random filename.
                                        string& randomFilename);
-    static void gettimeofday(struct timeval *tv, void *);               //Mimics BSD style gettimeofday in a way that is close enough for some I/O benchmarking.
+    static uint64 GetTimeUsec(void);                                    //Monotonic high resolution time in usec for benchmarking.
     static void LogFunc(const char *fmt, va_list args);                 //Callback for VixDiskLib Log messages.
     static void WarnFunc(const char *fmt, va_list args);                //Callback for VixDiskLib Warning messages.
     static void PanicFunc(const char *fmt, va_list args);               //Callback for VixDiskLib Panic messages.
     static Bool CloneProgressFunc(void * /*progressData*/,
                                   int percentCompleted);
-    static unsigned __stdcall CopyThread(void *arg);                    //Copies a source disk to the given file.
+    static void CopyWorker(CopyJob &job, size_t id);                    //Copies segments handed out by the job's scheduler.
+    static void CopyExtent(CopyStream &stream, ThreadLock *dstLock,
+                           CopyJournal *journal, ChunkManifest *manifest,
+                           TaskExecutor *hashers);                      //Copies one stream's extent of a -copy.
+    static void AioBenchCB(void *cbData, VixError err);                 //Completion callback for async benchmark requests.
+    static void CopyCB(void *cbData, VixError err);                     //Completion callback for pipelined copy writes.
+    static void CopyHash(CopyRequest *req);                             //Hashes a copied chunk into the manifest.
+    static void CopyRelease(CopyRequest *req);                          //Completes a chunk once written and hashed.
+    static void IncrementalChunk(CopyRequest *req, VixDiskLibHandle dst,
+                                 ThreadLock *dstLock,
+                                 const ChunkManifest &base);            //Writes a chunk to the child if it changed.
+    static void VerifyChunk(VerifyJob &job, uint8 *buf, uint64 chunk,
+                            size_t bytes);                              //Compares a chunk's hash with the manifest.
+    static VixError CopyRange(VixDiskLibHandle srcHandle,               //Pipelined copy of a sector range in chunkSize pieces.
+                              VixDiskLibHandle dstHandle,
+                              VixDiskLibSectorType startSector,
+                              VixDiskLibSectorType numSectors,
+                              CopyStat &stat,
+                              ThreadLock *dstLock = NULL);
+    static VixError CopyWait(VixDiskLibHandle dstHandle,                //Waits for all chunks of a pipelined copy to be written.
+                             CopyStat &stat);
+    static AccessPattern NewPattern(VixDiskLibSectorType capacity,      //Access pattern over the working set from appGlobals.
+                                    uint64 &numBlocks,
+                                    VixDiskLibSectorType &firstSector);
+    static void VixDiskAsyncReadWrite(VixDiskLibHandle handle,          //Keeps queueDepth async requests in flight over the whole disk.
+                                      VixDiskLibSectorType capacity,
+                                      bool read, bool verbose,
+                                      BenchResult &result,
+                                      BenchReport *report = NULL);
+    static bool ParseList(const char *arg,                              //Parses a comma separated list of numbers.
+                          std::vector<unsigned> &list);
+    static bool SplitArgs(const string &line,                           //Splits a job file line into arguments.
+                          std::vector<string> &args);
+    void RunCommand(void);                                              //Runs appGlobals.command and returns its connection to the pool.
+    static void SwitchBackend(DiskBackend *backend);                    //Installs another disk library, NULL for the default one.
     int BitCount(int number);                                           //Counts all the bits set in an int.
 
 protected:
@@ -192,6 +608,7 @@ public:
     worker();
     ~worker();
     int ParseArguments(int argc, char* argv[]);                  //Parses the arguments passed on the command line.
+    int Execute(int argc, char* argv[]);                         //Parses the arguments and runs the command without the GUI.
     void DoInit(void);                                             //Initializes vixdisklib
     void DoCreate(void);                                         //Creates a virtual disk.
     void DoRedo(void);                                           //Creates a child disk.
@@ -203,10 +620,17 @@ public:
     void DoInfo(void);                                           //Queries the information of a virtual disk.
     void DoTestMultiThread(void);                                //Starts a given number of threads, each of which will copy the source disk to a temp. file.
     void DoClone(void);                                          //Clones a local disk (possibly to an ESX host).
-    void DumpBytes(const uint8 *buf, size_t n, int step);        //Displays an array of n bytes.
+    void DoCopy(void);                                           //Copies a disk to a local file with parallel streams.
+    void DoVerify(void);                                         //Checks a disk against a chunk manifest.
+    void DoIncremental(void);                                    //Writes changed chunks into a child disk.
+    void DoBatch(void);                                          //Runs the commands of a job file on pooled connections.
+    void DumpBytes(const uint8 *buf, size_t n, int step,         //Displays an array of n bytes.
+                   uint64 offset = 0);
     void DoRWBench(bool read);                                   //Perform read/write benchmarks
+    void DoAsyncBench(bool read);                                //Perform read/write benchmarks with async requests in flight
     void DoCheckRepair(Bool repair);                             //Check a sparse disk for internal consistency.
-    //void DoAsyncIO(bool read);                                   //?????????
+    void DoAsyncIO(bool read);                                   //Runs async benchmarks on all appGlobals.diskPaths concurrently
+    void DoSweepBench(bool read);                                //Runs async benchmarks over a matrix of block sizes and queue depths
     //helper methods
 
     int PrintUsage(void);                                        //Displays the usage message.
@@ -226,9 +650,9 @@ public:
           _file(file),
           _line(line)
     {
-        char* msg = VixDiskLib_GetErrorText(errCode, NULL);
+        char* msg = DiskLib().GetErrorText(errCode, NULL);
         _desc = msg;
-        VixDiskLib_FreeErrorText(msg);
+        DiskLib().FreeErrorText(msg);
     }
 
     VixDiskLibErrWrapper(const char* description, const char* file, int line)
@@ -262,12 +686,12 @@ public:
        : _id(id)
     {
        _handle = NULL;
-       VixError vixError = VixDiskLib_Open(connection, path, flags, &_handle);
+       VixError vixError = DiskLib().Open(connection, path, flags, &_handle);
        CHECK_AND_THROW(vixError);
        printf("Disk[%d] \"%s\" is opened using transport mode \"%s\".\n",
-              id, path, VixDiskLib_GetTransportMode(_handle));
+              id, path, DiskLib().GetTransportMode(_handle));
 
-       vixError = VixDiskLib_GetInfo(_handle, &_info);
+       vixError = DiskLib().GetInfo(_handle, &_info);
        CHECK_AND_THROW(vixError);
     }
 
@@ -284,8 +708,8 @@ public:
     ~VixDisk()
     {
         if (_handle) {
-           VixDiskLib_FreeInfo(_info);
-           VixDiskLib_Close(_handle);
+           DiskLib().FreeInfo(_info);
+           DiskLib().Close(_handle);
            printf("Disk[%d] is closed.\n", _id);
         }
         _info = NULL;
@@ -299,144 +723,164 @@ private:
 };
 
 
-template <bool C, typename T, typename F>
-struct IF_THEN_ELSE;
-
-template <typename T, typename F>
-struct IF_THEN_ELSE<true, T, F>
-{
-   typedef T result;
-};
-
-template <typename T, typename F>
-struct IF_THEN_ELSE<false, T, F>
+// Page-aligned memory for I/O buffers, straight from the OS so that
+// unbuffered, SAN and hotadd transfers need no bounce copies. With
+// largePages set, allocations are backed by huge/large pages when the OS
+// grants them (Windows needs the "Lock pages in memory" privilege) and
+// fall back to normal pages otherwise.
+struct IoMemory
 {
-   typedef F result;
-};
+   static bool largePages;
 
-template <int N>
-struct INT_TYPE
-{
-   enum {value = N};
-};
+   static bool EnableLargePages();
 
-template <typename T1, typename T2, typename N = INT_TYPE<1> >
-struct sizeT
-{
-   enum
+   static size_t PageSize()
    {
-      value = IF_THEN_ELSE<(sizeof(T1) > sizeof(T2[N::value])),
-                           sizeT<T1, T2, INT_TYPE<N::value+1> >,
-                           N>::result::value
-   };
-};
-
-class ThreadLock
-{
-   public:
-      ThreadLock()
-      {
 #ifdef _WIN32
-         InitializeCriticalSection(&cs);
-         //InitializeConditionVariable(&cond);
+      SYSTEM_INFO si;
+      GetSystemInfo(&si);
+      return si.dwPageSize;
 #else
-         pthread_mutex_init(&mutex, NULL);
-         pthread_cond_init(&cond, NULL);
-#endif
-      }
-      ~ThreadLock()
-      {
-#ifndef _WIN32
-         pthread_mutex_destroy(&mutex);
-         pthread_cond_destroy(&cond);
+      return (size_t)sysconf(_SC_PAGESIZE);
 #endif
+   }
+
+   // Size of a huge/large page as reported by the OS, 0 if it has none.
+   static size_t LargePageSize();
+
+   // Rounds bytes up to the allocation granularity.
+   static size_t RoundUp(size_t bytes, bool large)
+   {
+      size_t unit = large ? LargePageSize() : 0;
+      if (unit == 0) {
+         unit = PageSize();
       }
+      return (bytes + unit - 1) / unit * unit;
+   }
 
-      void lock()
-      {
+   // Allocates at least bytes; mapped receives the length actually
+   // reserved, which Free needs back whatever largePages is by then.
+   static void *Alloc(size_t bytes, size_t &mapped)
+   {
+      void *p = NULL;
 #ifdef _WIN32
-         EnterCriticalSection(&cs);
-#else
-         pthread_mutex_lock(&mutex);
-#endif
+      if (largePages && LargePageSize() != 0) {
+         mapped = RoundUp(bytes, true);
+         p = VirtualAlloc(NULL, mapped,
+                          MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                          PAGE_READWRITE);
       }
-      void unlock()
-      {
-#ifdef _WIN32
-         LeaveCriticalSection(&cs);
-#else
-         pthread_mutex_unlock(&mutex);
-#endif
+      if (p == NULL) {
+         mapped = RoundUp(bytes, false);
+         p = VirtualAlloc(NULL, mapped, MEM_COMMIT | MEM_RESERVE,
+                          PAGE_READWRITE);
       }
-      bool wait()
-      {
-#ifdef _WIN32
-         //SleepConditionVariableCS(&cond, &cs, INFINITE);
 #else
-         pthread_cond_wait(&cond, &mutex);
+#ifdef MAP_HUGETLB
+      if (largePages && LargePageSize() != 0) {
+         mapped = RoundUp(bytes, true);
+         p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+         if (p == MAP_FAILED) {
+            p = NULL;
+         }
+      }
+#endif
+      if (p == NULL) {
+         mapped = RoundUp(bytes, largePages);
+         p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+         if (p == MAP_FAILED) {
+            p = NULL;
+         }
+#ifdef MADV_HUGEPAGE
+         else if (largePages) {
+            madvise(p, mapped, MADV_HUGEPAGE);
+         }
 #endif
-         return true;
       }
-      void notify()
-      {
-#ifdef _WIN32
-         //WakeConditionVariable(&cond);
-#else
-         pthread_cond_signal(&cond);
 #endif
+      if (p == NULL) {
+         throw std::bad_alloc();
       }
-   private:
-      ThreadLock(const ThreadLock&);
-      ThreadLock& operator = (const ThreadLock&);
+      return p;
+   }
 
+   static void Free(void *p, size_t mapped)
+   {
+      if (p == NULL) {
+         return;
+      }
 #ifdef _WIN32
-      CRITICAL_SECTION cs;
-      CONDITION_VARIABLE cond;
+      (void)mapped;
+      VirtualFree(p, 0, MEM_RELEASE);
 #else
-      pthread_mutex_t mutex;
-      pthread_cond_t cond;
+      munmap(p, mapped);
 #endif
+   }
 };
 
-struct FakeLock
+// A single page-aligned I/O buffer.
+class IoBuffer
 {
-   void lock() {}
-   void unlock() {}
-   bool wait()
-   {
-      return false;
-   }
+   public:
+      explicit IoBuffer(size_t n)
+         : buf(static_cast<uint8*>(IoMemory::Alloc(n, mapped))), bytes(n)
+      {}
+
+      IoBuffer(size_t n, uint8 filler)
+         : buf(static_cast<uint8*>(IoMemory::Alloc(n, mapped))), bytes(n)
+      {
+         memset(buf, filler, n);
+      }
+
+      ~IoBuffer()
+      {
+         IoMemory::Free(buf, mapped);
+      }
+
+      uint8 *data() { return buf; }
+      size_t size() const { return bytes; }
+      uint8 &operator [] (size_t i) { return buf[i]; }
+
+   private:
+      IoBuffer(const IoBuffer&);
+      IoBuffer& operator = (const IoBuffer&);
 
-   void notify() {}
+      size_t mapped;                // set by Alloc before buf
+      uint8 *buf;
+      size_t bytes;
 };
 
-template <typename LCK>
-struct LockGuard
+// Usage counters of a BufferPool.
+struct BufferPoolStats
 {
-   explicit LockGuard(LCK& l)
-      : lock(l)
-   {
-      lock.lock();
-   }
-   ~LockGuard()
-   {
-      lock.unlock();
-   }
-   private:
-      LCK& lock;
+   uint64 gets;                     // buffers handed out
+   uint64 waits;                    // getBuffer calls that found the pool empty
+   size_t highWater;                // most buffers out at the same time
 };
 
+// Fixed-capacity pool of up to SIZE buffers carved out of a single
+// page-aligned IoMemory arena; the constructor can ask for fewer, e.g.
+// just the queue depth, so that only those are allocated. Every buffer
+// starts on a sector boundary, and on a page boundary if it is at least
+// a page long. TYPE must be a plain type. Free buffers are kept on a
+// lock-free stack of slab indices, so getBuffer and returnBuffer never
+// take a lock while buffers are available and are safe to call from
+// VixDiskLib completion callbacks. LOCK is only used to sleep in
+// getBuffer when the pool is empty (FakeLock returns NULL instead) and
+// in the destructor until every buffer is back.
 template <size_t SIZE, typename TYPE = char, typename LOCK = FakeLock>
 class BufferPool : private LOCK
 {
-   typedef std::list<TYPE*> Pool;
-   typedef typename Pool::iterator PoolIt;
+   enum { NIL = 0xffffffff };
+   static const size_t CLOSING = ~((size_t)-1 >> 1);   // outstanding bit set by the destructor
    public:
       typedef TYPE type;
 
-      explicit BufferPool(size_t bufSize)
+      explicit BufferPool(size_t bufSize, size_t count = SIZE)
       {
-         initPool(bufSize);
+         initPool(bufSize, count);
       }
 
 #if __cplusplus > 199711L
@@ -447,84 +891,172 @@ class BufferPool : private LOCK
          : LOCK(lock)
 #endif
       {
-         initPool(bufSize);
+         initPool(bufSize, SIZE);
       }
 
       ~BufferPool()
       {
          {
             LockGrd lg(*this);
-            while (!outPool.empty()) {
+            outstanding.fetch_or(CLOSING);
+            while ((outstanding.load() & ~CLOSING) != 0) {
                if (!LOCK::wait()) {
                   break;
                }
             }
          }
-         std::for_each(inPool.begin(), inPool.end(), freeBuffer());
-         std::for_each(outPool.begin(), outPool.end(), freeBuffer());
+         IoMemory::Free(slab, mapped);
       }
 
       size_t size()
       {
-         return SIZE;
+         return capacity;
       }
 
       TYPE * getBuffer()
       {
-         TYPE * buf = NULL;
-         {
+         uint32 idx = pop();
+         if (idx == NIL) {
             LockGrd lg(*this);
-            while (inPool.empty()) {
+            ++waitCount;
+            // Register as a waiter before the final check so that a
+            // concurrent returnBuffer either sees us or we see its buffer.
+            ++waiters;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while ((idx = pop()) == NIL) {
                if (!LOCK::wait()) {
-                  return buf;
+                  break;
                }
             }
-            PoolIt it = inPool.begin();
-            outPool.splice(outPool.end(), inPool, it);
-            buf = &(*it)[sizeT<PoolIt, TYPE>::value];
+            --waiters;
+            if (idx == NIL) {
+               return NULL;
+            }
          }
-         return buf;
+         ++getCount;
+         ++outstanding;
+         size_t out = ++inUse;
+         size_t high = highWater.load(std::memory_order_relaxed);
+         while (out > high &&
+                !highWater.compare_exchange_weak(high, out,
+                                                 std::memory_order_relaxed)) {
+         }
+         return slab + (size_t)idx * stride;
       }
       void returnBuffer(TYPE * buf)
       {
-         PoolIt it =
-            *(reinterpret_cast<PoolIt*>(buf-sizeT<PoolIt, TYPE>::value));
-         {
+         // inUse drops before the slot is free again so that it never
+         // exceeds the capacity. Our outstanding count keeps the pool
+         // alive until release(), the last access.
+         --inUse;
+         push((uint32)((buf - slab) / stride));
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (waiters.load() != 0) {
             LockGrd lg(*this);
-            inPool.splice(inPool.end(), outPool, it);
+            LOCK::notifyAll();
          }
-         LOCK::notify();
+         release();
+      }
+
+      BufferPoolStats stats() const
+      {
+         BufferPoolStats st;
+         st.gets = getCount.load();
+         st.waits = waitCount.load();
+         st.highWater = highWater.load();
+         return st;
       }
    private:
+      BufferPool(const BufferPool&);
+      BufferPool& operator = (const BufferPool&);
+
+      void initPool(size_t bufSize, size_t count)
+      {
+         size_t bytes = bufSize * sizeof(TYPE);
+         size_t align = bytes >= IoMemory::PageSize() ?
+                        IoMemory::PageSize() : VIXDISKLIB_SECTOR_SIZE;
+
+         capacity = count == 0 ? 1 : count > SIZE ? SIZE : count;
+         stride = (bytes + align - 1) / align * align / sizeof(TYPE);
+         slab = static_cast<TYPE*>(IoMemory::Alloc(stride * capacity * sizeof(TYPE),
+                                                    mapped));
+         for (size_t i = 0; i < capacity; ++i) {
+            next[i].store(i + 1 < capacity ? (uint32)(i + 1) : (uint32)NIL,
+                          std::memory_order_relaxed);
+         }
+         head.store(0);
+         outstanding.store(0);
+         inUse.store(0);
+         waiters.store(0);
+         getCount.store(0);
+         waitCount.store(0);
+         highWater.store(0);
+      }
 
-      void initPool(size_t bufSize)
-      {
-         for (int i = 0 ; i < SIZE ; ++i) {
-            try {
-               std::auto_ptr<TYPE> buf(new TYPE[bufSize + sizeT<PoolIt, TYPE>::value]);
-               inPool.push_front(buf.get());
-               PoolIt * it = reinterpret_cast<PoolIt*>(buf.get());
-               *it = inPool.begin();
-               buf.release();
-            } catch (...) {
-               std::for_each(inPool.begin(), inPool.end(), freeBuffer());
-               throw;
+      // Drops outstanding. Without a lock while the pool is not closing;
+      // once the destructor has set CLOSING, under the lock with a wakeup
+      // so that the destructor cannot free the pool in between.
+      void release()
+      {
+         size_t old = outstanding.load();
+         while ((old & CLOSING) == 0) {
+            if (outstanding.compare_exchange_weak(old, old - 1)) {
+               return;
             }
          }
+         LockGrd lg(*this);
+         --outstanding;
+         LOCK::notifyAll();
       }
 
-      struct freeBuffer
+      // head holds the index of the top free slot in its low 32 bits and
+      // a tag bumped by every pop in its high 32 bits to defeat ABA.
+      uint32 pop()
       {
-         void operator () (TYPE* buf) const
-         {
-            delete[] buf;
+         uint64 old = head.load(std::memory_order_acquire);
+         for (;;) {
+            uint32 idx = (uint32)old;
+            if (idx == NIL) {
+               return NIL;
+            }
+            uint64 tag = (old >> 32) + 1;
+            uint64 top = (tag << 32) | next[idx].load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(old, top,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_acquire)) {
+               return idx;
+            }
          }
-      };
+      }
+
+      void push(uint32 idx)
+      {
+         uint64 old = head.load(std::memory_order_relaxed);
+         for (;;) {
+            next[idx].store((uint32)old, std::memory_order_relaxed);
+            uint64 top = (old & 0xffffffff00000000ULL) | idx;
+            if (head.compare_exchange_weak(old, top,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+               return;
+            }
+         }
+      }
 
       typedef LockGuard<LOCK> LockGrd;
 
-      Pool inPool;
-      Pool outPool;
+      TYPE *slab;
+      size_t mapped;                // length of the slab's mapping
+      size_t stride;
+      size_t capacity;              // buffers in the slab, at most SIZE
+      std::atomic<uint32> next[SIZE];
+      std::atomic<uint64> head;
+      std::atomic<size_t> outstanding;
+      std::atomic<size_t> inUse;
+      std::atomic<uint32> waiters;
+      std::atomic<uint64> getCount;
+      std::atomic<uint64> waitCount;
+      std::atomic<size_t> highWater;
 };
 
 // specialization for unlimited size buffer pool
@@ -561,6 +1093,12 @@ class BufferPool<-1, TYPE, LOCK>
 
 typedef BufferPool<VIX_AIO_BUFPOOL_SIZE, uint8, ThreadLock> AioBufferPool;
 
+#ifndef VIX_COPY_BUFPOOL_SIZE
+#define VIX_COPY_BUFPOOL_SIZE 8
+#endif
+
+typedef BufferPool<VIX_COPY_BUFPOOL_SIZE, uint8, ThreadLock> CopyBufferPool;
+
 template <typename Pool>
 class AioCBData
 {
@@ -597,6 +1135,619 @@ static void AioCB(void * cbData, VixError err)
 #endif
 }
 
+// Shared accounting for the requests an async benchmark keeps in flight.
+struct AioBenchStat
+{
+   AioBenchStat(uint32 depth)
+      : queueDepth(depth), inFlight(0), ops(0), sectors(0), measureFrom(0),
+        error(VIX_OK)
+   {}
+
+   uint32 queueDepth;
+   uint32 inFlight;
+   uint64 ops;
+   uint64 sectors;
+   uint64 measureFrom;              // requests submitted earlier are warmup
+   LatencyHistogram latency;        // usec, since the last interval report
+   VixError error;
+   ThreadLock lock;
+
+   // Waits for a free slot and claims it; false if a request failed.
+   bool acquire()
+   {
+      LockGuard<ThreadLock> lg(lock);
+      while (inFlight >= queueDepth) {
+         lock.wait();
+      }
+      if (VIX_FAILED(error)) {
+         return false;
+      }
+      ++inFlight;
+      return true;
+   }
+
+   // Waits until every claimed slot has completed.
+   void drain()
+   {
+      LockGuard<ThreadLock> lg(lock);
+      while (inFlight != 0) {
+         lock.wait();
+      }
+   }
+};
+
+// Completion context for a single async benchmark request. Requests
+// that write from a shared, unpooled buffer carry no AioCBData.
+struct AioBenchRequest
+{
+   AioBenchRequest(AioBufferPool::type * buf, AioBufferPool& pool,
+                   AioBenchStat& st, VixDiskLibSectorType n)
+      : cbData(new AioCBData<AioBufferPool>(buf, pool)), stat(st), numSectors(n)
+   {}
+
+   AioBenchRequest(AioBenchStat& st, VixDiskLibSectorType n)
+      : cbData(NULL), stat(st), numSectors(n)
+   {}
+
+   ~AioBenchRequest()
+   {
+      delete cbData;
+   }
+
+   AioCBData<AioBufferPool> *cbData;
+   AioBenchStat& stat;
+   VixDiskLibSectorType numSectors;
+   uint64 submitted;                // usec, see worker::GetTimeUsec
+};
+
+// Per-chunk content hashes of a disk, written by -copy -manifest and
+// checked by -verify. The manifest is a text file: a few "key value"
+// header lines, then one "index startSector numSectors hash" line per
+// chunk with the hash in hex.
+class ChunkManifest
+{
+   public:
+      ChunkManifest()
+         : capacity(0), chunkSize(0)
+      {}
+
+      void init(const std::string &diskPath, uint64 cap, uint64 chunk)
+      {
+         disk = diskPath;
+         capacity = cap;
+         chunkSize = chunk;
+         hashes.assign((size_t)((cap + chunk - 1) / chunk), 0);
+         present.assign(hashes.size(), 0);
+      }
+
+      uint64 chunks() const
+      {
+         return hashes.size();
+      }
+
+      const std::string &diskPath() const
+      {
+         return disk;
+      }
+
+      uint64 diskCapacity() const
+      {
+         return capacity;
+      }
+
+      uint64 chunkSectors() const
+      {
+         return chunkSize;
+      }
+
+      bool has(uint64 chunk) const
+      {
+         return present[(size_t)chunk] != 0;
+      }
+
+      uint64 hash(uint64 chunk) const
+      {
+         return hashes[(size_t)chunk];
+      }
+
+      // Chunks are set by different hashing threads, never the same one
+      // twice at a time, so no lock is needed.
+      void set(uint64 chunk, uint64 h)
+      {
+         hashes[(size_t)chunk] = h;
+         present[(size_t)chunk] = 1;
+      }
+
+      bool write(const std::string &path) const
+      {
+         std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
+         if (!out) {
+            return false;
+         }
+         out << "# chunk manifest\n"
+             << "disk " << disk << "\n"
+             << "capacity " << capacity << "\n"
+             << "chunksize " << chunkSize << "\n"
+             << "hash " << HASH_NAME << "\n";
+         for (size_t c = 0; c < hashes.size(); ++c) {
+            uint64 start = c * chunkSize;
+            out << c << " " << start << " "
+                << std::min(chunkSize, capacity - start) << " "
+                << std::hex << std::setw(16) << std::setfill('0') << hashes[c]
+                << std::dec << "\n";
+         }
+         out.close();
+         return !out.fail();
+      }
+
+      bool read(const std::string &path)
+      {
+         std::ifstream in(path.c_str());
+         std::string line, key, hashName;
+         uint64 c, start, count, h;
+
+         capacity = chunkSize = 0;
+         hashes.clear();
+         present.clear();
+         while (std::getline(in, line)) {
+            std::istringstream ls(line);
+            if (line.empty() || line[0] == '#') {
+               continue;
+            }
+            if (!isdigit((unsigned char)line[0])) {
+               ls >> key;
+               if (key == "disk") {
+                  std::getline(ls >> std::ws, disk);
+               } else if (key == "capacity") {
+                  ls >> capacity;
+               } else if (key == "chunksize") {
+                  ls >> chunkSize;
+               } else if (key == "hash") {
+                  ls >> hashName;
+               }
+               continue;
+            }
+            if (hashes.empty()) {
+               if (capacity == 0 || chunkSize == 0 || hashName != HASH_NAME) {
+                  return false;
+               }
+               init(disk, capacity, chunkSize);
+            }
+            if (!(ls >> c >> start >> count >> std::hex >> h) ||
+                c >= hashes.size()) {
+               return false;
+            }
+            set(c, h);
+         }
+         return !hashes.empty();
+      }
+
+      // XXH64 with seed 0: a fast non-cryptographic hash that keeps four
+      // independent lanes busy, so a core hashes several GB/s.
+      static uint64 Hash(const uint8 *p, size_t n)
+      {
+         const uint8 *end = p + n;
+         uint64 h;
+
+         if (n >= 32) {
+            const uint8 *limit = end - 32;
+            uint64 v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+            do {
+               v1 = Round(v1, Read64(p));
+               v2 = Round(v2, Read64(p + 8));
+               v3 = Round(v3, Read64(p + 16));
+               v4 = Round(v4, Read64(p + 24));
+               p += 32;
+            } while (p <= limit);
+            h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+            h = Merge(h, v1);
+            h = Merge(h, v2);
+            h = Merge(h, v3);
+            h = Merge(h, v4);
+         } else {
+            h = P5;
+         }
+         h += n;
+         for (; p + 8 <= end; p += 8) {
+            h ^= Round(0, Read64(p));
+            h = Rotl(h, 27) * P1 + P4;
+         }
+         if (p + 4 <= end) {
+            uint32 k;
+            memcpy(&k, p, sizeof k);
+            h ^= (uint64)k * P1;
+            h = Rotl(h, 23) * P2 + P3;
+            p += 4;
+         }
+         for (; p < end; ++p) {
+            h ^= *p * P5;
+            h = Rotl(h, 11) * P1;
+         }
+         h ^= h >> 33;
+         h *= P2;
+         h ^= h >> 29;
+         h *= P3;
+         h ^= h >> 32;
+         return h;
+      }
+
+   private:
+      static const uint64 P1 = 11400714785074694791ULL;
+      static const uint64 P2 = 14029467366897019727ULL;
+      static const uint64 P3 = 1609587929392839161ULL;
+      static const uint64 P4 = 9650029242287828579ULL;
+      static const uint64 P5 = 2870177450012600261ULL;
+      static const char HASH_NAME[];
+
+      static uint64 Rotl(uint64 x, int r)
+      {
+         return (x << r) | (x >> (64 - r));
+      }
+
+      static uint64 Read64(const uint8 *p)
+      {
+         uint64 v;
+         memcpy(&v, p, sizeof v);
+         return v;
+      }
+
+      static uint64 Round(uint64 acc, uint64 input)
+      {
+         acc += input * P2;
+         return Rotl(acc, 31) * P1;
+      }
+
+      static uint64 Merge(uint64 acc, uint64 v)
+      {
+         acc ^= Round(0, v);
+         return acc * P1 + P4;
+      }
+
+      std::string disk;
+      uint64 capacity;
+      uint64 chunkSize;
+      std::vector<uint64> hashes;
+      std::vector<char> present;
+};
+
+// Checkpoint journal of a resumable copy, kept next to the destination
+// as "<dest>.journal". A header identifies the copy by the source's
+// path, first chunk, capacity and chunk size, followed by one bit
+// per chunk and one 32 bit checksum per chunk. A chunk's bit and
+// checksum are written only after its write has completed, so after an
+// interruption every marked chunk is on the destination and can be
+// verified against its checksum without reading the source again.
+class CopyJournal
+{
+   public:
+      CopyJournal()
+         : file(NULL), capacity(0), chunkSize(0), numChunks(0), numDone(0),
+           existing(false)
+      {}
+
+      ~CopyJournal()
+      {
+         close();
+      }
+
+      // Opens the journal at path, or creates it. An existing journal
+      // of a different source, first chunk hash, capacity or chunk size
+      // is discarded. Returns false if the file cannot be written.
+      bool open(const std::string &journalPath, const std::string &source,
+                uint64 firstChunkHash, uint64 cap, uint64 chunk)
+      {
+         uint64 sourceHash = ChunkManifest::Hash((const uint8*)source.data(),
+                                                 source.size());
+         Header hdr;
+
+         close();
+         existing = false;
+         path = journalPath;
+         capacity = cap;
+         chunkSize = chunk;
+         numChunks = (cap + chunk - 1) / chunk;
+         bitmap.assign((size_t)((numChunks + 7) / 8), 0);
+         sums.assign((size_t)numChunks, 0);
+         numDone = 0;
+
+         file = fopen(path.c_str(), "r+b");
+         if (file != NULL) {
+            if (fread(&hdr, sizeof hdr, 1, file) == 1 &&
+                memcmp(hdr.magic, MAGIC, sizeof hdr.magic) == 0 &&
+                hdr.capacity == capacity && hdr.chunkSize == chunkSize &&
+                hdr.sourceHash == sourceHash &&
+                hdr.firstChunkHash == firstChunkHash &&
+                fread(&bitmap[0], 1, bitmap.size(), file) == bitmap.size() &&
+                fread(&sums[0], sizeof sums[0], sums.size(), file) == sums.size()) {
+               for (uint64 c = 0; c < numChunks; ++c) {
+                  numDone += isDone(c);
+               }
+               existing = true;
+               return true;
+            }
+            fclose(file);
+            bitmap.assign(bitmap.size(), 0);
+            sums.assign(sums.size(), 0);
+         }
+
+         file = fopen(path.c_str(), "w+b");
+         if (file == NULL) {
+            return false;
+         }
+         memcpy(hdr.magic, MAGIC, sizeof hdr.magic);
+         hdr.capacity = capacity;
+         hdr.chunkSize = chunkSize;
+         hdr.sourceHash = sourceHash;
+         hdr.firstChunkHash = firstChunkHash;
+         return fwrite(&hdr, sizeof hdr, 1, file) == 1 &&
+                fwrite(&bitmap[0], 1, bitmap.size(), file) == bitmap.size() &&
+                fwrite(&sums[0], sizeof sums[0], sums.size(), file) == sums.size() &&
+                fflush(file) == 0;
+      }
+
+      void close()
+      {
+         if (file != NULL) {
+            fclose(file);
+            file = NULL;
+         }
+      }
+
+      // Closes and deletes the journal once the copy is complete.
+      void remove()
+      {
+         close();
+         ::remove(path.c_str());
+      }
+
+      uint64 chunks() const
+      {
+         return numChunks;
+      }
+
+      uint64 done() const
+      {
+         return numDone;
+      }
+
+      // Whether open found the journal of this copy, even one that has
+      // no chunk checkpointed yet.
+      bool resumed() const
+      {
+         return existing;
+      }
+
+      bool isDone(uint64 chunk) const
+      {
+         return (bitmap[(size_t)(chunk / 8)] >> (chunk % 8)) & 1;
+      }
+
+      uint32 checksum(uint64 chunk) const
+      {
+         return sums[(size_t)chunk];
+      }
+
+      // Records a completed chunk and writes it through to the file.
+      bool markDone(uint64 chunk, uint32 sum)
+      {
+         return update(chunk, true, sum);
+      }
+
+      // Forgets a chunk that failed verification.
+      bool clear(uint64 chunk)
+      {
+         return update(chunk, false, 0);
+      }
+
+      static uint32 Checksum(const uint8 *buf, size_t n)
+      {
+         return Fold(ChunkManifest::Hash(buf, n));
+      }
+
+      // The journal keeps the low half of the chunk's manifest hash.
+      static uint32 Fold(uint64 hash)
+      {
+         return (uint32)hash;
+      }
+
+   private:
+      struct Header {
+         char magic[8];
+         uint64 capacity;
+         uint64 chunkSize;
+         uint64 sourceHash;         // ChunkManifest::Hash of the source path
+         uint64 firstChunkHash;     // ChunkManifest::Hash of the source's first chunk
+      };
+
+      static const char MAGIC[8];
+
+      bool update(uint64 chunk, bool done, uint32 sum)
+      {
+         size_t byte = (size_t)(chunk / 8);
+         bool ok;
+
+         LockGuard<ThreadLock> lg(lock);
+         if (isDone(chunk) != done) {
+            numDone += done ? 1 : -1;
+         }
+         if (done) {
+            bitmap[byte] |= (uint8)(1 << (chunk % 8));
+         } else {
+            bitmap[byte] &= (uint8)~(1 << (chunk % 8));
+         }
+         sums[(size_t)chunk] = sum;
+
+         // The checksum goes out before the bit that makes it valid.
+         ok = fseek(file, (long)(sizeof(Header) + bitmap.size() +
+                                 chunk * sizeof(uint32)), SEEK_SET) == 0 &&
+              fwrite(&sums[(size_t)chunk], sizeof(uint32), 1, file) == 1 &&
+              fseek(file, (long)(sizeof(Header) + byte), SEEK_SET) == 0 &&
+              fwrite(&bitmap[byte], 1, 1, file) == 1 &&
+              fflush(file) == 0;
+         return ok;
+      }
+
+      std::string path;
+      FILE *file;
+      uint64 capacity;
+      uint64 chunkSize;
+      uint64 numChunks;
+      uint64 numDone;
+      bool existing;
+      std::vector<uint8> bitmap;
+      std::vector<uint32> sums;
+      ThreadLock lock;
+};
+
+// State of one pipelined copy: its buffers and the chunks in flight.
+struct CopyStat
+{
+   CopyStat(size_t chunkBytes, uint32 depth, bool skip = false,
+            CopyJournal *jrnl = NULL, ChunkManifest *mf = NULL,
+            TaskExecutor *hashers = NULL)
+      : pool(chunkBytes), maxInFlight(depth), inFlight(0), skipZero(skip),
+        sectors(0), skipped(0), resumed(0), journal(jrnl), manifest(mf),
+        hasher(hashers), error(VIX_OK)
+   {}
+
+   CopyBufferPool pool;
+   uint32 maxInFlight;
+   uint32 inFlight;
+   bool skipZero;                   // don't write all-zero chunks (sparse destination)
+   uint64 sectors;                  // sectors written so far
+   uint64 skipped;                  // sectors of all-zero chunks skipped so far
+   uint64 resumed;                  // sectors verified as already copied
+   CopyJournal *journal;            // checkpoints completed chunks, may be NULL
+   ChunkManifest *manifest;         // receives chunk hashes, may be NULL
+   TaskExecutor *hasher;            // hashes chunks for manifest
+   VixError error;
+   ThreadLock lock;
+};
+
+// Completion context for a single chunk write of a pipelined copy. With
+// a manifest the chunk is also hashed, and whichever of the write and
+// the hash finishes last completes the request.
+struct CopyRequest
+{
+   CopyRequest(CopyBufferPool::type * b, CopyStat& st,
+               VixDiskLibSectorType n)
+      : cbData(b, st.pool), buf(b), stat(st), numSectors(n), skipped(false),
+        resumed(false), chunk(0), checksum(0), refs(1), error(VIX_OK)
+   {}
+
+   AioCBData<CopyBufferPool> cbData;
+   const uint8 *buf;
+   CopyStat& stat;
+   VixDiskLibSectorType numSectors;
+   bool skipped;                    // chunk was all zeros and not written
+   bool resumed;                    // chunk was verified on the destination
+   uint64 chunk;                    // journal and manifest chunk index
+   uint32 checksum;                 // journal checksum of the data
+   std::atomic<int> refs;           // pending write and hash
+   VixError error;                  // result of the write
+};
+
+// State of a -verify: chunk buffers in the hands of the hashing threads
+// and the chunks whose hash did not match the manifest.
+struct VerifyJob
+{
+   VerifyJob(const ChunkManifest &mf)
+      : pool(mf.chunkSectors() * VIXDISKLIB_SECTOR_SIZE), manifest(mf),
+        verified(0)
+   {}
+
+   CopyBufferPool pool;
+   const ChunkManifest &manifest;
+   uint64 verified;                 // chunks hashed so far
+   std::vector<uint64> mismatches;
+   ThreadLock lock;
+};
+
+// A piece of one disk of a -multithread copy.
+struct CopySegment
+{
+   size_t disk;                     // index into CopyJob::disks
+   VixDiskLibSectorType start;
+   VixDiskLibSectorType count;
+};
+
+// Work-stealing scheduler: every worker takes segments from the front of
+// its own queue and, once that is empty, steals from the back of the
+// other workers' queues, so idle workers help with the largest disks.
+class ChunkScheduler
+{
+   public:
+      explicit ChunkScheduler(size_t workers)
+         : queues(workers), steals(workers, 0)
+      {}
+
+      size_t workers() const
+      {
+         return queues.size();
+      }
+
+      void add(size_t worker, const CopySegment &seg)
+      {
+         LockGuard<ThreadLock> lg(queues[worker].lock);
+         queues[worker].segments.push_back(seg);
+      }
+
+      bool next(size_t worker, CopySegment &seg)
+      {
+         size_t n = queues.size();
+         for (size_t k = 0; k < n; ++k) {
+            Queue &q = queues[(worker + k) % n];
+            LockGuard<ThreadLock> lg(q.lock);
+            if (q.segments.empty()) {
+               continue;
+            }
+            if (k == 0) {
+               seg = q.segments.front();
+               q.segments.pop_front();
+            } else {
+               seg = q.segments.back();
+               q.segments.pop_back();
+               ++steals[worker];
+            }
+            return true;
+         }
+         return false;
+      }
+
+      // Only meaningful once the worker is done.
+      uint64 stolen(size_t worker) const
+      {
+         return steals[worker];
+      }
+
+   private:
+      struct Queue
+      {
+         ThreadLock lock;
+         std::deque<CopySegment> segments;
+      };
+
+      std::vector<Queue> queues;
+      std::vector<uint64> steals;   // written only by the owning worker
+};
+
+// Shared state of a -multithread copy.
+struct CopyJob
+{
+   CopyJob(std::vector<ThreadData> &d, size_t workers)
+      : disks(d), dstLocks(d.size()), scheduler(workers),
+        segments(workers, 0), sectors(workers, 0), start(0), error(VIX_OK)
+   {}
+
+   std::vector<ThreadData> &disks;
+   std::vector<ThreadLock> dstLocks;    // one writer at a time per destination handle
+   ChunkScheduler scheduler;
+   std::vector<uint64> segments;        // per worker, written only by that worker
+   std::vector<uint64> sectors;
+   uint64 start;                        // usec, see worker::GetTimeUsec
+   VixError error;                      // first error, under lock
+   ThreadLock lock;                     // protects error and the ThreadData totals
+};
 
 class TaskExecutor
 {
@@ -626,7 +1777,28 @@ class TaskExecutor
          m_ioService.post(t);
       }
 
+      // Runs t once delay has passed. No thread is tied up until then;
+      // the destructor still waits for it.
+      template <typename Task>
+      void addTask(Task t, boost::posix_time::time_duration delay) {
+         TimedTask<Task> timed = {
+            boost::shared_ptr<boost::asio::deadline_timer>(
+               new boost::asio::deadline_timer(m_ioService, delay)),
+            t
+         };
+         timed.timer->async_wait(timed);
+      }
+
    private:
+      // Keeps the timer alive until it fires.
+      template <typename Task>
+      struct TimedTask {
+         boost::shared_ptr<boost::asio::deadline_timer> timer;
+         Task task;
+
+         void operator()(const boost::system::error_code &) { task(); }
+      };
+
       boost::asio::io_service m_ioService;
       boost::shared_ptr<boost::asio::io_service::work> m_work;
       std::vector<boost::shared_ptr<boost::thread> > m_threads;